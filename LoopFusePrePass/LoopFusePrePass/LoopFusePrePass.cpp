@@ -46,27 +46,48 @@
   
 #include "llvm/Transforms/Scalar/LoopFuse.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/Delinearization.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
 #include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/Loads.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/InitializePasses.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CheckedArithmetic.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Signals.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/CodeMoverUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/LoopPeel.h"
+#include "llvm/Transforms/Utils/LoopRotationUtils.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 #include <iostream>
 #include <unordered_map>
 #include <utility>
@@ -75,7 +96,38 @@ using namespace llvm;
   
 #define DEBUG_TYPE "loop-fusion"
   
-STATISTIC(FuseCounter, "Loops fused");
+// Statistics that are also the reason of a decision on a candidate or a pair
+// of candidates, see reportInvalidCandidate and reportLoopFusion. They are
+// listed here so that their descriptions stay available to the trace when
+// statistics are disabled (see getTraceReason).
+#define FUSION_REASONS(REASON)                                                 \
+  REASON(FuseCounter, "Loops fused")                                           \
+  REASON(AddressTakenBB, "Basic block has address taken")                      \
+  REASON(MayThrowException, "Loop may throw an exception")                     \
+  REASON(ContainsVolatileAccess, "Loop contains a volatile access")            \
+  REASON(NotSimplifiedForm, "Loop is not in simplified form")                  \
+  REASON(InvalidDependencies, "Dependencies prevent fusion")                   \
+  REASON(UnknownTripCount, "Loop has unknown trip count")                      \
+  REASON(NonEqualTripCount, "Loop trip counts are not the same")               \
+  REASON(NonAdjacent, "Loops are not adjacent")                                \
+  REASON(NonEmptyPreheader, "Loop has a non-empty preheader with "             \
+                            "instructions that cannot be moved")               \
+  REASON(FusionNotBeneficial, "Fusion is not beneficial")                      \
+  REASON(NonIdenticalGuards, "Candidates have different guards")               \
+  REASON(NonEmptyExitBlock, "Candidate has a non-empty exit block with "       \
+                            "instructions that cannot be moved")               \
+  REASON(NonEmptyGuardBlock, "Candidate has a non-empty guard block with "     \
+                             "instructions that cannot be moved")              \
+  REASON(NotRotated, "Candidate is not rotated")                               \
+  REASON(OnlySecondCandidateIsGuarded,                                         \
+         "The second candidate is guarded while the first one is not")         \
+  REASON(OnlyFirstCandidateIsGuarded,                                          \
+         "The first candidate is guarded while the second one is not")
+
+#define DECLARE_REASON(VARNAME, DESC) STATISTIC(VARNAME, DESC);
+FUSION_REASONS(DECLARE_REASON)
+#undef DECLARE_REASON
+
 STATISTIC(NumFusionCandidates, "Number of candidates for loop fusion");
 STATISTIC(InvalidPreheader, "Loop has invalid preheader");
 STATISTIC(InvalidHeader, "Loop has invalid header");
@@ -83,31 +135,58 @@ STATISTIC(InvalidExitingBlock, "Loop has invalid exiting blocks");
 STATISTIC(InvalidExitBlock, "Loop has invalid exit block");
 STATISTIC(InvalidLatch, "Loop has invalid latch");
 STATISTIC(InvalidLoop, "Loop is invalid");
-STATISTIC(AddressTakenBB, "Basic block has address taken");
-STATISTIC(MayThrowException, "Loop may throw an exception");
-STATISTIC(ContainsVolatileAccess, "Loop contains a volatile access");
-STATISTIC(NotSimplifiedForm, "Loop is not in simplified form");
-STATISTIC(InvalidDependencies, "Dependencies prevent fusion");
-STATISTIC(UnknownTripCount, "Loop has unknown trip count");
 STATISTIC(UncomputableTripCount, "SCEV cannot compute trip count of loop");
-STATISTIC(NonEqualTripCount, "Loop trip counts are not the same");
-STATISTIC(NonAdjacent, "Loops are not adjacent");
-STATISTIC(
-    NonEmptyPreheader,
-    "Loop has a non-empty preheader with instructions that cannot be moved");
-STATISTIC(FusionNotBeneficial, "Fusion is not beneficial");
-STATISTIC(NonIdenticalGuards, "Candidates have different guards");
-STATISTIC(NonEmptyExitBlock, "Candidate has a non-empty exit block with "
-                              "instructions that cannot be moved");
-STATISTIC(NonEmptyGuardBlock, "Candidate has a non-empty guard block with "
-                              "instructions that cannot be moved");
-STATISTIC(NotRotated, "Candidate is not rotated");
-STATISTIC(OnlySecondCandidateIsGuarded,
-          "The second candidate is guarded while the first one is not");
+STATISTIC(PrepassCommitted, "for-if-for rewrites committed");
+STATISTIC(PrepassRolledBack,
+          "for-if-for rewrites rolled back as their loops were not fused");
+STATISTIC(GuardsVersioned, "for-if-for guards versioned");
+STATISTIC(VersioningSizeGrowth, "Instructions added by guard versioning");
+STATISTIC(GuardsIfConverted, "In-loop guards if-converted after fusion");
+STATISTIC(ChainsFused, "Chains of more than two loops fused at once");
+STATISTIC(ImpliedGuardsRemoved,
+          "Guards of candidates paired with unguarded ones removed as implied");
+STATISTIC(InterveningCodeMoved,
+          "Code between candidates moved to make them adjacent");
+STATISTIC(InterveningLoopsMoved,
+          "Loops moved out of the way of fusion candidates");
+STATISTIC(SecondLoopsPeeled,
+          "Second candidates with more iterations peeled for fusion");
+STATISTIC(IndexSetsSplit,
+          "Candidates split into a part that is fused and a remainder loop");
+STATISTIC(LoopsAligned,
+          "Pairs of candidates aligned for dependences of negative distance");
+STATISTIC(TripCountsVersioned,
+          "Pairs of candidates versioned on their trip counts being equal");
+STATISTIC(AliasChecksVersioned,
+          "Pairs of candidates versioned on runtime alias checks");
+STATISTIC(RuntimeAliasChecks,
+          "Runtime checks for overlapping accesses emitted");
+STATISTIC(RuntimeVersioningGrowth,
+          "Instructions added by versioning on runtime checks");
+STATISTIC(GuardRegionsMerged,
+          "Consecutive if-regions with equivalent conditions merged");
+
+// All statistics of the pass. A round that is rolled back restores them, as
+// it restores the function (see runRound).
+static Statistic *const AllStatistics[] = {
+#define REASON_ADDRESS(VARNAME, DESC) &VARNAME,
+    FUSION_REASONS(REASON_ADDRESS)
+#undef REASON_ADDRESS
+    &NumFusionCandidates,     &InvalidPreheader,       &InvalidHeader,
+    &InvalidExitingBlock,     &InvalidExitBlock,       &InvalidLatch,
+    &InvalidLoop,             &UncomputableTripCount,  &PrepassCommitted,
+    &PrepassRolledBack,       &GuardsVersioned,        &VersioningSizeGrowth,
+    &GuardsIfConverted,       &ChainsFused,            &ImpliedGuardsRemoved,
+    &InterveningCodeMoved,    &InterveningLoopsMoved,  &SecondLoopsPeeled,
+    &IndexSetsSplit,          &LoopsAligned,           &TripCountsVersioned,
+    &AliasChecksVersioned,    &RuntimeAliasChecks,     &RuntimeVersioningGrowth,
+    &GuardRegionsMerged,
+};
   
 enum FusionDependenceAnalysisChoice {
   FUSION_DEPENDENCE_ANALYSIS_SCEV,
   FUSION_DEPENDENCE_ANALYSIS_DA,
+  FUSION_DEPENDENCE_ANALYSIS_AFFINE,
   FUSION_DEPENDENCE_ANALYSIS_ALL,
 };
   
@@ -117,15 +196,104 @@ static cl::opt<FusionDependenceAnalysisChoice> FusionDependenceAnalysis(
     cl::values(clEnumValN(FUSION_DEPENDENCE_ANALYSIS_SCEV, "scev",
                           "Use the scalar evolution interface"),
                 clEnumValN(FUSION_DEPENDENCE_ANALYSIS_DA, "da",
-                          "Use the dependence analysis interface"),
+                          "Use the dependence analysis interface (only the "
+                          "directions of the loops around the candidates)"),
+                clEnumValN(FUSION_DEPENDENCE_ANALYSIS_AFFINE, "affine",
+                          "Solve affine subscripts exactly"),
                 clEnumValN(FUSION_DEPENDENCE_ANALYSIS_ALL, "all",
                           "Use all available analyses")),
     cl::Hidden, cl::init(FUSION_DEPENDENCE_ANALYSIS_ALL), cl::ZeroOrMore);
   
-static cl::opt<unsigned> FusionPeelMaxCount(
-    "loop-fusion-peel-max-count-proj", cl::init(0), cl::Hidden,
-    cl::desc("Max number of iterations to be peeled from a loop, such that "
-              "fusion can take place"));
+static cl::opt<unsigned> FusionMaxIterations(
+    "loop-fusion-max-iterations-proj", cl::init(4), cl::Hidden,
+    cl::desc("Max number of rounds of enabling transformations and fusion "
+             "run on a function"));
+
+static cl::opt<bool> FusionPrepassOnly(
+    "loop-fusion-prepass-only-proj", cl::init(false), cl::Hidden,
+    cl::desc("Only run the for-if-for prepass, without canonicalizing and "
+             "fusing the loops afterwards"));
+
+static cl::opt<bool> FusionPrepassRollback(
+    "loop-fusion-prepass-rollback-proj", cl::init(true), cl::Hidden,
+    cl::desc("Roll back for-if-for rewrites whose two loops are not fused"));
+
+/// How the prepass makes the two loops of a for-if-for site adjacent.
+enum FusionGuardRewriteChoice {
+  FUSION_GUARD_SINK,
+  FUSION_GUARD_VERSION,
+};
+
+static cl::opt<FusionGuardRewriteChoice> FusionGuardRewrite(
+    "loop-fusion-guard-rewrite-proj",
+    cl::desc("How the prepass rewrites the guard of a for-if-for site"),
+    cl::values(clEnumValN(FUSION_GUARD_SINK, "sink",
+                          "Evaluate the guard in every iteration of the "
+                          "second loop"),
+               clEnumValN(FUSION_GUARD_VERSION, "version",
+                          "Hoist the guard above the first loop and clone "
+                          "the first loop for the path that skips the "
+                          "second one, falling back to sink")),
+    cl::Hidden, cl::init(FUSION_GUARD_SINK));
+
+static cl::opt<unsigned> FusionVersionBudget(
+    "loop-fusion-version-budget-proj", cl::init(500), cl::Hidden,
+    cl::desc("Max number of instructions guard versioning may add to a "
+             "function in each round"));
+
+static cl::opt<bool> FusionIfConvertGuards(
+    "loop-fusion-if-convert-guards-proj", cl::init(false), cl::Hidden,
+    cl::desc("If-convert the in-loop guards left by the prepass in fused "
+             "loops, speculating loads and turning stores into selects of "
+             "the old and the new value (assumes the stored memory is not "
+             "accessed concurrently)"));
+
+static cl::opt<bool> FusionChains(
+    "loop-fusion-chains-proj", cl::init(true), cl::Hidden,
+    cl::desc("Fuse chains of adjacent loops in one transformation instead of "
+             "one pair at a time"));
+
+static cl::opt<bool> FusionMergeRegions(
+    "loop-fusion-merge-regions-proj", cl::init(true), cl::Hidden,
+    cl::desc("Merge consecutive if-regions with equivalent conditions, so "
+             "that the loops in them become control flow equivalent"));
+
+static cl::opt<unsigned> FusionMoveInterveningMax(
+    "loop-fusion-move-intervening-max-proj", cl::init(100), cl::Hidden,
+    cl::desc("Max number of instructions between two loops that are moved "
+             "above the first or below the second loop to make them adjacent "
+             "(0 disables moving them)"));
+
+static cl::opt<unsigned> FusionPeelMaxCost(
+    "loop-fusion-peel-max-cost-proj", cl::init(200), cl::Hidden,
+    cl::desc("Max number of instructions that peeling the loop with more "
+             "iterations may add, such that fusion can take place (0 "
+             "disables peeling)"));
+
+static cl::opt<bool> FusionSplitIndexSets(
+    "loop-fusion-split-index-sets-proj", cl::init(true), cl::Hidden,
+    cl::desc("Split loops whose trip counts differ by a runtime amount, or "
+             "one too large to peel, into a part running as many iterations "
+             "as the other loop, which is fused, and a remainder loop"));
+
+static cl::opt<bool> FusionAlignLoops(
+    "loop-fusion-align-proj", cl::init(true), cl::Hidden,
+    cl::desc("Fuse loops whose dependences have a negative distance -d by "
+             "peeling the first d iterations of the first loop and the last "
+             "d of the second one, so the second loop runs d iterations "
+             "behind"));
+
+static cl::opt<unsigned> FusionRuntimeVersionBudget(
+    "loop-fusion-runtime-version-budget-proj", cl::init(0), cl::Hidden,
+    cl::desc("Max number of instructions that versioning loops on runtime "
+             "checks, that their trip counts are equal or that their "
+             "accesses do not overlap, may add to a function (0 disables "
+             "it)"));
+
+static cl::opt<unsigned> FusionRuntimeAliasChecks(
+    "loop-fusion-runtime-alias-checks-proj", cl::init(8), cl::Hidden,
+    cl::desc("Max number of runtime checks for overlapping accesses that "
+             "versioning a pair of loops may take (0 disables them)"));
   
 #ifndef NDEBUG
 static cl::opt<bool>
@@ -133,8 +301,154 @@ static cl::opt<bool>
                             cl::desc("Enable verbose debugging for Loop Fusion"),
                             cl::Hidden, cl::init(false), cl::ZeroOrMore);
 #endif
+
+/// Categories of events that can be traced with -loop-fusion-trace-proj.
+enum FusionTraceCategory {
+  TRACE_PREPASS,
+  TRACE_CANDIDATES,
+  TRACE_FUSION,
+};
+
+static cl::bits<FusionTraceCategory> FusionTrace(
+    "loop-fusion-trace-proj",
+    cl::desc("Trace the decisions of loop fusion in the given categories"),
+    cl::values(clEnumValN(TRACE_PREPASS, "prepass",
+                          "for-if-for sites found, rejected and rewritten"),
+               clEnumValN(TRACE_CANDIDATES, "candidates",
+                          "loops accepted or rejected as fusion candidates"),
+               clEnumValN(TRACE_FUSION, "fusion",
+                          "pairs of candidates fused or not fused")),
+    cl::CommaSeparated, cl::Hidden);
+
+static cl::opt<unsigned> FusionTraceLevel(
+    "loop-fusion-trace-level-proj", cl::init(1), cl::Hidden,
+    cl::desc("Detail of traced events: 1 traces decisions, 2 also traces the "
+             "blocks involved"));
+
+static cl::opt<std::string> FusionTraceFile(
+    "loop-fusion-trace-file-proj", cl::Hidden, cl::value_desc("filename"),
+    cl::desc("Write traced events to this file instead of stderr"));
+
+static cl::opt<unsigned> FusionTraceBuffer(
+    "loop-fusion-trace-buffer-proj", cl::init(0), cl::Hidden,
+    cl::desc("Only keep the last N traced events in memory and write them "
+             "out when the process exits or crashes (0 = write every event "
+             "immediately)"));
+
+namespace {
+/// Destination of the events traced by FUSION_TRACE. Events are written to
+/// the trace file (or stderr) as they occur, or kept in a ring buffer of the
+/// last -loop-fusion-trace-buffer-proj events that is written out on exit and
+/// on a crash.
+class FusionTraceLog {
+public:
+  FusionTraceLog() {
+    if (!FusionTraceFile.empty()) {
+      std::error_code EC;
+      File = std::make_unique<raw_fd_ostream>(FusionTraceFile, EC,
+                                              sys::fs::OF_Text);
+      if (EC) {
+        errs() << "Could not open trace file '" << FusionTraceFile
+               << "': " << EC.message() << "\n";
+        File.reset();
+      }
+    }
+    if (FusionTraceBuffer) {
+      Ring.resize(FusionTraceBuffer);
+      sys::AddSignalHandler(flushOnCrash, this);
+    }
+  }
+
+  ~FusionTraceLog() { flush(); }
+
+  void record(FusionTraceCategory Category, StringRef Event) {
+    static const char *const Names[] = {"prepass", "candidates", "fusion"};
+    std::string Line = (Twine("[") + Names[Category] + "] " + Event).str();
+    if (Ring.empty()) {
+      getStream() << Line << '\n';
+      return;
+    }
+    Ring[Next] = std::move(Line);
+    Next = (Next + 1) % Ring.size();
+    Wrapped |= Next == 0;
+  }
+
+  /// Write out and clear the buffered events, oldest first.
+  void flush() {
+    if (Ring.empty())
+      return;
+    raw_ostream &OS = getStream();
+    for (size_t I = Wrapped ? Next : 0, E = Ring.size(); I < E; ++I)
+      OS << Ring[I] << '\n';
+    for (size_t I = 0; Wrapped && I < Next; ++I)
+      OS << Ring[I] << '\n';
+    OS.flush();
+    for (std::string &Line : Ring)
+      Line.clear();
+    Next = 0;
+    Wrapped = false;
+  }
+
+private:
+  static void flushOnCrash(void *Log) {
+    static_cast<FusionTraceLog *>(Log)->flush();
+  }
+
+  raw_ostream &getStream() { return File ? *File : errs(); }
+
+  std::unique_ptr<raw_fd_ostream> File;
+  std::vector<std::string> Ring;
+  size_t Next = 0;
+  bool Wrapped = false;
+};
+} // namespace
+
+static ManagedStatic<FusionTraceLog> TraceLog;
+
+static inline bool isTraceEnabled(FusionTraceCategory Category,
+                                  unsigned Level) {
+  return LLVM_UNLIKELY(FusionTrace.getBits() != 0) &&
+         FusionTrace.isSet(Category) && Level <= FusionTraceLevel;
+}
+
+/// Get the description of \p Stat, one of FUSION_REASONS, to trace as the
+/// reason for a decision. Statistics do not keep their description when they
+/// are disabled, so it is taken from the list instead.
+static StringRef getTraceReason(const Statistic &Stat) {
+#define GET_REASON(VARNAME, DESC)                                              \
+  if (&Stat == &VARNAME)                                                       \
+    return DESC;
+  FUSION_REASONS(GET_REASON)
+#undef GET_REASON
+  llvm_unreachable("Statistic is not a fusion reason");
+}
+
+/// Trace an event of the given category and level. \p MSG is a sequence of
+/// values separated by '<<' and is only evaluated if the category is enabled,
+/// so a disabled trace costs a single test of -loop-fusion-trace-proj.
+#define FUSION_TRACE(CATEGORY, LEVEL, MSG)                                     \
+  do {                                                                         \
+    if (isTraceEnabled(CATEGORY, LEVEL)) {                                     \
+      std::string TraceEvent;                                                  \
+      raw_string_ostream TraceOS(TraceEvent);                                  \
+      TraceOS << MSG;                                                          \
+      TraceLog->record(CATEGORY, TraceOS.str());                               \
+    }                                                                          \
+  } while (false)
   
 namespace {
+/// Prints the names of a list of blocks, for tracing.
+struct BlockNames {
+  ArrayRef<BasicBlock *> Blocks;
+};
+
+raw_ostream &operator<<(raw_ostream &OS, const BlockNames &BN) {
+  ListSeparator LS(" ");
+  for (BasicBlock *BB : BN.Blocks)
+    OS << LS << BB->getName();
+  return OS;
+}
+
 /// This class is used to represent a candidate for loop fusion. When it is
 /// constructed, it checks the conditions for loop fusion to ensure that it
 /// represents a valid candidate. It caches several parts of a loop that are
@@ -199,9 +513,11 @@ struct FusionCandidate {
     // prevent fusion. For each block, walk over all instructions and collect
     // the memory reads and writes If any instructions that prevent fusion are
     // found, invalidate this object and return.
-    errs() <<"Basic Blocks:\n";
+    FUSION_TRACE(TRACE_CANDIDATES, 2,
+                 "loop " << L->getName() << " in "
+                         << Header->getParent()->getName() << " has blocks "
+                         << BlockNames{L->getBlocks()});
     for (BasicBlock *BB : L->blocks()) {
-      errs() << "    " << BB->getName() << "\n";
       if (BB->hasAddressTaken()) {
         invalidate();
         reportInvalidCandidate(AddressTakenBB);
@@ -253,7 +569,16 @@ struct FusionCandidate {
     assert(ExitBlock == L->getExitBlock() && "Exit block is out of sync");
     assert(Latch == L->getLoopLatch() && "Latch is out of sync");
   }
-  
+
+  /// Return true if the blocks and the guard branch are still the ones of the
+  /// Loop object, i.e., the CFG around the loop has not been changed.
+  bool isInSync() const {
+    return Preheader == L->getLoopPreheader() && Header == L->getHeader() &&
+           ExitingBlock == L->getExitingBlock() &&
+           ExitBlock == L->getExitBlock() && Latch == L->getLoopLatch() &&
+           GuardBranch == L->getLoopGuardBranch();
+  }
+
   /// Get the entry block for this fusion candidate.
   ///
   /// If this fusion candidate represents a guarded loop, the entry block is the
@@ -322,7 +647,6 @@ struct FusionCandidate {
   /// fusion. Note that this only checks whether a single loop can be fused - it
   /// does not check whether it is *legal* to fuse two loops together.
   bool isEligibleForFusion(ScalarEvolution &SE) const {
-    errs() << "isEligibleForFusion: isValid?: " << isValid() << '\n';
     if (!isValid()) {
       LLVM_DEBUG(dbgs() << "FC has invalid CFG requirements!\n");
       if (!Preheader)
@@ -337,33 +661,29 @@ struct FusionCandidate {
         ++InvalidLatch;
       if (L->isInvalid())
         ++InvalidLoop;
-        errs() << "    isEligibleForFusion is returning false\n"; 
+      FUSION_TRACE(TRACE_CANDIDATES, 1,
+                   "loop " << L->getName() << " rejected: invalid CFG");
       return false;
     }
   
     // Require ScalarEvolution to be able to determine a trip count.
-    errs() << "Trip count: " << SE.getBackedgeTakenCount(L) << "\n";
     if (!SE.hasLoopInvariantBackedgeTakenCount(L)) {
       LLVM_DEBUG(dbgs() << "Loop " << L->getName()
                         << " trip count not computable!\n");
-        errs() << "    reportInvalidCandidate(UnknownTripCount) is false\n"; 
       return reportInvalidCandidate(UnknownTripCount);
     }
   
     if (!L->isLoopSimplifyForm()) {
       LLVM_DEBUG(dbgs() << "Loop " << L->getName()
                         << " is not in simplified form!\n");
-        errs() << "    reportInvalidCandidate(NotSimplifiedForm) is false\n"; 
       return reportInvalidCandidate(NotSimplifiedForm);
     }
   
     if (!L->isRotatedForm()) {
       LLVM_DEBUG(dbgs() << "Loop " << L->getName() << " is not rotated!\n");
-      errs() << "    reportInvalidCandidate(NotRotated); is false\n"; 
       return reportInvalidCandidate(NotRotated);
     }
   
-      errs() << "    isEligibleForFusion is returning true\n";
     return true;
   }
   
@@ -383,6 +703,10 @@ private:
   bool reportInvalidCandidate(llvm::Statistic &Stat) const {
     using namespace ore;
     assert(L && Preheader && "Fusion candidate not initialized properly!");
+    FUSION_TRACE(TRACE_CANDIDATES, 1,
+                 "loop " << L->getName() << " in "
+                         << Preheader->getParent()->getName()
+                         << " rejected: " << getTraceReason(Stat));
 #if LLVM_ENABLE_STATS
     ++Stat;
     ORE.emit(OptimizationRemarkAnalysis(DEBUG_TYPE, Stat.getName(),
@@ -438,12 +762,12 @@ using LoopVector = SmallVector<Loop *, 4>;
 // order. Thus, if FC0 comes *before* FC1 in a FusionCandidateSet, then FC0
 // dominates FC1 and FC1 post-dominates FC0.
 // std::set was chosen because we want a sorted data structure with stable
-// iterators. A subsequent patch to loop fusion will enable fusing non-ajdacent
-// loops by moving intervening code around. When this intervening code contains
-// loops, those loops will be moved also. The corresponding FusionCandidates
-// will also need to be moved accordingly. As this is done, having stable
-// iterators will simplify the logic. Similarly, having an efficient insert that
-// keeps the FusionCandidateSet sorted will also simplify the implementation.
+// iterators. Non-adjacent loops are fused by moving the intervening code
+// around, see moveInterveningCode. When this intervening code contains loops,
+// those loops are moved also, and only their FusionCandidates, and the ones
+// whose blocks changed, are erased and inserted again at their new place.
+// Iterators to all other candidates, e.g., the ones the caller is walking, stay
+// valid.
 using FusionCandidateSet = std::set<FusionCandidate, FusionCandidateCompare>;
 using FusionCandidateCollection = SmallVector<FusionCandidateSet, 4>;
   
@@ -545,6 +869,301 @@ static void printLoopVector(const LoopVector &LV) {
 }
 #endif
   
+/// Check whether \p I may write to the identified object \p Obj. Stores are
+/// disambiguated by their underlying object, other writes (calls) are assumed
+/// to write to everything but allocas whose address never escapes.
+static bool mayWriteToObject(const Instruction &I, const Value *Obj) {
+  if (!I.mayWriteToMemory())
+    return false;
+  if (const StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+    const Value *StoreObj = getUnderlyingObject(SI->getPointerOperand());
+    return StoreObj == Obj || !isIdentifiedObject(StoreObj) ||
+           !isIdentifiedObject(Obj);
+  }
+  return !isa<AllocaInst>(Obj) ||
+         PointerMayBeCaptured(Obj, /* ReturnCaptures */ true,
+                              /* StoreCaptures */ true);
+}
+
+/// A site found by the prepass. For a for-if-for site: loop L0, followed by a
+/// conditional branch (the guard) that either executes loop L1 or skips it and
+/// continues at the join block. For a for-for-if site: loop L0, directly
+/// followed by loop L1 whose body starts with a loop invariant guard. For an
+/// if-for-for site: a guard that either executes loop L0 or skips it to the
+/// join block, which is the preheader of loop L1.
+struct ForIfForSite {
+  enum SiteKind {
+    /// L0; if (c) L1
+    ForIfFor,
+    /// L0; L1 { if (c) ... }
+    ForForIf,
+    /// L0; if (c) L1 else L1Else
+    ForIfElseFor,
+    /// if (c) L0; L1
+    IfForFor,
+  };
+
+  /// The first loop, unguarded unless the site is if-for-for
+  Loop *L0;
+  /// The second loop, executed only if the guard holds unless the site is
+  /// if-for-for
+  Loop *L1;
+  /// Guard branch, terminating the exit block of L0 (for-if-for), the first
+  /// block of the body of L1 (for-for-if) or the block before L0 (if-for-for)
+  BranchInst *GuardBranch;
+  /// Block where the guarded and unguarded paths meet again
+  BasicBlock *Join;
+  /// Shape of the site
+  SiteKind Kind = ForIfFor;
+  /// The loop executed if the guard does not hold (for-if/else-for)
+  Loop *L1Else = nullptr;
+  /// Whether the guard is versioned (see versionGuard) rather than sunk into
+  /// L1 (see rearrangeSuccessors)
+  bool Versioned = false;
+  /// The copy of L0 made by versionGuard
+  Loop *L0Copy = nullptr;
+
+  /// Get the block the header of L1 branches to when it stays in the loop.
+  BasicBlock *getSecondLoopBody() const {
+    BasicBlock *Header = L1->getHeader();
+    for (BasicBlock *Succ : successors(Header))
+      if (L1->contains(Succ))
+        return Succ;
+    return nullptr;
+  }
+};
+
+/// A system of linear constraints A . x <= B over integer variables, for the
+/// affine dependence test. Equalities are checked with the GCD test and
+/// substituted where a variable has a unit coefficient. All constraints are
+/// checked against the bounds of the variables (the Banerjee test), and
+/// Fourier-Motzkin elimination projects the system onto one variable. Each
+/// constraint is divided by the gcd of its coefficients, rounding the bound
+/// down, so that the projection stays close to the integer solutions; it is
+/// exact for two variables. If the arithmetic overflows or the system grows
+/// too large, the projection gives up and the variable is unbounded.
+class LinearSystem {
+  /// The coefficients of a constraint, followed by its bound
+  using Row = SmallVector<int64_t, 8>;
+
+public:
+  explicit LinearSystem(unsigned NumVars) : NumVars(NumVars) {}
+
+  /// Add the constraint \p A . x <= \p B.
+  void addLE(ArrayRef<int64_t> A, int64_t B) { addRow(Rows, A, B); }
+
+  /// Add the constraint \p A . x == \p B.
+  void addEQ(ArrayRef<int64_t> A, int64_t B) { addRow(Eqs, A, B); }
+
+  /// Add the constraint \p Lo <= x_V <= \p Hi, for the bounds that exist.
+  void addBounds(unsigned V, Optional<int64_t> Lo, Optional<int64_t> Hi) {
+    Row R(NumVars + 1, 0);
+    if (Lo) {
+      R[V] = -1;
+      R[NumVars] = -*Lo;
+      Rows.push_back(R);
+    }
+    if (Hi) {
+      R[V] = 1;
+      R[NumVars] = *Hi;
+      Rows.push_back(R);
+    }
+  }
+
+  /// Return false if the system has no integer solution, and otherwise
+  /// true with the bounds of x_V in \p Lo and \p Hi, or None for the bounds
+  /// that are not known.
+  bool project(unsigned V, Optional<int64_t> &Lo, Optional<int64_t> &Hi) {
+    Lo = Hi = None;
+    bool GaveUp = false;
+    if (!substituteEqualities(V, GaveUp) || !checkBounds())
+      return false;
+    for (unsigned U = 0; U < NumVars && !GaveUp; ++U)
+      if (U != V && !eliminate(U, GaveUp))
+        return false;
+    if (GaveUp)
+      return true;
+    for (const Row &R : Rows) {
+      if (R[V] > 0) {
+        int64_t Bound = floorDiv(R[NumVars], R[V]);
+        Hi = Hi ? std::min(*Hi, Bound) : Bound;
+      } else if (R[V] < 0) {
+        int64_t Bound = -floorDiv(R[NumVars], -R[V]);
+        Lo = Lo ? std::max(*Lo, Bound) : Bound;
+      }
+    }
+    return !Lo || !Hi || *Lo <= *Hi;
+  }
+
+private:
+  static constexpr unsigned MaxRows = 64;
+
+  static int64_t floorDiv(int64_t A, int64_t B) {
+    assert(B > 0 && "Dividing by a non-positive number");
+    return A >= 0 ? A / B : -((-A + B - 1) / B);
+  }
+
+  void addRow(SmallVectorImpl<Row> &To, ArrayRef<int64_t> A, int64_t B) {
+    assert(A.size() == NumVars && "Wrong number of coefficients");
+    To.emplace_back(A.begin(), A.end());
+    To.back().push_back(B);
+  }
+
+  /// Divide \p R by the gcd of its coefficients. Return false if it has no
+  /// integer solution, which for an equality is the GCD test. Rows without
+  /// coefficients that hold are cleared.
+  bool normalize(Row &R, bool IsEquality) const {
+    uint64_t GCD = 0;
+    for (unsigned I = 0; I < NumVars; ++I)
+      GCD = GreatestCommonDivisor64(GCD, std::abs(R[I]));
+    int64_t &B = R[NumVars];
+    if (!GCD) {
+      if (IsEquality ? B != 0 : B < 0)
+        return false;
+      R.clear();
+      return true;
+    }
+    if (IsEquality && B % int64_t(GCD))
+      return false;
+    for (unsigned I = 0; I < NumVars; ++I)
+      R[I] /= int64_t(GCD);
+    B = IsEquality ? B / int64_t(GCD) : floorDiv(B, GCD);
+    return true;
+  }
+
+  /// Return \p A * \p X + \p B * \p Y, or None on overflow.
+  static Optional<int64_t> combine(int64_t A, int64_t X, int64_t B,
+                                   int64_t Y) {
+    Optional<int64_t> AX = checkedMul(A, X), BY = checkedMul(B, Y);
+    if (!AX || !BY)
+      return None;
+    return checkedAdd(*AX, *BY);
+  }
+
+  /// Return \p X * R0 + \p Y * R1 in \p Out, or false on overflow.
+  bool combineRows(int64_t X, const Row &R0, int64_t Y, const Row &R1,
+                   Row &Out) const {
+    Out.assign(NumVars + 1, 0);
+    for (unsigned I = 0; I <= NumVars; ++I) {
+      Optional<int64_t> C = combine(X, R0[I], Y, R1[I]);
+      if (!C)
+        return false;
+      Out[I] = *C;
+    }
+    return true;
+  }
+
+  /// Substitute the equalities that have a variable other than \p V with a
+  /// unit coefficient into the other constraints, and turn the rest into
+  /// pairs of inequalities. Return false if an equality fails the GCD test.
+  bool substituteEqualities(unsigned V, bool &GaveUp) {
+    for (unsigned I = 0; I < Eqs.size(); ++I) {
+      Row &Eq = Eqs[I];
+      if (!normalize(Eq, /*IsEquality=*/true))
+        return false;
+      if (Eq.empty())
+        continue;
+      unsigned U = 0;
+      while (U < NumVars && (U == V || std::abs(Eq[U]) != 1))
+        ++U;
+      if (U == NumVars) {
+        Row Neg(NumVars + 1);
+        for (unsigned J = 0; J <= NumVars; ++J)
+          Neg[J] = -Eq[J];
+        Rows.push_back(Eq);
+        Rows.push_back(Neg);
+        continue;
+      }
+      // With Eq[U] = +-1, x_U = Eq[U] * (B - sum of the others), so
+      // C . x <= D becomes (C - C[U] * Eq[U] * Eq) . x <= D - ... .
+      auto Substitute = [&](Row &R) {
+        if (R.empty() || !R[U])
+          return true;
+        Row Out;
+        if (!combineRows(1, R, -R[U] * Eq[U], Eq, Out))
+          return false;
+        R = std::move(Out);
+        return true;
+      };
+      for (unsigned J = I + 1; J < Eqs.size(); ++J)
+        if (!Substitute(Eqs[J]))
+          GaveUp = true;
+      for (Row &R : Rows)
+        if (!Substitute(R))
+          GaveUp = true;
+      if (GaveUp)
+        return true;
+    }
+    return true;
+  }
+
+  /// Check each constraint against the bounds of its variables given by the
+  /// constraints on a single variable. Return false if one cannot hold.
+  bool checkBounds() {
+    SmallVector<Optional<int64_t>, 8> Lo(NumVars), Hi(NumVars);
+    for (Row &R : Rows) {
+      if (!normalize(R, /*IsEquality=*/false))
+        return false;
+      if (R.empty() || count_if(makeArrayRef(R).drop_back(),
+                                    [](int64_t C) { return C; }) != 1)
+        continue;
+      unsigned U = find_if(R, [](int64_t C) { return C; }) - R.begin();
+      if (R[U] > 0)
+        Hi[U] = Hi[U] ? std::min(*Hi[U], R[NumVars]) : R[NumVars];
+      else
+        Lo[U] = Lo[U] ? std::max(*Lo[U], -R[NumVars]) : -R[NumVars];
+    }
+    for (const Row &R : Rows) {
+      if (R.empty())
+        continue;
+      // The smallest value of the left-hand side over the bounds.
+      Optional<int64_t> Min = 0;
+      for (unsigned I = 0; I < NumVars && Min; ++I) {
+        Optional<int64_t> Bound = R[I] > 0 ? Lo[I] : Hi[I];
+        if (!R[I])
+          continue;
+        Min = Bound ? combine(1, *Min, R[I], *Bound) : None;
+      }
+      if (Min && *Min > R[NumVars])
+        return false;
+    }
+    return true;
+  }
+
+  /// Eliminate x_U from the inequalities. Return false if they have no
+  /// solution.
+  bool eliminate(unsigned U, bool &GaveUp) {
+    SmallVector<Row, 16> Lower, Upper, Result;
+    for (Row &R : Rows) {
+      if (R.empty())
+        continue;
+      (R[U] > 0 ? Upper : R[U] < 0 ? Lower : Result).push_back(std::move(R));
+    }
+    if (Result.size() + Lower.size() * Upper.size() > MaxRows) {
+      GaveUp = true;
+      return true;
+    }
+    for (const Row &L : Lower)
+      for (const Row &H : Upper) {
+        Row Out;
+        if (!combineRows(H[U], L, -L[U], H, Out)) {
+          GaveUp = true;
+          return true;
+        }
+        if (!normalize(Out, /*IsEquality=*/false))
+          return false;
+        if (!Out.empty())
+          Result.push_back(std::move(Out));
+      }
+    Rows = std::move(Result);
+    return true;
+  }
+
+  unsigned NumVars;
+  SmallVector<Row, 16> Rows;
+  SmallVector<Row, 4> Eqs;
+};
+
 struct LoopFuser {
 private:
   // Sets of control flow equivalent fusion candidates for a given nest level.
@@ -552,6 +1171,22 @@ private:
   
   LoopDepthTree LDT;
   DomTreeUpdater DTU;
+
+  /// Loops fused in the current round, mapped to the loop they were fused
+  /// into.
+  DenseMap<const Loop *, const Loop *> FusedInto;
+
+  /// Whether loops with different trip counts may be peeled to fuse them,
+  /// and whether a round found a pair that peeling would fuse while it was
+  /// not allowed yet.
+  bool AllowPeeling = false;
+  bool PeelingDeferred = false;
+
+  /// Instructions that versionOnRuntimeChecks may still add to the function.
+  unsigned RuntimeVersionBudget = 0;
+
+  /// The for-if-for sites rewritten in the current round.
+  ArrayRef<ForIfForSite> RoundSites;
   
   LoopInfo &LI;
   DominatorTree &DT;
@@ -562,6 +1197,7 @@ private:
   AssumptionCache &AC;
   
   const TargetTransformInfo &TTI;
+  const DataLayout &DL;
   
 public:
   LoopFuser(LoopInfo &LI, DominatorTree &DT, DependenceInfo &DI,
@@ -569,285 +1205,1650 @@ public:
             OptimizationRemarkEmitter &ORE, const DataLayout &DL,
             AssumptionCache &AC, const TargetTransformInfo &TTI)
       : LDT(LI), DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy), LI(LI),
-        DT(DT), DI(DI), SE(SE), PDT(PDT), ORE(ORE), AC(AC), TTI(TTI) {}
+        DT(DT), DI(DI), SE(SE), PDT(PDT), ORE(ORE), AC(AC), TTI(TTI), DL(DL) {}
+
+  /// Run the enabling transformations and loop fusion on \p F until the
+  /// function does not change any more, for at most
+  /// -loop-fusion-max-iterations-proj rounds. Each round runs:
+  ///   1. the for-if-for prepass,
+  ///   2. promotion of allocas to registers (as mem2reg),
+  ///   3. merging of consecutive if-regions with equivalent conditions,
+  ///   4. loop canonicalization: simplified, rotated and LCSSA form,
+  ///   5. fuseLoops,
+  ///   6. if-conversion of the in-loop guards of the fused loops, with
+  ///      -loop-fusion-if-convert-guards-proj.
+  /// All analyses are kept up to date in place and shared across the rounds.
+  /// Peeling a loop to match the trip count of another one, or splitting or
+  /// versioning both, is the last resort:
+  /// it is only allowed once a round without it has changed nothing, so that
+  /// it does not take a loop that would otherwise be fused exactly, e.g., after
+  /// a for-if-for rewrite of a later round. The two loops of a rewritten site
+  /// may always be peeled, as the rewrite is rolled back otherwise, except for
+  /// if-for-for sites, whose second loop is just whatever follows the if.
+  bool run(Function &F) {
+    if (FusionPrepassOnly)
+      return prepass(F);
 
-  // 
-  bool prepass(Function &F) {
     bool Changed = false;
-        std::unordered_map<BasicBlock*, int> loopDepths;
-        std::unordered_map<BasicBlock*, BasicBlock*> blockToLoopHeader;
-        
-        // vec of all blocks in function
-        std::vector<BasicBlock*> blocks;
-        // map: for.end BB* -> pair<for.body BB*, loopDepth>
-        std::unordered_map<BasicBlock*, BasicBlock*> loopEnds;
-
-        // map: for.end BB* -> pair<for.body BB*, loopDepth>
-        //     construct this map by iterating through loops and using getBlocks()
-        // blocks vector (all blocks in function): 
-        //     iterate through - if we see a for.body block, go two up to check if it's a if.then, if it's an if.then, go one up and see if it's an for.end
-        //     if it's a for.end: search map for for.end key, and the value is the for.body block
-        //     as a result, we now have for.body for two loops: we confirmed that there exists a for-if-for structure
-
-        if (!LI.empty()) { // All for loops stored in LoopFuser LI, LDT
-            for (auto CurrLoop : LI) {
-                errs() << "\nBlocks is this damn loop\n";
-                for (auto block : CurrLoop->getBlocks()){
-                    errs() << "     " << block->getName() << "\n";
-                    blockToLoopHeader[block] = CurrLoop->getHeader();
-                }
-            }
-            for (auto CurrLoop : LI) { // For each for loop:
-                errs() << "\n********************\nLOOP ENDS:\n";
-                // this builds the loopEnds map
-                for (auto block : CurrLoop->getBlocks()) {
-                // note: getBlocks() does not contain the for.end block
-                    loopDepths[block] = CurrLoop->getLoopDepth();
-                    if (block->getName().find("for.cond") != -1) {
-                        for (auto it = succ_begin(block), end = succ_end(block); it != end; ++it) {
-                            BasicBlock* succblock = *it;
-                            // if the succ block to for.cond is not for.body (but instd the bb that leads to for.end)
-                            if (succblock->getName().find("for.body") == -1 /* && succblock->getSingleSuccessor() != nullptr*/) {
-                                BasicBlock* endBlock = succblock/*->getSingleSuccessor()*/;
-                                errs() << "    this should be the end block: " << endBlock->getName() << '\n';
-                                loopEnds[endBlock] = (CurrLoop->getHeader());
-                            }
-                        }
-                    }
-                }
-            } // for (auto CurrLoop : LI)
-            errs() << "Loop Ends:\n";
-            for (auto endBlock : loopEnds) { 
-                errs() << endBlock.first->getName() << ", " << endBlock.second->getName() << "\n";
-            }
-        }    
-        
-        errs() << "\n********************\nALL BLOCKS IN FUNCTION:\n";
-        for (Function::iterator bb = F.begin(), e = F.end(); bb != e; ++bb) {
-            BasicBlock &block_ref = *bb;
-            BasicBlock *block = &block_ref;
-            errs() << block->getName() <<"\n";
-            blocks.push_back(block);
-        }
+    AllowPeeling = false;
+    RuntimeVersionBudget = FusionRuntimeVersionBudget;
+    for (unsigned Iter = 0; Iter < FusionMaxIterations; ++Iter) {
+      PeelingDeferred = false;
+      bool RoundChanged = runRound(F);
+      LLVM_DEBUG(dbgs() << "Round " << Iter << " on " << F.getName()
+                        << (RoundChanged ? " changed" : " did not change")
+                        << " the function\n");
+      if (!RoundChanged) {
+        if (!PeelingDeferred)
+          break;
+        AllowPeeling = true;
+        continue;
+      }
+      Changed = true;
+    }
+    return Changed;
+  }
 
-        errs() << "\n********************\nFOR IF FOR RECOGNITION:\n";
-        int counter = 0;
-        bool hasForIfFor = false;
-        std::set<BasicBlock*> allowedIfBlocks;
-        std::vector<BasicBlock*> forIfFors;
-        std::unordered_map<BasicBlock*, BasicBlock*> forIfForsHeaderToEnd;
-        for (int i = 0; i < blocks.size(); i++) {
-            // // we check predecessors 3 levels up, so it makes no sense to check pred until 3rd bb
-            if (i > 2) {
-                if (blocks[i]->getName().find("for.body") != -1 && 
-                // blocks[i-1] is a block named like "for.body5.lr.ph" or "for.cond23.for.end29_crit_edge"
-                blocks[i-2]->getName().find("if.then") != -1 && 
-                blocks[i-3]->getName().find("for.end") != -1) {
-                    hasForIfFor = true;
-                    forIfFors.push_back(loopEnds[blocks[i-3]]);
-
-                    for (auto it = succ_begin(blocks[i-3]), end = succ_end(blocks[i-3]); it != end; ++it) {
-                        BasicBlock* succblock = *it;
-                        // if the succ block to for.cond is not for.body (but instd the bb that leads to for.end)
-                        if (succblock->getName().find("if.then") == -1 /* && succblock->getSingleSuccessor() != nullptr*/) {
-                            BasicBlock* endBlock = succblock/*->getSingleSuccessor()*/;
-                            errs() << "    this should be the end block: " << endBlock->getName() << '\n';
-                            forIfForsHeaderToEnd[blocks[i-3]->getSinglePredecessor()] = succblock;
-                            allowedIfBlocks.insert(succblock);
-                        }
-                    }
-
-                    // Know that we can execute the swaps
-                    
-                    errs() << "     CAN SWAP\n";
-                    errs() << "     if block:" << blocks[i-2]->getName() << "\n";
-                    allowedIfBlocks.insert(blocks[i-2]);
-                    errs() << "     for end block:" << blocks[i-3]->getName() << "\n";
-                    if (loopEnds.find(blocks[i-3]) != loopEnds.end()) {
-                        errs() << "     start of foriffor: " << loopEnds[blocks[i-3]]->getName() << "\n\n";
-                    }
-                    else {
-                        errs() << "     NOT FOUND DAMN IT\n";
-                    }
-                }
-            }
-        }
-        
-        errs() << "ForIfFors:\n";
-        for(auto forBlock : forIfFors){
-          errs() << "       " << forBlock->getName() << "\n";
-        }
+  /// Run one round of the driver on \p F.
+  ///
+  /// The for-if-for rewrites of the round form a transaction. A snapshot of
+  /// \p F, the statistics and the runtime versioning budget is taken before
+  /// they are applied, and a rewrite is committed only if its two loops end
+  /// up in the same loop after fusion. Otherwise the snapshot is restored and
+  /// the round is run again with the committed rewrites only. Every
+  /// repetition drops at least one site, so this ends.
+  bool runRound(Function &F) {
+    bool Restricted = false;
+    SmallPtrSet<BranchInst *, 8> Allowed;
+    while (true) {
+      FUSION_TRACE(TRACE_FUSION, 2, "round on " << F.getName());
+      bool Promoted = promoteAllocas(F);
+      SmallVector<ForIfForSite, 8> Sites = collectSites(F);
+      if (Restricted)
+        erase_if(Sites, [&](const ForIfForSite &Site) {
+          return !Allowed.count(Site.GuardBranch);
+        });
 
-        errs() << "\nforIfForsHeaderToEnd:\n";
-        for (auto block : forIfForsHeaderToEnd) {
-          errs() << block.first->getName() << "->" << block.second->getName() << "\n";
-        }
-        errs() << "\n\n";
-
-        for (auto forCond : forIfFors) {
-          errs() << "\nDOING " << forCond->getName() << ":\n";
-          // this vector keeps track of bb's relevant to this for-if-for relationship
-          // this contains blocks ranging from "for.cond" to "if.end", inclusive
-          std::vector<BasicBlock*> forIfForBlocks;
-          // when flag is true, it means we are in the relevant for-if-for blocks in the blocks vector
-          bool flag = false;
-          BasicBlock* forCondBlock;
-          errs() << "Blocks:\n";
-          for (auto block: blocks) {
-            errs() << "   " << block->getName() << "\n";
-          }
-          errs() << "Ok end of blocks\n";
-          for (BasicBlock* block : blocks) {
-              errs() << block->getName() << "\n";
-              if (block == forCond){
-                  errs() << "   found" << block->getName() << "\n";
-                  flag = true;
-              }
-              if (flag) {
-                  // if it's an if statement (getName has "if." in it), don't push unless it's found in a set that has the allowed if statements in it.
-                  // also, don't push if it's a "for." statement and the depth isn't == for->getLoopDepth
-                  // if (block->getName().find("if.") != -1 && allowedIfBlocks.find(block) == allowedIfBlocks.end()){
-                  //     break;
-                  // }
-                  // else if (block->getName().find("for.") != -1 && loopDepths[block] != loopDepths[forCond]) { // todo:
-                  //     break;
-                  // }
-                  if (blockToLoopHeader[block] == forCond && block != forCond) {
-                      continue;
-                  }
-                  else {
-                      errs() << "   pushing in " << block->getName() << "\n";
-                      forIfForBlocks.push_back(block);
-                  }
-              }
-              if (block == forIfForsHeaderToEnd[forCond]) {
-                  errs() << "here sad break\n";
-                  break;
-                  // this check for block == forIfForsHeaderToEnd[forCondBlock] is to make sure pushing blocks to forIfForBlocks
-                  // doesn't get halted when you reach an if.end statement of a if statement nested in the second for loop
-              }
-          }
+      // The statistics and the runtime versioning budget are saved with the
+      // function, so that a round that is rolled back does not count.
+      ValueToValueMapTy VMap;
+      std::unique_ptr<Function> Snapshot;
+      SmallVector<BranchInst *, 8> SnapshotGuards;
+      SmallVector<uint64_t, 48> SnapshotStatistics;
+      unsigned SnapshotBudget = RuntimeVersionBudget;
+      if (!Sites.empty() && FusionPrepassRollback) {
+        Snapshot = cloneFunctionBody(F, VMap);
+        for (const ForIfForSite &Site : Sites)
+          SnapshotGuards.push_back(cast<BranchInst>(VMap[Site.GuardBranch]));
+        for (Statistic *Stat : AllStatistics)
+          SnapshotStatistics.push_back(Stat->getValue());
+      }
 
-          // now we have a vector of all the blocks in order for this specific for if for
-          // next we do the changes
-          
-          errs() << "forIfForBlocks" << "\n";
-          for (auto block: forIfForBlocks){
-            errs() << "      " << block->getName() << "\n";
-          }
-          
-          // here in forIfForBlocks we've isolated the for if fors. Should always be 8 blocks otherwise there's nested branches in the internal for,
-          // which we do not handle in this implemention (yet)
-
-          if (forIfForBlocks.size() == 8) {
-              errs() << "REARRANGING SUCCESSORS\n";
-              rearrangeSuccessors(forIfForBlocks);
-              Changed = true;
-          }
+      SmallVector<std::pair<unsigned, WeakVH>, 8> InLoopGuards;
+      bool Changed = rewriteSites(Sites, &InLoopGuards);
+      Changed |= Promoted;
+      Changed |= mergeGuardRegions(F);
+      Changed |= canonicalizeLoops(F);
+
+      LDT = LoopDepthTree(LI);
+      FusedInto.clear();
+      RoundSites = Sites;
+      Changed |= fuseLoops(F);
+      RoundSites = {};
+
+      if (FusionIfConvertGuards) {
+        for (auto &SiteGuard : InLoopGuards) {
+          BranchInst *BI = dyn_cast_or_null<BranchInst>(SiteGuard.second);
+          if (BI && BI->isConditional() && isFused(Sites[SiteGuard.first]))
+            Changed |= ifConvertGuard(BI);
         }
+        DTU.flush();
+      }
+
+      if (!Snapshot)
+        return Changed;
 
+      SmallPtrSet<BranchInst *, 8> Committed;
+      for (unsigned I = 0, E = Sites.size(); I < E; ++I) {
+        bool Fused = isFused(Sites[I]);
+        if (Fused)
+          Committed.insert(SnapshotGuards[I]);
+        FUSION_TRACE(TRACE_PREPASS, 1,
+                     "site guarded in "
+                         << SnapshotGuards[I]->getParent()->getName()
+                         << (Fused ? " committed" : " rolled back"));
+      }
+
+      if (Committed.size() == Sites.size()) {
+        PrepassCommitted += Sites.size();
         return Changed;
+      }
+
+      for (auto StatPair : zip(AllStatistics, SnapshotStatistics))
+        *std::get<0>(StatPair) = std::get<1>(StatPair);
+      RuntimeVersionBudget = SnapshotBudget;
+      PrepassRolledBack += Sites.size() - Committed.size();
+      FUSION_TRACE(TRACE_FUSION, 2,
+                   "round on " << F.getName() << " rolled back");
+      restoreSnapshot(F, std::move(Snapshot));
+      Allowed = std::move(Committed);
+      Restricted = true;
+    }
   }
 
-  void rearrangeSuccessors(std::vector<llvm::BasicBlock*>& blocks) {
-      BasicBlock* forcond = blocks[0];
-      BasicBlock* forend = blocks[1];
-      BasicBlock* ifthen = blocks[2];
-      BasicBlock* forcond2 = blocks[3];
-      BasicBlock* forbody = blocks[4];
-      BasicBlock* forinc = blocks[5];
-      BasicBlock* forend2 = blocks[6];
-      BasicBlock* ifend = blocks[7];
-      errs() << forcond->getName() << "\n";
-      errs() << forend->getName() << "\n";
-      errs() << ifthen->getName() << "\n";
-      errs() << forcond2->getName() << "\n";
-      errs() << forbody->getName() << "\n";
-      errs() << forinc->getName() << "\n";
-      errs() << forend2->getName() << "\n";
-      errs() << ifend->getName() << "\n";
-      errs() << "HERE1\n";
-      forcond->getTerminator()->setSuccessor(1, ifthen);
-      errs() << "HERE2\n";
-      forend->getTerminator()->setSuccessor(0, forbody);
-      errs() << "HERE3\n";
-      forend->getTerminator()->setSuccessor(1, forinc);
-      errs() << "HERE4\n";
-      forcond2->getTerminator()->setSuccessor(0, forend);
-      errs() << "HERE5\n";
+  /// Check whether the loops of \p Site ended up in the same loop in the
+  /// current round. For a versioned for-if/else-for site, each branch loop has
+  /// to be fused with its copy of the first loop.
+  bool isFused(const ForIfForSite &Site) const {
+    if (getFusedLoop(Site.L0) != getFusedLoop(Site.L1))
+      return false;
+    if (!Site.L1Else)
+      return true;
+    const Loop *ElseFirst = Site.Versioned ? Site.L0Copy : Site.L1;
+    return getFusedLoop(ElseFirst) == getFusedLoop(Site.L1Else);
   }
-  
-  /// This is the main entry point for loop fusion. It will traverse the
-  /// specified function and collect candidate loops to fuse, starting at the
-  /// outermost nesting level and working inwards.
-  bool fuseLoops(Function &F) {
-#ifndef NDEBUG
-    if (VerboseFusionDebugging) {
-      LI.print(dbgs());
+
+  /// Check whether \p L0 and \p L1 hold the two loops of one of the for-if-for
+  /// sites rewritten in the current round, see isFused. If-for-for sites are
+  /// not considered.
+  bool isSitePair(const Loop *L0, const Loop *L1) const {
+    for (const ForIfForSite &Site : RoundSites) {
+      if (Site.Kind == ForIfForSite::IfForFor)
+        continue;
+      if (getFusedLoop(Site.L0) == L0 && getFusedLoop(Site.L1) == L1)
+        return true;
+      const Loop *ElseFirst = Site.Versioned ? Site.L0Copy : Site.L1;
+      if (Site.L1Else && getFusedLoop(ElseFirst) == L0 &&
+          getFusedLoop(Site.L1Else) == L1)
+        return true;
     }
-#endif
-  
-      errs() << "starting fuseLoops(F)...\n";
+    return false;
+  }
 
-    LLVM_DEBUG(dbgs() << "Performing Loop Fusion on function " << F.getName()
-                      << "\n");
-    bool Changed = false;
-  
-    while (!LDT.empty()) {
-      LLVM_DEBUG(dbgs() << "Got " << LDT.size() << " loop sets for depth "
-                        << LDT.getDepth() << "\n";);
-  
-      for (const LoopVector &LV : LDT) {
-        assert(LV.size() > 0 && "Empty loop set was build!");
-  
-        // Skip singleton loop sets as they do not offer fusion opportunities on
-        // this level.
-        if (LV.size() == 1)
-          continue;
-#ifndef NDEBUG
-        if (VerboseFusionDebugging) {
-          LLVM_DEBUG({
-            dbgs() << "  Visit loop set (#" << LV.size() << "):\n";
-            printLoopVector(LV);
-          });
-        }
-#endif
+  /// Get the loop that \p L has been fused into in the current round, or \p L
+  /// itself if it was not fused. Note that the returned loop may have been
+  /// erased; it is only meant to be compared.
+  const Loop *getFusedLoop(const Loop *L) const {
+    for (auto It = FusedInto.find(L); It != FusedInto.end();
+         It = FusedInto.find(L))
+      L = It->second;
+    return L;
+  }
 
-          errs() << "right before 'collectFusionCandidates(LV)'...\n";
-  
-        collectFusionCandidates(LV);
-        Changed |= fuseCandidates();
-      }
-  
-      // Finished analyzing candidates at this level.
-      // Descend to the next level and clear all of the candidates currently
-      // collected. Note that it will not be possible to fuse any of the
-      // existing candidates with new candidates because the new candidates will
-      // be at a different nest level and thus not be control flow equivalent
-      // with all of the candidates collected so far.
-      LLVM_DEBUG(dbgs() << "Descend one level!\n");
-      LDT.descend();
-      FusionCandidates.clear();
-    }
-  
-    if (Changed)
-      LLVM_DEBUG(dbgs() << "Function after Loop Fusion: \n"; F.dump(););
-  
-#ifndef NDEBUG
-    assert(DT.verify());
-    assert(PDT.verify());
-    LI.verify(DT);
-    SE.verify();
-#endif
-  
-    LLVM_DEBUG(dbgs() << "Loop Fusion complete\n");
-    return Changed;
+  /// Clone the body of \p F into a new function that is not part of the
+  /// module. \p VMap maps the values of \p F to their copies.
+  std::unique_ptr<Function> cloneFunctionBody(Function &F,
+                                              ValueToValueMapTy &VMap) const {
+    std::unique_ptr<Function> Clone(
+        Function::Create(F.getFunctionType(), F.getLinkage(),
+                         F.getAddressSpace(), F.getName()));
+    for (auto ArgPair : zip(F.args(), Clone->args()))
+      VMap[&std::get<0>(ArgPair)] = &std::get<1>(ArgPair);
+    SmallVector<ReturnInst *, 4> Returns;
+    CloneFunctionInto(Clone.get(), &F, VMap,
+                      CloneFunctionChangeType::LocalChangesOnly, Returns);
+    return Clone;
   }
-  
-private:
-  /// Determine if two fusion candidates are control flow equivalent.
-  ///
-  /// Two fusion candidates are control flow equivalent if when one executes,
+
+  /// Replace the body of \p F with the body of \p Snapshot, which has been
+  /// cloned from \p F by cloneFunctionBody, and recompute the analyses.
+  void restoreSnapshot(Function &F, std::unique_ptr<Function> Snapshot) {
+    DTU.flush();
+    SE.forgetAllLoops();
+    LI.releaseMemory();
+
+    for (BasicBlock &BB : F)
+      BB.dropAllReferences();
+    while (!F.empty())
+      F.begin()->eraseFromParent();
+    F.getBasicBlockList().splice(F.end(), Snapshot->getBasicBlockList());
+    for (auto ArgPair : zip(Snapshot->args(), F.args()))
+      std::get<0>(ArgPair).replaceAllUsesWith(&std::get<1>(ArgPair));
+
+    DTU.recalculate(F);
+    LI.analyze(DT);
+    AC.clear();
+  }
+
+  /// Enabling transformation for the for-if-for pattern:
+  ///
+  ///   for (...) { A }          for (...) { A }
+  ///   if (c)           ==>     for (...) { if (c) { B } }
+  ///     for (...) { B }
+  ///
+  /// Moving the guard into the second loop makes the two loops adjacent and
+  /// control flow equivalent, so that loop fusion can fuse them. The mirrored
+  /// for-for-if pattern, whose loops are adjacent already, only gets its loop
+  /// invariant guard condition hoisted out of the second loop. In the
+  /// if-for-for pattern the guard skips the first loop, and is moved into it.
+  /// Sites are recognized structurally (see matchForIfFor, matchForForIf and
+  /// matchIfForFor), so the prepass does not depend on value names or on the
+  /// order of the blocks in the function.
+  bool prepass(Function &F) {
+    bool Changed = promoteAllocas(F);
+    SmallVector<ForIfForSite, 8> Sites = collectSites(F);
+    Changed |= rewriteSites(Sites);
+    return Changed;
+  }
+
+  /// Collect the for-if-for sites of \p F that can be rewritten.
+  ///
+  /// All sites are collected before any of them is rewritten. Matching and
+  /// the legality checks only look at the site itself, and rewriting a site
+  /// does not touch the loops of any other site, so this is a single walk over
+  /// the loops with dominance queries on an unmodified tree.
+  ///
+  /// Sites are looked for at every nesting depth, outer loops first, as
+  /// LoopDepthTree descends. A site nested in the body of another one is only
+  /// touched by the rewrite of the outer site at the edges entering and
+  /// leaving that body, which the inner site does not depend on.
+  SmallVector<ForIfForSite, 8> collectSites(Function &F) const {
+    SmallVector<ForIfForSite, 8> Sites;
+    // Blocks with their address taken cannot be restored from a snapshot.
+    if (any_of(F, [](const BasicBlock &BB) { return BB.hasAddressTaken(); }))
+      return Sites;
+
+    SmallVector<ForIfForSite, 8> Matched;
+    for (Loop *L : LI.getLoopsInPreorder()) {
+      Optional<ForIfForSite> Site = matchForIfFor(L);
+      if (!Site)
+        Site = matchForIfElseFor(L);
+      if (!Site)
+        Site = matchForForIf(L);
+      if (!Site)
+        Site = matchIfForFor(L);
+      if (!Site)
+        continue;
+      FUSION_TRACE(TRACE_PREPASS, 1,
+                   (Site->Kind == ForIfForSite::ForForIf   ? "for-for-if "
+                    : Site->Kind == ForIfForSite::IfForFor ? "if-for-for "
+                                                           : "")
+                       << "site " << Site->L0->getName() << " -> "
+                       << Site->L1->getName()
+                       << (Site->L1Else ? " / " + Site->L1Else->getName().str()
+                                        : "")
+                       << " in " << F.getName() << " found");
+      Matched.push_back(*Site);
+    }
+
+    // The guard of an if-for-for site may also be the guard of the for-if-for
+    // site of the loop before it, which takes precedence.
+    SmallPtrSet<const BranchInst *, 8> Guards;
+    for (const ForIfForSite &Site : Matched)
+      if (Site.Kind != ForIfForSite::IfForFor)
+        Guards.insert(Site.GuardBranch);
+    erase_if(Matched, [&](const ForIfForSite &Site) {
+      return Site.Kind == ForIfForSite::IfForFor &&
+             Guards.count(Site.GuardBranch);
+    });
+
+    // Versioning a site copies its first loop, which would not receive the
+    // rewrites of other sites sharing that loop. Chained sites are therefore
+    // only versioned if they do not share a loop.
+    DenseMap<const Loop *, unsigned> SitesPerLoop;
+    for (const ForIfForSite &Site : Matched) {
+      ++SitesPerLoop[Site.L0];
+      ++SitesPerLoop[Site.L1];
+      if (Site.L1Else)
+        ++SitesPerLoop[Site.L1Else];
+    }
+
+    unsigned Budget = FusionVersionBudget;
+    for (ForIfForSite &Site : Matched) {
+      if (Site.Kind == ForIfForSite::ForForIf) {
+        SmallVector<Instruction *, 4> CondInsts;
+        if (collectGuardCondition(Site.GuardBranch, Site.L1, CondInsts))
+          Sites.push_back(Site);
+        else
+          FUSION_TRACE(TRACE_PREPASS, 1,
+                       "site " << Site.L0->getName() << " -> "
+                               << Site.L1->getName()
+                               << " rejected: guard is not loop invariant");
+        continue;
+      }
+      if (Site.Kind == ForIfForSite::IfForFor) {
+        if (canSinkGuard({Site.L1, Site.L0, Site.GuardBranch, Site.Join}))
+          Sites.push_back(Site);
+        continue;
+      }
+      if (FusionGuardRewrite == FUSION_GUARD_VERSION &&
+          SitesPerLoop[Site.L0] == 1 && SitesPerLoop[Site.L1] == 1 &&
+          (!Site.L1Else || SitesPerLoop[Site.L1Else] == 1)) {
+        if (Optional<unsigned> Cost = getVersioningCost(Site)) {
+          if (*Cost <= Budget) {
+            Budget -= *Cost;
+            Site.Versioned = true;
+            Sites.push_back(Site);
+            continue;
+          }
+          FUSION_TRACE(TRACE_PREPASS, 1,
+                       "site " << Site.L0->getName() << " -> "
+                               << Site.L1->getName() << " not versioned: "
+                               << *Cost << " instructions exceed the budget");
+        }
+      }
+      // The else branch is sunk into its loop as a guard on the negated
+      // condition, in the same way (see splitElseBranch).
+      if (canSinkGuard(Site) &&
+          (!Site.L1Else ||
+           canSinkGuard({Site.L1, Site.L1Else, Site.GuardBranch, Site.Join})))
+        Sites.push_back(Site);
+    }
+    return Sites;
+  }
+
+  /// Rewrite the for-if-for \p Sites collected by collectSites. The dominator
+  /// tree updates of all rewrites are applied in one batch at the end. If
+  /// \p InLoopGuards is given, the in-loop guards left by the rewrites are
+  /// added to it, together with the index of their site.
+  bool rewriteSites(
+      MutableArrayRef<ForIfForSite> Sites,
+      SmallVectorImpl<std::pair<unsigned, WeakVH>> *InLoopGuards = nullptr) {
+    auto AddInLoopGuard = [&](unsigned Idx, BranchInst *BI) {
+      if (InLoopGuards)
+        InLoopGuards->emplace_back(Idx, BI);
+    };
+
+    // Fold the empty blocks between the first loop and the guard into the
+    // guard block, so that the first loop exits into the guard block.
+    bool Changed = false, AnyVersioned = false;
+    for (ForIfForSite &Site : Sites) {
+      if (Site.Kind != ForIfForSite::ForIfFor &&
+          Site.Kind != ForIfForSite::ForIfElseFor)
+        continue;
+      while (Site.GuardBranch->getParent() != Site.L0->getExitBlock()) {
+        bool Merged =
+            MergeBlockIntoPredecessor(Site.GuardBranch->getParent(), &DTU, &LI);
+        assert(Merged && "Guard block not reached over empty blocks");
+        (void)Merged;
+        Changed = true;
+      }
+    }
+    DTU.flush();
+
+    for (unsigned Idx = 0, E = Sites.size(); Idx < E; ++Idx) {
+      ForIfForSite &Site = Sites[Idx];
+      if (Site.Kind == ForIfForSite::ForForIf) {
+        Changed |= hoistInLoopGuard(Site);
+        AddInLoopGuard(Idx, Site.GuardBranch);
+        FUSION_TRACE(TRACE_PREPASS, 1,
+                     "site " << Site.L0->getName() << " -> "
+                             << Site.L1->getName()
+                             << " guard hoisted out of the second loop");
+        continue;
+      }
+      if (Site.Versioned) {
+        unsigned Growth = versionGuard(Site);
+        ++GuardsVersioned;
+        VersioningSizeGrowth += Growth;
+        Changed = AnyVersioned = true;
+        FUSION_TRACE(TRACE_PREPASS, 1,
+                     "site " << Site.L0->getName() << " -> "
+                             << Site.L1->getName() << " versioned, adding "
+                             << Growth << " instructions");
+        continue;
+      }
+
+      Changed = true;
+      if (Site.Kind == ForIfForSite::IfForFor) {
+        // The guard is sunk into the first loop, the one it skips.
+        AddInLoopGuard(Idx, rearrangeSuccessors({Site.L1, Site.L0,
+                                                 Site.GuardBranch, Site.Join}));
+      } else if (Site.L1Else) {
+        // Guard each branch loop separately:
+        //   L0; if (c) L1; if (!c) L1Else
+        BranchInst *ElseBranch = splitElseBranch(Site);
+        AddInLoopGuard(Idx, rearrangeSuccessors({Site.L0, Site.L1,
+                                                 Site.GuardBranch,
+                                                 ElseBranch->getParent()}));
+        MergeBlockIntoPredecessor(ElseBranch->getParent(), &DTU, &LI);
+        AddInLoopGuard(Idx, rearrangeSuccessors(
+                                {Site.L1, Site.L1Else, ElseBranch, Site.Join}));
+      } else {
+        AddInLoopGuard(Idx, rearrangeSuccessors(Site));
+      }
+      FUSION_TRACE(TRACE_PREPASS, 1,
+                   "site " << Site.L0->getName() << " -> "
+                           << Site.L1->getName() << " rewritten");
+      FUSION_TRACE(TRACE_PREPASS, 2,
+                   "loop " << Site.L1->getName() << " now has blocks "
+                           << BlockNames{Site.L1->getBlocks()});
+    }
+
+    // Versioning updates DT directly, so the queued updates no longer apply.
+    if (AnyVersioned)
+      DTU.recalculate(*Sites.front().L0->getHeader()->getParent());
+    else
+      DTU.flush();
+
+#ifndef NDEBUG
+    assert(DT.verify(DominatorTree::VerificationLevel::Fast));
+    assert(PDT.verify(PostDominatorTree::VerificationLevel::Fast));
+    LI.verify(DT);
+#endif
+
+    return Changed;
+  }
+
+  /// Get the block that ends in the guard of a for-if-for site whose first
+  /// loop is \p L0: the exit block of \p L0, or the end of a chain of empty
+  /// blocks that it falls through, each one only entered from the one before.
+  /// rewriteSites folds such a chain into the guard block.
+  BasicBlock *getGuardBlock(const Loop *L0) const {
+    BasicBlock *BB = L0->getExitBlock();
+    while (BB && BB->getSinglePredecessor() &&
+           BB->getFirstNonPHIOrDbg() == BB->getTerminator()) {
+      BasicBlock *Succ = BB->getSingleSuccessor();
+      if (!Succ || Succ->getSinglePredecessor() != BB)
+        break;
+      BB = Succ;
+    }
+    return BB;
+  }
+
+  /// Get the loop that a successor \p Entry of the guard block of \p L0
+  /// leads to, if \p Entry is its preheader, the loop is a sibling of \p L0
+  /// and control continues at \p Join after it exits, either directly or
+  /// through an exit block that only branches to \p Join. Returns nullptr
+  /// otherwise.
+  Loop *getGuardedLoop(Loop *L0, BasicBlock *Entry, BasicBlock *Join) const {
+    BasicBlock *GuardBlock = getGuardBlock(L0);
+    if (Entry == Join || Entry->getSinglePredecessor() != GuardBlock)
+      return nullptr;
+
+    BasicBlock *Header1 = Entry->getSingleSuccessor();
+    Loop *L1 = Header1 ? LI.getLoopFor(Header1) : nullptr;
+    if (!L1 || L1 == L0 || L1->getHeader() != Header1 ||
+        L1->getLoopPreheader() != Entry ||
+        L1->getParentLoop() != L0->getParentLoop())
+      return nullptr;
+
+    BasicBlock *ExitBlock1 = L1->getExitBlock();
+    if (!ExitBlock1 || !L1->getExitingBlock())
+      return nullptr;
+    if (ExitBlock1 != Join && (ExitBlock1->getUniqueSuccessor() != Join ||
+                               !ExitBlock1->getSinglePredecessor()))
+      return nullptr;
+    return L1;
+  }
+
+  /// Try to match a for-if-for site whose first loop is \p L0.
+  ///
+  /// The exit block of \p L0, or the block it falls through to over empty
+  /// blocks (see getGuardBlock), has to end in a conditional branch (the
+  /// guard).
+  /// One successor of the guard must be the preheader of a sibling loop L1 and
+  /// the other successor (the join block) must be where control continues
+  /// after L1 exits, either directly or through an exit block of L1 that only
+  /// branches to the join block (see getGuardedLoop). Together with the guard
+  /// dominating and the join block post-dominating the region, this makes the
+  /// guarded part a single-entry/single-exit region containing nothing but L1.
+  Optional<ForIfForSite> matchForIfFor(Loop *L0) const {
+    BasicBlock *GuardBlock = getGuardBlock(L0);
+    if (!GuardBlock || !L0->getExitingBlock())
+      return None;
+
+    BranchInst *GuardBranch = dyn_cast<BranchInst>(GuardBlock->getTerminator());
+    if (!GuardBranch || !GuardBranch->isConditional())
+      return None;
+
+    for (unsigned Idx = 0; Idx < 2; ++Idx) {
+      BasicBlock *Entry = GuardBranch->getSuccessor(Idx);
+      BasicBlock *Join = GuardBranch->getSuccessor(1 - Idx);
+      Loop *L1 = getGuardedLoop(L0, Entry, Join);
+      if (!L1)
+        continue;
+
+      if (!DT.dominates(GuardBlock, Join) || !PDT.dominates(Join, GuardBlock))
+        continue;
+
+      return ForIfForSite{L0, L1, GuardBranch, Join};
+    }
+
+    return None;
+  }
+
+  /// Try to match a for-if/else-for site whose first loop is \p L0: like a
+  /// for-if-for site, but both successors of the guard are preheaders of
+  /// sibling loops, L1 (taken if the guard holds) and L1Else, that continue
+  /// at the same join block. Both loops need exit blocks of their own.
+  Optional<ForIfForSite> matchForIfElseFor(Loop *L0) const {
+    BasicBlock *GuardBlock = getGuardBlock(L0);
+    if (!GuardBlock || !L0->getExitingBlock())
+      return None;
+
+    BranchInst *GuardBranch = dyn_cast<BranchInst>(GuardBlock->getTerminator());
+    if (!GuardBranch || !GuardBranch->isConditional())
+      return None;
+
+    BasicBlock *Header1 = GuardBranch->getSuccessor(0)->getSingleSuccessor();
+    Loop *L1 = Header1 ? LI.getLoopFor(Header1) : nullptr;
+    BasicBlock *ExitBlock1 = L1 ? L1->getExitBlock() : nullptr;
+    BasicBlock *Join = ExitBlock1 ? ExitBlock1->getUniqueSuccessor() : nullptr;
+    if (!Join)
+      return None;
+
+    Loop *L1Then = getGuardedLoop(L0, GuardBranch->getSuccessor(0), Join);
+    Loop *L1Else = getGuardedLoop(L0, GuardBranch->getSuccessor(1), Join);
+    if (!L1Then || !L1Else || L1Then == L1Else ||
+        L1Else->getExitBlock() == Join)
+      return None;
+
+    if (!DT.dominates(GuardBlock, Join) || !PDT.dominates(Join, GuardBlock))
+      return None;
+
+    ForIfForSite Site{L0, L1Then, GuardBranch, Join,
+                      ForIfForSite::ForIfElseFor};
+    Site.L1Else = L1Else;
+    return Site;
+  }
+
+  /// Try to match a for-for-if site whose first loop is \p L0.
+  ///
+  /// The exit block of \p L0 has to be the preheader of a sibling loop L1,
+  /// i.e., the loops are adjacent. L1 has to exit from its header, and the
+  /// first block of its body has to end in a conditional branch (the guard)
+  /// whose successors both stay in L1 and one of which (the join block)
+  /// post-dominates the other. Whether the guard is loop invariant is checked
+  /// separately, by collectGuardCondition.
+  Optional<ForIfForSite> matchForForIf(Loop *L0) const {
+    BasicBlock *ExitBlock = L0->getExitBlock();
+    if (!ExitBlock || !L0->getExitingBlock())
+      return None;
+
+    BasicBlock *Header1 = ExitBlock->getSingleSuccessor();
+    Loop *L1 = Header1 ? LI.getLoopFor(Header1) : nullptr;
+    if (!L1 || L1 == L0 || L1->getHeader() != Header1 ||
+        L1->getLoopPreheader() != ExitBlock ||
+        L1->getParentLoop() != L0->getParentLoop() ||
+        L1->getExitingBlock() != Header1)
+      return None;
+
+    ForIfForSite Site{L0, L1, nullptr, nullptr, ForIfForSite::ForForIf};
+    BasicBlock *Body = Site.getSecondLoopBody();
+    Site.GuardBranch =
+        Body ? dyn_cast<BranchInst>(Body->getTerminator()) : nullptr;
+    if (!Site.GuardBranch || !Site.GuardBranch->isConditional())
+      return None;
+
+    for (unsigned Idx = 0; Idx < 2; ++Idx) {
+      BasicBlock *Then = Site.GuardBranch->getSuccessor(Idx);
+      BasicBlock *Join = Site.GuardBranch->getSuccessor(1 - Idx);
+      if (Then != Join && L1->contains(Then) && L1->contains(Join) &&
+          Then != Header1 && PDT.dominates(Join, Then)) {
+        Site.Join = Join;
+        return Site;
+      }
+    }
+    return None;
+  }
+
+  /// Try to match an if-for-for site whose guarded first loop is \p L0.
+  ///
+  /// The preheader of \p L0 has to be entered only from a conditional branch
+  /// (the guard), whose other successor (the join block) is where control
+  /// continues after \p L0 exits, as for the second loop of a for-if-for site
+  /// (see getGuardedLoop). The join block has to be the preheader of a
+  /// sibling loop L1. The guard is sunk into \p L0 rather than into L1.
+  Optional<ForIfForSite> matchIfForFor(Loop *L0) const {
+    BasicBlock *Preheader0 = L0->getLoopPreheader();
+    BasicBlock *GuardBlock =
+        Preheader0 ? Preheader0->getSinglePredecessor() : nullptr;
+    BranchInst *GuardBranch =
+        GuardBlock ? dyn_cast<BranchInst>(GuardBlock->getTerminator())
+                   : nullptr;
+    if (!GuardBranch || !GuardBranch->isConditional())
+      return None;
+
+    BasicBlock *Join = GuardBranch->getSuccessor(0) == Preheader0
+                           ? GuardBranch->getSuccessor(1)
+                           : GuardBranch->getSuccessor(0);
+    BasicBlock *ExitBlock0 = L0->getExitBlock();
+    if (Join == Preheader0 || !ExitBlock0 || !L0->getExitingBlock())
+      return None;
+    if (ExitBlock0 != Join && (ExitBlock0->getUniqueSuccessor() != Join ||
+                               !ExitBlock0->getSinglePredecessor()))
+      return None;
+
+    BasicBlock *Header1 = Join->getSingleSuccessor();
+    Loop *L1 = Header1 ? LI.getLoopFor(Header1) : nullptr;
+    if (!L1 || L1 == L0 || L1->getHeader() != Header1 ||
+        L1->getLoopPreheader() != Join ||
+        L1->getParentLoop() != L0->getParentLoop())
+      return None;
+
+    if (!DT.dominates(GuardBlock, Join) || !PDT.dominates(Join, GuardBlock))
+      return None;
+
+    return ForIfForSite{L0, L1, GuardBranch, Join, ForIfForSite::IfForFor};
+  }
+
+  /// Hoist the loop invariant guard condition of the for-for-if \p Site into
+  /// the preheader of its second loop, giving the guard the same form as the
+  /// in-loop guard rearrangeSuccessors creates for for-if-for sites. The two
+  /// loops are already adjacent, so they are fused as is; this makes the guard
+  /// visible as loop invariant to fusion and to ifConvertGuard. The CFG is not
+  /// changed. Returns true if any instruction was hoisted.
+  bool hoistInLoopGuard(const ForIfForSite &Site) {
+    SmallVector<Instruction *, 4> CondInsts;
+    bool CanHoist = collectGuardCondition(Site.GuardBranch, Site.L1, CondInsts);
+    assert(CanHoist && "Guard of for-for-if site is not loop invariant");
+    (void)CanHoist;
+
+    Instruction *InsertPt = Site.L1->getLoopPreheader()->getTerminator();
+    for (Instruction *I : CondInsts)
+      I->moveBefore(InsertPt);
+    SE.forgetLoop(Site.L1);
+    return !CondInsts.empty();
+  }
+
+  /// Find where the latch of the second loop of \p Site has to be split so
+  /// that everything before the split point can be treated as part of the
+  /// body and everything after it only advances the loop.
+  ///
+  /// The tail of the latch is the longest sequence of instructions before the
+  /// terminator that have no side effects other than stores to allocas (the
+  /// induction variable before mem2reg). Returns nullptr if the whole latch is
+  /// such a tail and it is separate from the body, i.e., no split is needed.
+  Instruction *getLatchSplitPoint(const ForIfForSite &Site) const {
+    BasicBlock *Latch = Site.L1->getLoopLatch();
+    Instruction *SplitPt = Latch->getTerminator();
+    for (Instruction *I = SplitPt->getPrevNode(); I && !isa<PHINode>(I);
+         I = I->getPrevNode()) {
+      if (I->mayHaveSideEffects()) {
+        StoreInst *SI = dyn_cast<StoreInst>(I);
+        if (!SI || SI->isVolatile() ||
+            !isa<AllocaInst>(getUnderlyingObject(SI->getPointerOperand())))
+          break;
+      }
+      SplitPt = I;
+    }
+
+    if (SplitPt == Latch->getFirstNonPHI() && !isa<PHINode>(Latch->front()) &&
+        Site.getSecondLoopBody() != Latch)
+      return nullptr;
+    return SplitPt;
+  }
+
+  /// Check whether the guard of \p Site can be moved into its second loop.
+  ///
+  /// After the rewrite the preheader, header, latch and exit block of L1 are
+  /// executed even if the guard does not hold, while the body (every other
+  /// block of L1, and the part of the latch before its split point) is only
+  /// entered if it does. This requires that:
+  ///   1. L1 exits from its header, so that skipping the body still runs the
+  ///      loop to completion, and its trip count is computable from values
+  ///      that are not defined under the guard.
+  ///   2. The blocks that now always execute have no side effects other than
+  ///      updating allocas that are private to L1 (e.g., the induction
+  ///      variable before mem2reg), and can be speculated: they do not trap
+  ///      and only load from memory known to be dereferenceable.
+  ///   3. The exit condition of L1 does not depend on the body, neither
+  ///      through SSA values nor through memory.
+  ///   4. Instructions outside the body that use values computed in the body
+  ///      can be speculated, as they will see undef when the body is skipped.
+  /// As the guard is loop invariant, it either holds for every iteration or
+  /// for none, so values flowing out of a skipped body are never observed.
+  bool canSinkGuard(const ForIfForSite &Site) const {
+    Loop *L1 = Site.L1;
+    BasicBlock *Preheader = L1->getLoopPreheader();
+    BasicBlock *Header = L1->getHeader();
+    BasicBlock *Latch = L1->getLoopLatch();
+    BasicBlock *ExitBlock = L1->getExitBlock();
+    BasicBlock *Body = Site.getSecondLoopBody();
+
+    auto Reject = [&](StringRef Reason) {
+      FUSION_TRACE(TRACE_PREPASS, 1,
+                   "site " << Site.L0->getName() << " -> " << L1->getName()
+                           << " rejected: " << Reason);
+      return false;
+    };
+
+    if (!Latch || L1->getExitingBlock() != Header || !Body)
+      return Reject("second loop does not exit from its header");
+
+    Instruction *LatchSplit = getLatchSplitPoint(Site);
+    SmallPtrSet<BasicBlock *, 16> BodyBlocks;
+    for (BasicBlock *BB : L1->blocks())
+      if (BB != Header && BB != Latch)
+        BodyBlocks.insert(BB);
+
+    auto IsInBody = [&](const Instruction *I) {
+      const BasicBlock *BB = I->getParent();
+      if (BB == Latch)
+        return LatchSplit &&
+               (isa<PHINode>(I) || I->comesBefore(LatchSplit));
+      return BodyBlocks.count(BB) != 0;
+    };
+
+    auto IsInRegion = [&](const BasicBlock *BB) {
+      return BB == Preheader || BB == ExitBlock || L1->contains(BB);
+    };
+
+    // An alloca is private to L1 if it is only loaded from and stored to
+    // within the guarded region.
+    auto IsPrivateAlloca = [&](const Value *Ptr) {
+      const AllocaInst *AI = dyn_cast<AllocaInst>(getUnderlyingObject(Ptr));
+      if (!AI)
+        return false;
+      for (const User *U : AI->users()) {
+        const Instruction *UI = dyn_cast<Instruction>(U);
+        if (!UI || !IsInRegion(UI->getParent()))
+          return false;
+        if (const StoreInst *SI = dyn_cast<StoreInst>(UI))
+          if (SI->getValueOperand() == AI)
+            return false;
+        if (!isa<LoadInst>(UI) && !isa<StoreInst>(UI))
+          return false;
+      }
+      return true;
+    };
+
+    // Without the guard, L1 has to terminate after the same number of
+    // iterations as with it.
+    const SCEV *BTC = SE.getBackedgeTakenCount(L1);
+    if (isa<SCEVCouldNotCompute>(BTC))
+      return Reject("trip count of second loop is not computable");
+    if (SCEVExprContains(BTC, [&](const SCEV *S) {
+          const SCEVUnknown *U = dyn_cast<SCEVUnknown>(S);
+          const Instruction *I =
+              U ? dyn_cast<Instruction>(U->getValue()) : nullptr;
+          return I && IsInRegion(I->getParent());
+        }))
+      return Reject("trip count of second loop depends on its guard");
+
+    // No context instruction is given to the speculation queries, as facts
+    // implied by the guard no longer hold once it is sunk.
+    SmallVector<BasicBlock *, 4> AlwaysExecuted = {Preheader, Header, Latch};
+    if (ExitBlock != Site.Join)
+      AlwaysExecuted.push_back(ExitBlock);
+    for (BasicBlock *BB : AlwaysExecuted)
+      for (Instruction &I : *BB) {
+        if (IsInBody(&I) || isa<PHINode>(I) || I.isTerminator() ||
+            isa<DbgInfoIntrinsic>(I))
+          continue;
+        if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+          if (SI->isVolatile() || !IsPrivateAlloca(SI->getPointerOperand()))
+            return Reject("second loop has side effects outside of its body");
+          continue;
+        }
+        if (LoadInst *LoadI = dyn_cast<LoadInst>(&I)) {
+          if (!LoadI->isUnordered() ||
+              !isDereferenceableAndAlignedPointer(LoadI->getPointerOperand(),
+                                                  LoadI->getType(),
+                                                  LoadI->getAlign(), DL))
+            return Reject("second loop may load from memory that is only "
+                          "dereferenceable under its guard");
+          continue;
+        }
+        if (I.mayHaveSideEffects())
+          return Reject("second loop has side effects outside of its body");
+        if (!isSafeToSpeculativelyExecute(&I))
+          return Reject("second loop may trap outside of its body");
+      }
+
+    // Follow the exit condition of L1 back through SSA values and the private
+    // allocas it loads from. Reaching the body means skipping the body would
+    // change the trip count.
+    SmallVector<Instruction *, 8> BodyWrites;
+    for (BasicBlock *BB : L1->blocks())
+      for (Instruction &I : *BB)
+        if (IsInBody(&I) && I.mayWriteToMemory())
+          BodyWrites.push_back(&I);
+
+    auto BodyMayWrite = [&](const Value *Obj) {
+      return any_of(BodyWrites,
+                    [&](Instruction *I) { return mayWriteToObject(*I, Obj); });
+    };
+
+    BranchInst *ExitBranch = dyn_cast<BranchInst>(Header->getTerminator());
+    if (!ExitBranch || !ExitBranch->isConditional())
+      return false;
+
+    SmallPtrSet<const Value *, 16> Visited;
+    SmallVector<const Value *, 16> Worklist = {ExitBranch->getCondition()};
+    while (!Worklist.empty()) {
+      const Instruction *I = dyn_cast<Instruction>(Worklist.pop_back_val());
+      if (!I || !L1->contains(I) || !Visited.insert(I).second)
+        continue;
+      if (IsInBody(I))
+        return Reject("exit condition of second loop depends on its body");
+      if (const LoadInst *LoadI = dyn_cast<LoadInst>(I)) {
+        const Value *Obj = getUnderlyingObject(LoadI->getPointerOperand());
+        if (!isIdentifiedObject(Obj) || BodyMayWrite(Obj))
+          return Reject("exit condition of second loop may read memory "
+                        "written by its body");
+        for (const User *U : Obj->users())
+          if (const StoreInst *SI = dyn_cast<StoreInst>(U))
+            Worklist.push_back(SI->getValueOperand());
+      }
+      for (const Value *Op : I->operands())
+        Worklist.push_back(Op);
+    }
+
+    // Values computed in the body only reach the rest of the loop through the
+    // latch. Everything that (transitively) uses them outside of the body will
+    // be executed with undef operands when the body is skipped.
+    SmallPtrSet<const Instruction *, 16> Tainted;
+    SmallVector<const Instruction *, 16> TaintWorklist;
+    for (BasicBlock *BB : L1->blocks())
+      for (Instruction &I : *BB)
+        if (IsInBody(&I))
+          TaintWorklist.push_back(&I);
+    while (!TaintWorklist.empty()) {
+      const Instruction *I = TaintWorklist.pop_back_val();
+      if (!Tainted.insert(I).second)
+        continue;
+      for (const User *U : I->users()) {
+        const Instruction *UI = cast<Instruction>(U);
+        const BasicBlock *UseBB = UI->getParent();
+        if (IsInBody(UI) || UseBB == Site.Join || !IsInRegion(UseBB))
+          continue;
+        if (!isa<PHINode>(UI) && !isSafeToSpeculativelyExecute(UI))
+          return Reject("second loop uses body values outside its body");
+        TaintWorklist.push_back(UI);
+      }
+    }
+
+    return true;
+  }
+
+  /// Split the else branch of the for-if/else-for \p Site off into a guard of
+  /// its own, on the same condition, that follows the then branch:
+  ///
+  ///   L0                        L0
+  ///   if (c)                    if (c)
+  ///     L1            ==>         L1
+  ///   else                      if (!c)
+  ///     L1Else                    L1Else
+  ///
+  /// The new guard block is placed between the exit block of L1 and the join
+  /// block, and the guard of L0 now skips to it instead of entering L1Else.
+  /// This turns the site into two for-if-for sites. Values flowing from L1 to
+  /// the join block are passed through the new guard block. The DT and PDT
+  /// updates are queued in DTU. Returns the new guard branch.
+  BranchInst *splitElseBranch(const ForIfForSite &Site) {
+    BranchInst *GuardBranch = Site.GuardBranch;
+    BasicBlock *GuardBlock = GuardBranch->getParent();
+    BasicBlock *ExitBlock1 = Site.L1->getExitBlock();
+    BasicBlock *PreheaderElse = Site.L1Else->getLoopPreheader();
+
+    BasicBlock *ElseGuard =
+        BasicBlock::Create(GuardBlock->getContext(), "prepass.else",
+                           GuardBlock->getParent(), PreheaderElse);
+    BranchInst *ElseBranch = BranchInst::Create(
+        Site.Join, PreheaderElse, GuardBranch->getCondition(), ElseGuard);
+    ElseBranch->copyMetadata(*GuardBranch);
+    if (Loop *ParentLoop = Site.L0->getParentLoop())
+      ParentLoop->addBasicBlockToLoop(ElseGuard, LI);
+
+    for (PHINode &PN : Site.Join->phis()) {
+      int Idx = PN.getBasicBlockIndex(ExitBlock1);
+      PHINode *Then = PHINode::Create(PN.getType(), 2, PN.getName() + ".then",
+                                      ElseBranch);
+      Then->addIncoming(PN.getIncomingValue(Idx), ExitBlock1);
+      Then->addIncoming(UndefValue::get(PN.getType()), GuardBlock);
+      PN.setIncomingBlock(Idx, ElseGuard);
+      PN.setIncomingValue(Idx, Then);
+    }
+
+    ExitBlock1->getTerminator()->replaceUsesOfWith(Site.Join, ElseGuard);
+    GuardBranch->setSuccessor(1, ElseGuard);
+    PreheaderElse->replacePhiUsesWith(GuardBlock, ElseGuard);
+
+    DTU.applyUpdates({{DominatorTree::Insert, GuardBlock, ElseGuard},
+                      {DominatorTree::Insert, ExitBlock1, ElseGuard},
+                      {DominatorTree::Insert, ElseGuard, Site.Join},
+                      {DominatorTree::Insert, ElseGuard, PreheaderElse},
+                      {DominatorTree::Delete, GuardBlock, PreheaderElse},
+                      {DominatorTree::Delete, ExitBlock1, Site.Join}});
+    return ElseBranch;
+  }
+
+  /// Move the guard of \p Site into the second loop, between its header and
+  /// its body, so that the first loop exits into the preheader of the second
+  /// loop. The guard condition is still computed once, before the loops, and
+  /// the body region of the second loop is left untouched: iterations for
+  /// which the guard does not hold branch from the new in-loop guard straight
+  /// to the latch. Returns the new in-loop guard branch.
+  ///
+  /// Only the edges around the body are changed. LI is updated as part of the
+  /// rewrite, while the DT and PDT updates are queued in DTU for the caller to
+  /// flush.
+  BranchInst *rearrangeSuccessors(const ForIfForSite &Site) {
+    Loop *L1 = Site.L1;
+    BranchInst *GuardBranch = Site.GuardBranch;
+    BasicBlock *GuardBlock = GuardBranch->getParent();
+    BasicBlock *Preheader1 = L1->getLoopPreheader();
+    BasicBlock *Header1 = L1->getHeader();
+    BasicBlock *Body1 = Site.getSecondLoopBody();
+    BasicBlock *Latch1 = L1->getLoopLatch();
+    Value *Cond = GuardBranch->getCondition();
+    bool EntryOnTrue = GuardBranch->getSuccessor(0) == Preheader1;
+
+    // Separate the part of the latch that belongs to the body from the part
+    // that advances the loop.
+    if (Instruction *LatchSplit = getLatchSplitPoint(Site))
+      Latch1 = SplitBlock(Latch1, LatchSplit, &DTU, &LI, nullptr,
+                          "prepass.latch");
+
+    SmallPtrSet<BasicBlock *, 16> BodyBlocks;
+    for (BasicBlock *BB : L1->blocks())
+      if (BB != Header1 && BB != Latch1)
+        BodyBlocks.insert(BB);
+    SmallVector<BasicBlock *, 4> LatchPreds(predecessors(Latch1));
+
+    // Create the in-loop guard on the edge from the header into the body.
+    BasicBlock *InLoopGuard =
+        BasicBlock::Create(Header1->getContext(), "prepass.guard",
+                           Header1->getParent(), Body1);
+    BranchInst *InLoopBranch = BranchInst::Create(
+        EntryOnTrue ? Body1 : Latch1, EntryOnTrue ? Latch1 : Body1, Cond,
+        InLoopGuard);
+    InLoopBranch->copyMetadata(*GuardBranch);
+    Header1->getTerminator()->replaceUsesOfWith(Body1, InLoopGuard);
+    Body1->replacePhiUsesWith(Header1, InLoopGuard);
+    L1->addBasicBlockToLoop(InLoopGuard, LI);
+
+    // Values computed in the body no longer dominate the latch. Merge them
+    // with undef coming from the in-loop guard.
+    for (PHINode &PN : Latch1->phis())
+      PN.addIncoming(UndefValue::get(PN.getType()), InLoopGuard);
+    for (BasicBlock *BB : BodyBlocks)
+      for (Instruction &I : *BB) {
+        auto IsOutsideBody = [&](Use &U) {
+          Instruction *UI = cast<Instruction>(U.getUser());
+          if (PHINode *PN = dyn_cast<PHINode>(UI))
+            return !BodyBlocks.count(PN->getIncomingBlock(U));
+          return !BodyBlocks.count(UI->getParent());
+        };
+        if (none_of(I.uses(), IsOutsideBody))
+          continue;
+        PHINode *PN = PHINode::Create(I.getType(), LatchPreds.size() + 1,
+                                      I.getName() + ".guarded",
+                                      &Latch1->front());
+        for (BasicBlock *Pred : LatchPreds)
+          PN->addIncoming(&I, Pred);
+        PN->addIncoming(UndefValue::get(I.getType()), InLoopGuard);
+        I.replaceUsesWithIf(PN, IsOutsideBody);
+      }
+
+    // The join block is now only reached through the second loop. Select the
+    // values that used to come directly from the guard.
+    Instruction *SelectPt = &*Site.Join->getFirstInsertionPt();
+    for (PHINode &PN : Site.Join->phis()) {
+      Value *Skipped = PN.removeIncomingValue(GuardBlock, false);
+      SelectInst *Sel = SelectInst::Create(
+          Cond, EntryOnTrue ? &PN : Skipped, EntryOnTrue ? Skipped : &PN,
+          PN.getName() + ".sel", SelectPt);
+      PN.replaceUsesWithIf(Sel, [Sel](Use &U) { return U.getUser() != Sel; });
+      SE.forgetValue(&PN);
+    }
+
+    // The guard block now unconditionally falls through into the preheader.
+    ReplaceInstWithInst(GuardBranch, BranchInst::Create(Preheader1));
+
+    DTU.applyUpdates({{DominatorTree::Insert, Header1, InLoopGuard},
+                      {DominatorTree::Insert, InLoopGuard, Body1},
+                      {DominatorTree::Insert, InLoopGuard, Latch1},
+                      {DominatorTree::Delete, Header1, Body1},
+                      {DominatorTree::Delete, GuardBlock, Site.Join}});
+
+    // Fold the preheader of the second loop into the guard block, making the
+    // guard block both the exit of the first loop and the preheader of the
+    // second one, i.e., the two loops become adjacent.
+    MergeBlockIntoPredecessor(Preheader1, &DTU, &LI);
+
+    SE.forgetLoop(L1);
+    return InLoopBranch;
+  }
+  
+  /// Collect the instructions of the block of \p Guard that compute its
+  /// condition into \p CondInsts, in program order. Returns false if they
+  /// cannot be hoisted into the preheader of \p L, i.e., if the condition
+  /// depends on \p L, through SSA values or through memory it may write, or if
+  /// it cannot be evaluated speculatively (\p L need not terminate, or run at
+  /// all).
+  bool collectGuardCondition(BranchInst *Guard, Loop *L,
+                             SmallVectorImpl<Instruction *> &CondInsts) const {
+    BasicBlock *GuardBlock = Guard->getParent();
+    SmallPtrSet<Instruction *, 8> InCond;
+    SmallVector<Value *, 8> Worklist = {Guard->getCondition()};
+    while (!Worklist.empty()) {
+      Instruction *I = dyn_cast<Instruction>(Worklist.pop_back_val());
+      if (!I)
+        continue;
+      if (I->getParent() != GuardBlock) {
+        if (L->contains(I))
+          return false;
+        continue;
+      }
+      if (isa<PHINode>(I) || !isSafeToSpeculativelyExecute(I))
+        return false;
+      if (InCond.insert(I).second)
+        append_range(Worklist, I->operands());
+    }
+
+    for (Instruction &I : *GuardBlock) {
+      if (!InCond.count(&I))
+        continue;
+      if (LoadInst *LoadI = dyn_cast<LoadInst>(&I)) {
+        if (!LoadI->isSimple())
+          return false;
+        const Value *Obj = getUnderlyingObject(LoadI->getPointerOperand());
+        auto MayClobber = [Obj](const Instruction &W) {
+          return mayWriteToObject(W, Obj);
+        };
+        for (BasicBlock *BB : L->blocks())
+          if (any_of(*BB, MayClobber))
+            return false;
+        if (any_of(make_range(GuardBlock->begin(), I.getIterator()),
+                   MayClobber))
+          return false;
+      }
+      CondInsts.push_back(&I);
+    }
+    return true;
+  }
+
+  /// Check whether the guard of \p Site can be versioned (see versionGuard)
+  /// and return the number of instructions versioning adds, i.e., the size of
+  /// the copy of the first loop and of its exit block.
+  Optional<unsigned> getVersioningCost(const ForIfForSite &Site) const {
+    auto Reject = [&](StringRef Reason) -> Optional<unsigned> {
+      FUSION_TRACE(TRACE_PREPASS, 1,
+                   "site " << Site.L0->getName() << " -> "
+                           << Site.L1->getName()
+                           << " not versioned: " << Reason);
+      return None;
+    };
+
+    BasicBlock *GuardBlock = Site.GuardBranch->getParent();
+    if (!Site.L0->getLoopPreheader() || !GuardBlock->getSinglePredecessor())
+      return Reject("first loop is not in simplified form");
+
+    SmallVector<Instruction *, 4> CondInsts;
+    if (!collectGuardCondition(Site.GuardBranch, Site.L0, CondInsts))
+      return Reject("guard cannot be evaluated before the first loop");
+
+    // The copy also gets a preheader, holding a single branch.
+    unsigned Cost = 1 + GuardBlock->size() - CondInsts.size();
+    for (BasicBlock *BB : Site.L0->blocks()) {
+      for (Instruction &I : *BB) {
+        if (I.getType()->isTokenTy())
+          return Reject("first loop defines a token");
+        if (const CallBase *CB = dyn_cast<CallBase>(&I))
+          if (CB->cannotDuplicate() || CB->isConvergent())
+            return Reject("first loop cannot be duplicated");
+      }
+      Cost += BB->size();
+    }
+    return Cost;
+  }
+
+  /// Version \p Site on its guard:
+  ///
+  ///   for (...) { A }          if (c) {
+  ///   if (c)           ==>       for (...) { A }
+  ///     for (...) { B }          for (...) { B }
+  ///                            } else {
+  ///                              for (...) { A }
+  ///                            }
+  ///
+  /// Unlike rearrangeSuccessors, this leaves no branch on the guard in the
+  /// loop that results from fusion, at the cost of a copy of the first loop.
+  /// The guard condition is hoisted into the preheader of L0, which becomes the
+  /// versioning block, and L0 is cloned together with its exit block. Values of
+  /// L0 used after the join block are merged with their copies. For a
+  /// for-if/else-for site the copy of L0 is followed by the else loop, so that
+  /// each path has a pair of loops to fuse.
+  ///
+  /// LI is updated and the new blocks are added to DT, as
+  /// cloneLoopWithPreheader requires, but the caller has to recompute DT and
+  /// PDT. Returns the number of instructions added.
+  unsigned versionGuard(ForIfForSite &Site) {
+    Loop *L0 = Site.L0;
+    BranchInst *GuardBranch = Site.GuardBranch;
+    BasicBlock *GuardBlock = GuardBranch->getParent();
+    BasicBlock *Preheader1 = Site.L1->getLoopPreheader();
+    Value *Cond = GuardBranch->getCondition();
+    bool EntryOnTrue = GuardBranch->getSuccessor(0) == Preheader1;
+
+    SmallVector<Instruction *, 4> CondInsts;
+    bool CanHoist = collectGuardCondition(GuardBranch, L0, CondInsts);
+    assert(CanHoist && "Guard of versioned site cannot be hoisted");
+    (void)CanHoist;
+
+    // Give L0 a new preheader and evaluate the guard in the old one.
+    BasicBlock *VersionBlock = L0->getLoopPreheader();
+    BasicBlock *Preheader0 = SplitEdge(VersionBlock, L0->getHeader(), &DT, &LI);
+    for (Instruction *I : CondInsts)
+      I->moveBefore(VersionBlock->getTerminator());
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 16> Blocks;
+    Site.L0Copy = cloneLoopWithPreheader(Site.Join, VersionBlock, L0, VMap,
+                                         ".unguarded", &LI, &DT, Blocks);
+    BasicBlock *ClonedGuardBlock =
+        CloneBasicBlock(GuardBlock, VMap, ".unguarded", GuardBlock->getParent());
+    ClonedGuardBlock->moveBefore(Site.Join);
+    VMap[GuardBlock] = ClonedGuardBlock;
+    Blocks.push_back(ClonedGuardBlock);
+    if (Loop *ParentLoop = L0->getParentLoop())
+      ParentLoop->addBasicBlockToLoop(ClonedGuardBlock, LI);
+    remapInstructionsInBlocks(Blocks, VMap);
+
+    // The copy of L0 runs when the guard does not hold and continues at the
+    // join block, or into L1Else, the original one always falls through into
+    // L1.
+    BasicBlock *ElseTarget =
+        Site.L1Else ? Site.L1Else->getLoopPreheader() : Site.Join;
+    BasicBlock *ClonedPreheader0 = cast<BasicBlock>(VMap[Preheader0]);
+    BranchInst *VersionBranch = BranchInst::Create(
+        EntryOnTrue ? Preheader0 : ClonedPreheader0,
+        EntryOnTrue ? ClonedPreheader0 : Preheader0, Cond);
+    VersionBranch->copyMetadata(*GuardBranch);
+    ReplaceInstWithInst(VersionBlock->getTerminator(), VersionBranch);
+    ReplaceInstWithInst(ClonedGuardBlock->getTerminator(),
+                        BranchInst::Create(ElseTarget));
+    ReplaceInstWithInst(GuardBranch, BranchInst::Create(Preheader1));
+
+    for (PHINode &PN : ElseTarget->phis()) {
+      int Idx = PN.getBasicBlockIndex(GuardBlock);
+      PN.setIncomingBlock(Idx, ClonedGuardBlock);
+      if (Value *Cloned = VMap.lookup(PN.getIncomingValue(Idx)))
+        PN.setIncomingValue(Idx, Cloned);
+      SE.forgetValue(&PN);
+    }
+
+    // Values of L0 and its exit block no longer dominate the join block.
+    SmallVector<BasicBlock *, 16> CopiedBlocks(L0->blocks());
+    CopiedBlocks.push_back(Preheader0);
+    CopiedBlocks.push_back(GuardBlock);
+    SmallPtrSet<BasicBlock *, 16> Copied(CopiedBlocks.begin(),
+                                         CopiedBlocks.end());
+    SSAUpdater SSA;
+    SmallVector<Use *, 8> UsesToRewrite;
+    for (BasicBlock *BB : CopiedBlocks)
+      for (Instruction &I : *BB) {
+        UsesToRewrite.clear();
+        for (Use &U : I.uses())
+          if (!Copied.count(cast<Instruction>(U.getUser())->getParent()))
+            UsesToRewrite.push_back(&U);
+        if (UsesToRewrite.empty())
+          continue;
+        SSA.Initialize(I.getType(), I.getName());
+        SSA.AddAvailableValue(BB, &I);
+        SSA.AddAvailableValue(cast<BasicBlock>(VMap[BB]), VMap[&I]);
+        for (Use *U : UsesToRewrite)
+          SSA.RewriteUse(*U);
+      }
+
+    // Make L0 and L1 adjacent, as rearrangeSuccessors does, and the copy of
+    // L0 and L1Else.
+    MergeBlockIntoPredecessor(Preheader1, &DTU, &LI);
+    if (Site.L1Else)
+      MergeBlockIntoPredecessor(ElseTarget, &DTU, &LI);
+    SE.forgetLoop(L0);
+
+    unsigned Growth = 0;
+    for (BasicBlock *BB : Blocks)
+      Growth += BB->size();
+    ORE.emit([&]() {
+      return OptimizationRemark(DEBUG_TYPE, "GuardVersioned",
+                                L0->getStartLoc(), VersionBlock)
+             << "versioned the guard of " << Site.L1->getName()
+             << ", adding " << ore::NV("Instructions", Growth)
+             << " instructions";
+    });
+    return Growth;
+  }
+
+  /// If-convert the in-loop guard \p BI created by rearrangeSuccessors, once
+  /// its loop has been fused, so that the fused loop body has no control flow
+  /// left that would keep it from being vectorized:
+  ///
+  ///   if (c) { B }     ==>     B', where every store *p = v in B becomes
+  ///                            *p = c ? v : *p
+  ///
+  /// This requires the guarded body to be a single block whose instructions
+  /// can be speculated. Loads, including the ones added for the stores, must
+  /// be known to be dereferenceable in every iteration of the loop. As the
+  /// stores now also write when the guard does not hold, this is only done
+  /// with -loop-fusion-if-convert-guards-proj. The DT and PDT updates are
+  /// queued in DTU for the caller to flush.
+  bool ifConvertGuard(BranchInst *BI) {
+    BasicBlock *GuardBB = BI->getParent();
+    Loop *L = LI.getLoopFor(GuardBB);
+    Value *Cond = BI->getCondition();
+
+    auto Reject = [&](StringRef Reason) {
+      FUSION_TRACE(TRACE_PREPASS, 1,
+                   "in-loop guard in " << GuardBB->getName()
+                                       << " not if-converted: " << Reason);
+      return false;
+    };
+
+    BasicBlock *Body = nullptr, *Skip = nullptr;
+    for (unsigned Idx = 0; Idx < 2; ++Idx) {
+      BasicBlock *Succ = BI->getSuccessor(Idx);
+      BasicBlock *Other = BI->getSuccessor(1 - Idx);
+      if (Succ != Other && Succ->getSinglePredecessor() == GuardBB &&
+          Succ->getSingleSuccessor() == Other) {
+        Body = Succ;
+        Skip = Other;
+      }
+    }
+    if (!L || !Body || !L->contains(Skip))
+      return Reject("guarded body is not a single block");
+    bool BodyOnTrue = BI->getSuccessor(0) == Body;
+    // L was just fused; what SE knows about it still describes one of the
+    // loops it was made of.
+    SE.forgetLoop(L);
+
+    SmallVector<StoreInst *, 8> Stores;
+    for (Instruction &I : Body->instructionsWithoutDebug()) {
+      if (I.isTerminator())
+        continue;
+      if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+        if (!SI->isSimple())
+          return Reject("guarded body has a volatile or atomic store");
+        Stores.push_back(SI);
+        continue;
+      }
+      if (LoadInst *LoadI = dyn_cast<LoadInst>(&I)) {
+        if (!LoadI->isSimple() ||
+            !isDereferenceableAndAlignedInLoop(LoadI, L, SE, DT))
+          return Reject("guarded body has a load that cannot be speculated");
+        continue;
+      }
+      if (isa<PHINode>(I) || !isSafeToSpeculativelyExecute(&I))
+        return Reject("guarded body cannot be speculated");
+    }
+
+    // Load the old value for every store; if one of them may trap, give up.
+    SmallVector<LoadInst *, 8> OldValues;
+    for (StoreInst *SI : Stores) {
+      Value *Ptr = SI->getPointerOperand();
+      OldValues.push_back(new LoadInst(SI->getValueOperand()->getType(), Ptr,
+                                       Ptr->getName() + ".old", false,
+                                       SI->getAlign(), SI));
+      if (!isDereferenceableAndAlignedInLoop(OldValues.back(), L, SE, DT)) {
+        for (LoadInst *LoadI : OldValues)
+          LoadI->eraseFromParent();
+        return Reject("guarded body has a store that cannot be speculated");
+      }
+    }
+
+    for (auto Pair : zip(Stores, OldValues)) {
+      StoreInst *SI = std::get<0>(Pair);
+      LoadInst *Old = std::get<1>(Pair);
+      Value *New = SI->getValueOperand();
+      SI->setOperand(0, SelectInst::Create(Cond, BodyOnTrue ? New : Old,
+                                           BodyOnTrue ? Old : New,
+                                           New->getName() + ".sel", SI));
+    }
+
+    // Values coming from the guard when the body is skipped are selected at
+    // the end of the body.
+    for (PHINode &PN : Skip->phis()) {
+      Value *Skipped = PN.removeIncomingValue(GuardBB, false);
+      Value *Taken = PN.getIncomingValueForBlock(Body);
+      if (isa<UndefValue>(Skipped))
+        continue;
+      SelectInst *Sel = SelectInst::Create(
+          Cond, BodyOnTrue ? Taken : Skipped, BodyOnTrue ? Skipped : Taken,
+          PN.getName() + ".sel", Body->getTerminator());
+      PN.setIncomingValue(PN.getBasicBlockIndex(Body), Sel);
+    }
+
+    ReplaceInstWithInst(BI, BranchInst::Create(Body));
+    DTU.applyUpdates({{DominatorTree::Delete, GuardBB, Skip}});
+    if (Skip->getSinglePredecessor())
+      FoldSingleEntryPHINodes(Skip);
+    MergeBlockIntoPredecessor(Body, &DTU, &LI);
+    SE.forgetLoop(L);
+
+    ++GuardsIfConverted;
+    FUSION_TRACE(TRACE_PREPASS, 1,
+                 "in-loop guard in " << GuardBB->getName()
+                                     << " if-converted, " << Stores.size()
+                                     << " stores predicated");
+    return true;
+  }
+
+  /// Promote the allocas in the entry block of \p F to registers, as mem2reg
+  /// does. Fusion, and the prepass before it (see canSinkGuard), need the
+  /// induction variables in SSA form to compute trip counts. The CFG is not
+  /// changed, so only SE has to be updated.
+  bool promoteAllocas(Function &F) {
+    BasicBlock &Entry = F.getEntryBlock();
+    SmallVector<AllocaInst *, 16> Allocas;
+    for (Instruction &I : Entry)
+      if (AllocaInst *AI = dyn_cast<AllocaInst>(&I))
+        if (isAllocaPromotable(AI))
+          Allocas.push_back(AI);
+    if (Allocas.empty())
+      return false;
+
+    PromoteMemToReg(Allocas, DT, &AC);
+    SE.forgetAllLoops();
+    return true;
+  }
+
+  /// Merge consecutive if-regions of \p F that are entered under equivalent
+  /// conditions:
+  ///
+  ///   if (c) { A }              S1;
+  ///   S;                 ==>    if (c) { A B }
+  ///   if (c) { B }              S2;
+  ///
+  /// where S1 is the longest prefix of S that can be hoisted above the first
+  /// region and S2 is the rest of S, which is sunk below the second region.
+  /// The loops in A and B are control flow equivalent afterwards, so that
+  /// fusion can consider them. Chains of regions are merged into the first
+  /// one. DT, PDT and LI are updated in place.
+  bool mergeGuardRegions(Function &F) {
+    if (!FusionMergeRegions)
+      return false;
+    DTU.flush();
+
+    SmallVector<WeakVH, 32> Blocks;
+    for (BasicBlock &BB : F)
+      Blocks.push_back(&BB);
+
+    bool Changed = false;
+    for (WeakVH &VH : Blocks)
+      if (BasicBlock *Guard = dyn_cast_or_null<BasicBlock>(VH))
+        while (mergeGuardRegion(Guard, Changed))
+          Changed = true;
+    return Changed;
+  }
+
+  /// Get the if-region guarded by the terminator of \p Guard: a conditional
+  /// branch to \p Then, which is entered from \p Guard only, and to \p Join,
+  /// which ends the region. Returns false if the terminator is no such branch.
+  bool getGuardRegion(BasicBlock *Guard, BasicBlock *&Then,
+                      BasicBlock *&Join) const {
+    auto *BI = dyn_cast<BranchInst>(Guard->getTerminator());
+    if (!BI || !BI->isConditional())
+      return false;
+    for (unsigned Idx = 0; Idx < 2; ++Idx) {
+      Then = BI->getSuccessor(Idx);
+      Join = BI->getSuccessor(1 - Idx);
+      if (Then != Join && Then->getSinglePredecessor() == Guard &&
+          DT.dominates(Guard, Join) && PDT.dominates(Join, Guard))
+        return true;
+    }
+    return false;
+  }
+
+  /// Merge the if-region guarded by the terminator of \p Guard with the
+  /// if-region guarded by the terminator of its join block, see
+  /// mergeGuardRegions. The code in the join block is moved out of it first,
+  /// so \p Changed is set if \p Guard was changed even though the regions
+  /// could not be merged in the end. Returns true if the regions were merged.
+  bool mergeGuardRegion(BasicBlock *Guard, bool &Changed) {
+    BasicBlock *Then1, *Join1, *Then2, *Join2;
+    if (!getGuardRegion(Guard, Then1, Join1) ||
+        !getGuardRegion(Join1, Then2, Join2))
+      return false;
+    Loop *L = LI.getLoopFor(Guard);
+    if (LI.getLoopFor(Join1) != L || LI.getLoopFor(Join2) != L ||
+        LI.isLoopHeader(Join1) || Join1->isEHPad() || Join2->isEHPad())
+      return false;
+
+    auto *BI1 = cast<BranchInst>(Guard->getTerminator());
+    auto *BI2 = cast<BranchInst>(Join1->getTerminator());
+    bool SameCondition =
+        BI1->getCondition() == BI2->getCondition() &&
+        (BI1->getSuccessor(0) == Then1) == (BI2->getSuccessor(0) == Then2);
+    if (!SameCondition && !haveEquivalentGuards(BI1, Then1, BI2, Then2))
+      return false;
+
+    auto Reject = [&](StringRef Reason) {
+      FUSION_TRACE(TRACE_PREPASS, 1,
+                   "if-regions guarded in " << Guard->getName() << " and "
+                                            << Join1->getName()
+                                            << " not merged: " << Reason);
+      return false;
+    };
+
+    // The instructions that only compute the condition of the second region
+    // are dropped with it, everything else in Join1 has to be moved.
+    SmallPtrSet<Instruction *, 8> Dropped;
+    Dropped.insert(BI2);
+    for (Instruction &I : reverse(*Join1))
+      if (!isa<PHINode>(I) && !I.mayHaveSideEffects() &&
+          all_of(I.users(), [&](User *U) {
+            return Dropped.count(cast<Instruction>(U));
+          }))
+        Dropped.insert(&I);
+
+    SmallVector<Instruction *, 8> Intervening;
+    for (Instruction &I : Join1->instructionsWithoutDebug())
+      if (!isa<PHINode>(I) && !Dropped.count(&I))
+        Intervening.push_back(&I);
+
+    // Hoist the longest prefix of the intervening code above the first region
+    // and sink the rest below the second one, keeping the order.
+    auto *SinkBegin = Intervening.begin();
+    for (; SinkBegin != Intervening.end(); ++SinkBegin) {
+      if (!isSafeToMoveBefore(**SinkBegin, *BI1, DT, &PDT, &DI))
+        break;
+      (*SinkBegin)->moveBefore(BI1);
+      Changed = true;
+    }
+    for (Instruction *I : reverse(make_range(SinkBegin, Intervening.end()))) {
+      Instruction *SinkPos = Join2->getFirstNonPHI();
+      if (!isSafeToMoveBefore(*I, *SinkPos, DT, &PDT, &DI))
+        return Reject("intervening code cannot be moved");
+      I->moveBefore(SinkPos);
+      Changed = true;
+    }
+
+    SmallSetVector<BasicBlock *, 4> Region1Exits;
+    for (BasicBlock *Pred : predecessors(Join1))
+      if (Pred != Guard)
+        Region1Exits.insert(Pred);
+    BasicBlock *ThenJoin = SplitBlockPredecessors(
+        Join1, Region1Exits.getArrayRef(), ".merged", &DTU, &LI);
+    if (!ThenJoin)
+      return Reject("region exits cannot be split");
+    Changed = true;
+
+    // Join1 now has the predecessors Guard and ThenJoin. Its phis are
+    // replaced by the values coming from either of them, phis are inserted
+    // where the paths meet again.
+    SmallVector<std::unique_ptr<SSAUpdater>, 4> Updaters;
+    SmallVector<PHINode *, 4> PHIs;
+    for (PHINode &PN : Join1->phis()) {
+      auto SSA = std::make_unique<SSAUpdater>();
+      SSA->Initialize(PN.getType(), PN.getName());
+      SSA->AddAvailableValue(Guard, PN.getIncomingValueForBlock(Guard));
+      SSA->AddAvailableValue(ThenJoin, PN.getIncomingValueForBlock(ThenJoin));
+      Updaters.push_back(std::move(SSA));
+      PHIs.push_back(&PN);
+    }
+
+    // Guard skips both regions, ThenJoin falls through into the second one.
+    BI1->setSuccessor(BI1->getSuccessor(0) == Join1 ? 0 : 1, Join2);
+    Join2->replacePhiUsesWith(Join1, Guard);
+    ThenJoin->getTerminator()->setSuccessor(0, Then2);
+    Then2->replacePhiUsesWith(Join1, ThenJoin);
+
+    std::string Join1Name = Join1->getName().str();
+    for (Instruction &I : make_early_inc_range(reverse(*Join1)))
+      if (Dropped.count(&I))
+        I.eraseFromParent();
+    new UnreachableInst(Join1->getContext(), Join1);
+
+    for (unsigned Idx = 0, E = PHIs.size(); Idx < E; ++Idx) {
+      SE.forgetValue(PHIs[Idx]);
+      for (Use &U : make_early_inc_range(PHIs[Idx]->uses()))
+        Updaters[Idx]->RewriteUse(U);
+      PHIs[Idx]->eraseFromParent();
+    }
+
+    DTU.applyUpdates({{DominatorTree::Delete, Guard, Join1},
+                      {DominatorTree::Insert, Guard, Join2},
+                      {DominatorTree::Delete, ThenJoin, Join1},
+                      {DominatorTree::Insert, ThenJoin, Then2},
+                      {DominatorTree::Delete, Join1, Then2},
+                      {DominatorTree::Delete, Join1, Join2}});
+    LI.removeBlock(Join1);
+    DTU.deleteBB(Join1);
+    MergeBlockIntoPredecessor(Then2, &DTU, &LI);
+    MergeBlockIntoPredecessor(ThenJoin, &DTU, &LI);
+    DTU.flush();
+
+#ifndef NDEBUG
+    assert(!verifyFunction(*Guard->getParent(), &errs()));
+    assert(DT.verify(DominatorTree::VerificationLevel::Fast));
+    assert(PDT.verify());
+    LI.verify(DT);
+#endif
+
+    ++GuardRegionsMerged;
+    FUSION_TRACE(TRACE_PREPASS, 1,
+                 "if-regions guarded in " << Guard->getName() << " and "
+                                          << Join1Name << " merged");
+    return true;
+  }
+
+  /// Put all loops of \p F into the form required by fusion: simplified,
+  /// rotated and in LCSSA form, as -loop-simplify, -loop-rotate and -lcssa
+  /// would, with no blocks between the exit of a loop and the preheader of
+  /// the next one. DT, LI and SE are updated in place, PDT is recomputed if
+  /// the CFG changed.
+  bool canonicalizeLoops(Function &F) {
+    // Same header duplication limit as the default of -loop-rotate.
+    const unsigned RotationMaxHeaderSize = 16;
+    const SimplifyQuery SQ(DL, nullptr, &DT, &AC);
+
+    bool Changed = false;
+    for (Loop *L : LI)
+      Changed |= simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr,
+                              /* PreserveLCSSA */ false);
+
+    // Rotate inner loops before their parents, as the loop pass manager does.
+    SmallVector<Loop *, 16> Loops = LI.getLoopsInPreorder();
+    for (Loop *L : reverse(Loops))
+      Changed |= LoopRotation(L, &LI, &TTI, &AC, &DT, &SE, nullptr, SQ,
+                              /* RotationOnly */ false, RotationMaxHeaderSize,
+                              /* IsUtilMode */ false);
+
+    // Rotation can leave phis merging a single value in the loop, e.g., in the
+    // latch of a loop whose body is guarded, which hide the induction
+    // variable from SE.
+    for (Loop *L : Loops)
+      for (BasicBlock *BB : L->blocks())
+        for (PHINode &PN : make_early_inc_range(BB->phis()))
+          if (Value *V = PN.hasConstantValue()) {
+            if (V == &PN)
+              continue;
+            SE.forgetValue(&PN);
+            PN.replaceAllUsesWith(V);
+            PN.eraseFromParent();
+            Changed = true;
+          }
+
+    // Rotation can leave loops without dedicated exits.
+    for (Loop *L : LI) {
+      Changed |= simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr,
+                              /* PreserveLCSSA */ false);
+      Changed |= formLCSSARecursively(*L, DT, &LI, &SE);
+    }
+
+    // A block between the exit of a loop and the preheader of the next loop,
+    // like the join block of a rewritten site, makes the loops non-adjacent.
+    // Merge it into the exit block, so that chains of loops can be fused.
+    DomTreeUpdater EagerDTU(&DT, nullptr,
+                            DomTreeUpdater::UpdateStrategy::Eager);
+    for (Loop *L : Loops) {
+      BasicBlock *Exit = L->getExitBlock();
+      BasicBlock *Succ = Exit ? Exit->getSingleSuccessor() : nullptr;
+      if (!Succ || Succ->getSinglePredecessor() != Exit ||
+          !Succ->getSingleSuccessor())
+        continue;
+      Loop *Next = LI.getLoopFor(Succ->getSingleSuccessor());
+      if (Next && Next->getParentLoop() == L->getParentLoop() &&
+          Next->getLoopPreheader() == Succ)
+        Changed |= MergeBlockIntoPredecessor(Succ, &EagerDTU, &LI);
+    }
+
+    if (Changed)
+      PDT.recalculate(F);
+    return Changed;
+  }
+
+  /// This is the main entry point for loop fusion. It will traverse the
+  /// specified function and collect candidate loops to fuse, starting at the
+  /// outermost nesting level and working inwards.
+  bool fuseLoops(Function &F) {
+#ifndef NDEBUG
+    if (VerboseFusionDebugging) {
+      LI.print(dbgs());
+    }
+#endif
+  
+    LLVM_DEBUG(dbgs() << "Performing Loop Fusion on function " << F.getName()
+                      << "\n");
+    bool Changed = false;
+  
+    while (!LDT.empty()) {
+      LLVM_DEBUG(dbgs() << "Got " << LDT.size() << " loop sets for depth "
+                        << LDT.getDepth() << "\n";);
+  
+      for (const LoopVector &LV : LDT) {
+        assert(LV.size() > 0 && "Empty loop set was build!");
+  
+        // Skip singleton loop sets as they do not offer fusion opportunities on
+        // this level.
+        if (LV.size() == 1)
+          continue;
+#ifndef NDEBUG
+        if (VerboseFusionDebugging) {
+          LLVM_DEBUG({
+            dbgs() << "  Visit loop set (#" << LV.size() << "):\n";
+            printLoopVector(LV);
+          });
+        }
+#endif
+  
+        collectFusionCandidates(LV);
+        Changed |= fuseCandidates();
+      }
+  
+      // Finished analyzing candidates at this level.
+      // Descend to the next level and clear all of the candidates currently
+      // collected. Note that it will not be possible to fuse any of the
+      // existing candidates with new candidates because the new candidates will
+      // be at a different nest level and thus not be control flow equivalent
+      // with all of the candidates collected so far.
+      LLVM_DEBUG(dbgs() << "Descend one level!\n");
+      LDT.descend();
+      FusionCandidates.clear();
+    }
+  
+    if (Changed)
+      LLVM_DEBUG(dbgs() << "Function after Loop Fusion: \n"; F.dump(););
+  
+#ifndef NDEBUG
+    assert(DT.verify());
+    assert(PDT.verify());
+    LI.verify(DT);
+    SE.verify();
+#endif
+  
+    LLVM_DEBUG(dbgs() << "Loop Fusion complete\n");
+    return Changed;
+  }
+  
+private:
+  /// Determine if two fusion candidates are control flow equivalent.
+  ///
+  /// Two fusion candidates are control flow equivalent if when one executes,
   /// the other is guaranteed to execute. This is determined using dominators
   /// and post-dominators: if A dominates B and B post-dominates A then A and B
   /// are control-flow equivalent.
@@ -863,33 +2864,26 @@ private:
   /// are eligible for fusion. Place all eligible fusion candidates into Control
   /// Flow Equivalent sets, sorted by dominance.
   void collectFusionCandidates(const LoopVector &LV) {
-
-    errs() << "starting collectFusionCandidates()\n";
-
     for (Loop *L : LV) {
-      errs() << "LV loop iteration **********\n";
       TTI::PeelingPreferences PP =
           gatherPeelingPreferences(L, SE, TTI, None, None);
       FusionCandidate CurrCand(L, &DT, &PDT, ORE, PP);
-      errs() << "HERE1" << "\n";
-      if (!CurrCand.isEligibleForFusion(SE)) {
-        errs() << "   *** ineligible for fusion ***   \n";
+      if (!CurrCand.isEligibleForFusion(SE))
         continue;
-      }
-      errs() << "HERE2" << "\n";
       // Go through each list in FusionCandidates and determine if L is control
       // flow equivalent with the first loop in that list. If it is, append LV.
       // If not, go to the next list.
       // If no suitable list is found, start another list and add it to
       // FusionCandidates.
       bool FoundSet = false;
-      errs() << "Number FusionCandidates" << FusionCandidates.size() << "\n";
       for (auto &CurrCandSet : FusionCandidates) {
-        errs() << CurrCand << " is control flow equiv?: " << isControlFlowEquivalent(*CurrCandSet.begin(), CurrCand) << "\n";
         if (isControlFlowEquivalent(*CurrCandSet.begin(), CurrCand)) {
           CurrCandSet.insert(CurrCand);
           FoundSet = true;
-            errs() << "Adding" << CurrCand << " to existing candidate set\n";
+          FUSION_TRACE(TRACE_CANDIDATES, 1,
+                       "loop " << L->getName() << " accepted, control flow "
+                               << "equivalent to "
+                               << CurrCandSet.begin()->L->getName());
 #ifndef NDEBUG
           if (VerboseFusionDebugging)
             LLVM_DEBUG(dbgs() << "Adding " << CurrCand
@@ -907,12 +2901,437 @@ private:
         FusionCandidateSet NewCandSet;
         NewCandSet.insert(CurrCand);
         FusionCandidates.push_back(NewCandSet);
+        FUSION_TRACE(TRACE_CANDIDATES, 1,
+                     "loop " << L->getName() << " accepted, new set");
       }
       NumFusionCandidates++;
     }
-    errs() << "NumFusionCandidates: " << NumFusionCandidates << '\n';
   }
   
+  /// Remove the guard of whichever of the adjacent candidates \p FC0 and \p FC1
+  /// is guarded, if the conditions dominating the guard block prove that it
+  /// always enters its loop, and replace both candidates with new ones for
+  /// the changed loops. Adding a guard on the same condition to the other
+  /// loop would be just as sound, but as the condition is known to hold, both
+  /// loops are left unguarded instead.
+  ///
+  /// The preheader of the loop is merged into the guard block, and if the first
+  /// candidate was guarded, the preheader of the second one into the exit
+  /// block of the first, to keep the loops adjacent. Returns false, without
+  /// changing anything, if the guard cannot be proved to hold.
+  bool removeImpliedGuard(FusionCandidateSet &CandidateSet,
+                          FusionCandidateSet::iterator &FC0,
+                          FusionCandidateSet::iterator &FC1) {
+    bool FirstGuarded = FC0->GuardBranch;
+    const FusionCandidate &FC = FirstGuarded ? *FC0 : *FC1;
+    ICmpInst::Predicate Pred;
+    const SCEV *LHS, *RHS;
+    if (!getGuardEntryCondition(FC.GuardBranch, FC.Preheader, Pred, LHS, RHS))
+      return false;
+
+    BranchInst *GuardBranch = FC.GuardBranch;
+    BasicBlock *GuardBlock = GuardBranch->getParent();
+    if (!SE.isKnownPredicate(Pred, LHS, RHS) &&
+        !SE.isBasicBlockEntryGuardedByCond(GuardBlock, Pred, LHS, RHS))
+      return false;
+
+    FUSION_TRACE(TRACE_FUSION, 1,
+                 "guard of loop " << FC.L->getName() << " in "
+                                  << GuardBlock->getParent()->getName()
+                                  << " always holds, removed");
+    BasicBlock *NonLoopBlock = FC.getNonLoopBlock();
+    Value *Cond = GuardBranch->getCondition();
+    NonLoopBlock->removePredecessor(GuardBlock);
+    ReplaceInstWithInst(GuardBranch, BranchInst::Create(FC.Preheader));
+    RecursivelyDeleteTriviallyDeadInstructions(Cond);
+    DTU.applyUpdates({{DominatorTree::Delete, GuardBlock, NonLoopBlock}});
+    MergeBlockIntoPredecessor(FC.Preheader, &DTU, &LI);
+    if (FirstGuarded)
+      MergeBlockIntoPredecessor(FC1->Preheader, &DTU, &LI);
+    DTU.flush();
+    SE.forgetLoop(FC0->L);
+    SE.forgetLoop(FC1->L);
+    ++ImpliedGuardsRemoved;
+
+    FusionCandidate NewFC0(FC0->L, &DT, &PDT, ORE, FC0->PP);
+    FusionCandidate NewFC1(FC1->L, &DT, &PDT, ORE, FC1->PP);
+    CandidateSet.erase(FC0);
+    CandidateSet.erase(FC1);
+    FC0 = CandidateSet.insert(NewFC0).first;
+    FC1 = CandidateSet.insert(NewFC1).first;
+    return true;
+  }
+
+  /// Move the code between \p FC0 and \p FC1 out of their way, so that they
+  /// become adjacent and the preheader of \p FC1 holds no instructions that
+  /// keep them from being fused.
+  ///
+  /// Straight-line code is moved instruction by instruction: the longest
+  /// prefix that is safe to hoist goes to the end of the entry block of
+  /// \p FC0, the rest is sunk to the beginning of the block following \p FC1.
+  /// Lifetime markers and debug intrinsics are dropped. Code with control flow
+  /// of its own, e.g., an if or another loop, is moved as a single-entry
+  /// single-exit region either above \p FC0 or below \p FC1, if it has no
+  /// dependences on that candidate. At most
+  /// -loop-fusion-move-intervening-max-proj instructions are moved, and only
+  /// if nothing else keeps the candidates from being fused, so that code does
+  /// not move back and forth between rounds. If \p MayAlign is set,
+  /// dependences that aligning the loops keeps (see alignFusionCandidates) do
+  /// not count as keeping them from being fused.
+  ///
+  /// Returns true if the code was moved. Then the candidates of the moved
+  /// loops are put at their new place in \p CandidateSet, see
+  /// updateCandidates, and \p FC0 and \p FC1 point to new candidates for the
+  /// changed loops. Otherwise nothing is changed.
+  bool moveInterveningCode(FusionCandidateSet &CandidateSet,
+                           FusionCandidateSet::iterator &FC0,
+                           FusionCandidateSet::iterator &FC1,
+                           bool MayAlign) {
+    if (!FusionMoveInterveningMax || !FC0->GuardBranch != !FC1->GuardBranch)
+      return false;
+
+    bool Guarded = FC0->GuardBranch;
+    BasicBlock *Exit0 = Guarded ? FC0->getNonLoopBlock() : FC0->ExitBlock;
+    BasicBlock *Entry1 = FC1->getEntryBlock();
+
+    // Follow the straight-line code from the exit of FC0.
+    SmallVector<BasicBlock *, 4> Path = {Exit0};
+    while (Path.back() != Entry1) {
+      BasicBlock *Next = Path.back()->getSingleSuccessor();
+      if (!Next || Next->getSinglePredecessor() != Path.back())
+        break;
+      Path.push_back(Next);
+    }
+
+    SmallVector<Instruction *, 16> Insts;
+    SmallSetVector<BasicBlock *, 16> Region;
+    if (Path.back() == Entry1) {
+      // The computation of the guard condition of FC1 stays in its guard
+      // block, which is merged with the one of FC0 when they are fused.
+      SmallPtrSet<Instruction *, 4> GuardCond;
+      if (Guarded) {
+        SmallVector<Value *, 4> Worklist = {FC1->GuardBranch->getCondition()};
+        while (!Worklist.empty()) {
+          auto *I = dyn_cast<Instruction>(Worklist.pop_back_val());
+          if (I && I->getParent() == Entry1 && !isa<PHINode>(I) &&
+              GuardCond.insert(I).second)
+            append_range(Worklist, I->operands());
+        }
+      }
+      for (BasicBlock *BB : Path)
+        for (Instruction &I : *BB)
+          if (!isa<PHINode>(I) && !I.isTerminator() && !GuardCond.count(&I))
+            Insts.push_back(&I);
+      if (Insts.empty() && Exit0 == Entry1)
+        return false;
+    } else {
+      Region = collectInterveningRegion(Exit0, Entry1);
+      if (Region.empty())
+        return false;
+      for (Instruction &I : *Exit0)
+        if (!isa<PHINode>(I))
+          Insts.push_back(&I);
+      for (BasicBlock *BB : Region)
+        for (Instruction &I : *BB)
+          Insts.push_back(&I);
+    }
+
+    auto Reject = [&](StringRef Reason) {
+      FUSION_TRACE(TRACE_FUSION, 1,
+                   "code between loops " << FC0->L->getName() << " and "
+                                         << FC1->L->getName()
+                                         << " not moved: " << Reason);
+      return false;
+    };
+    if (Insts.size() > FusionMoveInterveningMax)
+      return Reject("too many instructions");
+    unsigned Shift = 0;
+    if ((Guarded && !haveIdenticalGuards(*FC0, *FC1)) ||
+        !dependencesAllowFusion(*FC0, *FC1, nullptr,
+                                MayAlign ? &Shift : nullptr))
+      return false;
+
+    DTU.flush();
+    StringRef Where;
+    bool Hoisted = false;
+    if (Region.empty()) {
+      if (!moveInterveningInsts(*FC0, *FC1, Insts))
+        return Reject("an instruction can be neither hoisted nor sunk");
+      Where = "hoisted and sunk";
+    } else if (canHoistRegion(*FC0, Exit0, Region, Insts)) {
+      moveRegion(Exit0, Entry1, FC0->getEntryBlock(), /* Hoist */ true);
+      Where = "hoisted";
+      Hoisted = true;
+    } else if (canSinkRegion(*FC1, Insts)) {
+      moveRegion(Exit0, Entry1,
+                 Guarded ? FC1->getNonLoopBlock() : FC1->ExitBlock,
+                 /* Hoist */ false);
+      Where = "sunk";
+    } else {
+      return Reject("dependences on both loops");
+    }
+
+    // The blocks between the candidates are empty now.
+    while (Exit0 != Entry1) {
+      BasicBlock *Succ = Exit0->getSingleSuccessor();
+      if (!Succ || !MergeBlockIntoPredecessor(Succ, &DTU, &LI))
+        break;
+      if (Succ == Entry1)
+        Entry1 = Exit0;
+    }
+    DTU.flush();
+    if (!Region.empty())
+      SE.forgetAllLoops();
+    ++InterveningCodeMoved;
+    FUSION_TRACE(TRACE_FUSION, 1,
+                 "code between loops " << FC0->L->getName() << " and "
+                                       << FC1->L->getName() << " " << Where);
+    for (BasicBlock *BB : Region) {
+      Loop *L = LI.getLoopFor(BB);
+      if (!L || L->getHeader() != BB ||
+          L->getParentLoop() != FC0->L->getParentLoop())
+        continue;
+      ++InterveningLoopsMoved;
+      FUSION_TRACE(TRACE_FUSION, 1,
+                   "loop " << L->getName() << " moved "
+                           << (Hoisted ? "above loop " : "below loop ")
+                           << (Hoisted ? FC0->L : FC1->L)->getName());
+    }
+
+    updateCandidates(CandidateSet, Region, FC0, FC1);
+    return true;
+  }
+
+  /// Erase the candidates of \p CandidateSet whose loops were moved with the
+  /// intervening \p Region, or whose blocks are out of sync after moving it
+  /// or peeling a neighbour, and insert new ones for their loops at their new
+  /// place. \p FC0 and \p FC1
+  /// are always renewed and point to the new candidates afterwards. All other
+  /// iterators stay valid.
+  void updateCandidates(FusionCandidateSet &CandidateSet,
+                        const SmallSetVector<BasicBlock *, 16> &Region,
+                        FusionCandidateSet::iterator &FC0,
+                        FusionCandidateSet::iterator &FC1) {
+    // All stale candidates have to be erased before any is inserted, as the
+    // ordering looks at their blocks.
+    Loop *L0 = FC0->L, *L1 = FC1->L;
+    SmallVector<FusionCandidate, 4> Renewed;
+    for (auto It = CandidateSet.begin(); It != CandidateSet.end();) {
+      if (It != FC0 && It != FC1 && !Region.count(It->Header) &&
+          It->isInSync()) {
+        ++It;
+        continue;
+      }
+      Renewed.emplace_back(It->L, &DT, &PDT, ORE, It->PP);
+      It = CandidateSet.erase(It);
+    }
+    for (const FusionCandidate &FC : Renewed) {
+      auto It = CandidateSet.insert(FC).first;
+      if (FC.L == L0)
+        FC0 = It;
+      if (FC.L == L1)
+        FC1 = It;
+    }
+  }
+
+  /// Move the straight-line code \p Insts between \p FC0 and \p FC1 out of
+  /// their way, see moveInterveningCode. Returns false and restores the
+  /// original order if an instruction can be neither hoisted nor sunk.
+  bool moveInterveningInsts(const FusionCandidate &FC0,
+                            const FusionCandidate &FC1,
+                            ArrayRef<Instruction *> Insts) {
+    SmallVector<Instruction *, 16> ToMove, ToDrop;
+    for (Instruction *I : Insts)
+      (I->isLifetimeStartOrEnd() || isa<DbgInfoIntrinsic>(I) ? ToDrop : ToMove)
+          .push_back(I);
+
+    // Every instruction with the instruction that followed it.
+    SmallVector<std::pair<Instruction *, Instruction *>, 16> Moves;
+    auto Move = [&](Instruction *I, Instruction *MovePos) {
+      if (!isSafeToMoveBefore(*I, *MovePos, DT, &PDT, &DI))
+        return false;
+      Moves.emplace_back(I, I->getNextNode());
+      I->moveBefore(MovePos);
+      return true;
+    };
+
+    Instruction *HoistPos = FC0.getEntryBlock()->getTerminator();
+    BasicBlock *SinkBB = FC1.GuardBranch ? FC1.getNonLoopBlock() : FC1.ExitBlock;
+    auto *SinkBegin = ToMove.begin();
+    while (SinkBegin != ToMove.end() && Move(*SinkBegin, HoistPos))
+      ++SinkBegin;
+    for (Instruction *I : reverse(make_range(SinkBegin, ToMove.end())))
+      if (!Move(I, &*SinkBB->getFirstInsertionPt())) {
+        for (auto &Moved : reverse(Moves))
+          Moved.first->moveBefore(Moved.second);
+        return false;
+      }
+
+    for (Instruction *I : ToDrop)
+      I->eraseFromParent();
+    return true;
+  }
+
+  /// Collect the blocks between \p Exit0, the block that the code following
+  /// the first candidate starts in, and \p Entry1, the entry block of the
+  /// second candidate. Returns an empty set unless they form a single-entry
+  /// single-exit region with only branches and switches as terminators.
+  SmallSetVector<BasicBlock *, 16>
+  collectInterveningRegion(BasicBlock *Exit0, BasicBlock *Entry1) const {
+    SmallSetVector<BasicBlock *, 16> Region;
+    SmallVector<BasicBlock *, 16> Worklist(successors(Exit0));
+    unsigned NumInsts = 0;
+    while (!Worklist.empty()) {
+      BasicBlock *BB = Worklist.pop_back_val();
+      if (BB == Entry1 || !Region.insert(BB))
+        continue;
+      NumInsts += BB->size();
+      if (NumInsts > FusionMoveInterveningMax)
+        return {};
+      append_range(Worklist, successors(BB));
+    }
+
+    if (!PDT.dominates(Entry1, Exit0) ||
+        !isa<BranchInst, SwitchInst>(Exit0->getTerminator()) ||
+        any_of(predecessors(Entry1), [&](BasicBlock *Pred) {
+          return Pred != Exit0 && !Region.count(Pred);
+        }))
+      return {};
+    for (BasicBlock *BB : Region) {
+      if (!isa<BranchInst, SwitchInst>(BB->getTerminator()) ||
+          BB->hasAddressTaken())
+        return {};
+      for (BasicBlock *Pred : predecessors(BB))
+        if (Pred != Exit0 && !Region.count(Pred))
+          return {};
+    }
+    return Region;
+  }
+
+  /// Return true if the code in \p Insts can be reordered with the code in
+  /// \p Blocks: there are no dependences between them, and neither side may
+  /// skip the side effects of the other by throwing or not returning.
+  bool canReorder(ArrayRef<Instruction *> Insts,
+                  ArrayRef<BasicBlock *> Blocks) {
+    auto MayNotContinue = [](const Instruction *I) {
+      return I->mayThrow() || !I->willReturn();
+    };
+    bool InstsMayNotContinue = any_of(Insts, MayNotContinue);
+    bool InstsHaveSideEffects = any_of(
+        Insts, [](const Instruction *I) { return I->mayHaveSideEffects(); });
+
+    for (BasicBlock *BB : Blocks)
+      for (Instruction &Other : *BB) {
+        if ((InstsMayNotContinue && Other.mayHaveSideEffects()) ||
+            (InstsHaveSideEffects && MayNotContinue(&Other)))
+          return false;
+        if (!Other.mayReadOrWriteMemory())
+          continue;
+        for (Instruction *I : Insts)
+          if (I->mayReadOrWriteMemory() &&
+              (I->mayWriteToMemory() || Other.mayWriteToMemory()) &&
+              DI.depends(I, &Other, true))
+            return false;
+      }
+    return true;
+  }
+
+  /// Collect the blocks from \p Entry up to, but not including, \p Exit.
+  static SmallVector<BasicBlock *, 16> collectBlocksBetween(BasicBlock *Entry,
+                                                            BasicBlock *Exit) {
+    SmallSetVector<BasicBlock *, 16> Blocks;
+    SmallVector<BasicBlock *, 16> Worklist = {Entry};
+    while (!Worklist.empty()) {
+      BasicBlock *BB = Worklist.pop_back_val();
+      if (BB != Exit && Blocks.insert(BB))
+        append_range(Worklist, successors(BB));
+    }
+    return Blocks.takeVector();
+  }
+
+  /// Return true if the intervening \p Region, with the instructions \p Insts
+  /// including the ones in \p Exit0, can be moved above \p FC0.
+  bool canHoistRegion(const FusionCandidate &FC0, BasicBlock *Exit0,
+                      const SmallSetVector<BasicBlock *, 16> &Region,
+                      ArrayRef<Instruction *> Insts) {
+    BasicBlock *Entry0 = FC0.getEntryBlock();
+    if (!isa<BranchInst>(Entry0->getTerminator()))
+      return false;
+
+    // The operands have to be available at the end of the entry block of FC0,
+    // where the region is put.
+    for (Instruction *I : Insts)
+      for (Value *Op : I->operands())
+        if (auto *OpInst = dyn_cast<Instruction>(Op)) {
+          BasicBlock *OpBB = OpInst->getParent();
+          if (!Region.count(OpBB) &&
+              !(OpBB == Exit0 && !isa<PHINode>(OpInst)) &&
+              !DT.dominates(OpBB, Entry0))
+            return false;
+        }
+    return canReorder(Insts, collectBlocksBetween(Entry0, Exit0));
+  }
+
+  /// Return true if the intervening region with the instructions \p Insts
+  /// can be moved below \p FC1.
+  bool canSinkRegion(const FusionCandidate &FC1,
+                     ArrayRef<Instruction *> Insts) {
+    BasicBlock *Exit1 = FC1.GuardBranch ? FC1.getNonLoopBlock() : FC1.ExitBlock;
+    SmallVector<BasicBlock *, 16> Blocks =
+        collectBlocksBetween(FC1.getEntryBlock(), Exit1);
+
+    // FC1 must not use any of the values, including the phis in Exit1, which
+    // stay above the region.
+    SmallPtrSet<BasicBlock *, 16> BlockSet(Blocks.begin(), Blocks.end());
+    for (Instruction *I : Insts)
+      for (Use &U : I->uses()) {
+        auto *User = cast<Instruction>(U.getUser());
+        BasicBlock *UseBB = User->getParent();
+        if (auto *PN = dyn_cast<PHINode>(User))
+          UseBB = PN->getIncomingBlock(U);
+        if (BlockSet.count(UseBB))
+          return false;
+      }
+    return canReorder(Insts, Blocks);
+  }
+
+  /// Move the intervening region, the code from the first non-phi of \p Exit0
+  /// up to \p Entry1, right before the terminator of \p Target if \p Hoist is
+  /// true, or right after the phis of \p Target otherwise. \p Exit0 branches
+  /// to \p Entry1 afterwards. The region is never put on an edge leaving a
+  /// loop, so that exit blocks stay in LCSSA form. DT and PDT updates are
+  /// queued in DTU.
+  void moveRegion(BasicBlock *Exit0, BasicBlock *Entry1, BasicBlock *Target,
+                  bool Hoist) {
+    BasicBlock *RegionEntry =
+        SplitBlock(Exit0, Exit0->getFirstNonPHI(), &DTU, &LI);
+    BasicBlock *RegionExit = Entry1->getSinglePredecessor();
+    if (!RegionExit) {
+      SmallVector<BasicBlock *, 4> Preds(predecessors(Entry1));
+      RegionExit = SplitBlockPredecessors(Entry1, Preds, ".intervening", &DTU,
+                                          &LI);
+    }
+
+    // Splice the region into the edge from Before to After.
+    BasicBlock *Before = Target;
+    BasicBlock *After =
+        SplitBlock(Target,
+                   Hoist ? Target->getTerminator() : Target->getFirstNonPHI(),
+                   &DTU, &LI);
+
+    Exit0->getTerminator()->replaceSuccessorWith(RegionEntry, Entry1);
+    Entry1->replacePhiUsesWith(RegionExit, Exit0);
+    RegionExit->getTerminator()->replaceSuccessorWith(Entry1, After);
+    Before->getTerminator()->replaceSuccessorWith(After, RegionEntry);
+    After->replacePhiUsesWith(Before, RegionExit);
+    DTU.applyUpdates({{DominatorTree::Delete, Exit0, RegionEntry},
+                      {DominatorTree::Insert, Exit0, Entry1},
+                      {DominatorTree::Delete, RegionExit, Entry1},
+                      {DominatorTree::Insert, RegionExit, After},
+                      {DominatorTree::Delete, Before, After},
+                      {DominatorTree::Insert, Before, RegionEntry}});
+  }
+
   /// Determine if it is beneficial to fuse two loops.
   ///
   /// For now, this method simply returns true because we want to fuse as much
@@ -929,9 +3348,12 @@ private:
   /// This function will return a pair of values. The first is a boolean,
   /// stating whether or not the two candidates are known at compile time to
   /// have the same TripCount. The second is the difference in the two
-  /// TripCounts. This information can be used later to determine whether or not
-  /// peeling can be performed on either one of the candiates.
-  std::pair<bool, Optional<unsigned>>
+  /// TripCounts, positive if the first candidate has more iterations and
+  /// negative if the second one has. This information can be used later to
+  /// determine whether or not peeling can be performed on either one of the
+  /// candiates. The trip counts themselves do not have to be constants, e.g.,
+  /// loops running to n + 1 and n differ by 1.
+  std::pair<bool, Optional<int>>
   haveIdenticalTripCounts(const FusionCandidate &FC0,
                           const FusionCandidate &FC1) const {
   
@@ -960,37 +3382,94 @@ private:
     LLVM_DEBUG(dbgs() << "The loops do not have the same tripcount, "
                           "determining the difference between trip counts\n");
   
-    // Currently only considering loops with a single exit point
-    // and a non-constant trip count.
-    const unsigned TC0 = SE.getSmallConstantTripCount(FC0.L);
-    const unsigned TC1 = SE.getSmallConstantTripCount(FC1.L);
-  
-    // If any of the tripcounts are zero that means that loop(s) do not have
-    // a single exit or a constant tripcount.
-    if (TC0 == 0 || TC1 == 0) {
-      LLVM_DEBUG(dbgs() << "Loop(s) do not have a single exit point or do not "
-                            "have a constant number of iterations. Peeling "
-                            "is not benefical\n");
+    // The trip counts may be runtime values, e.g., n and n + 1, as long as
+    // they differ by a constant. A narrower count is zero extended, which
+    // does not change the number of iterations.
+    Type *Ty = SE.getWiderType(TripCount0->getType(), TripCount1->getType());
+    const auto *Diff = dyn_cast<SCEVConstant>(
+        SE.getMinusSCEV(SE.getNoopOrZeroExtend(TripCount0, Ty),
+                        SE.getNoopOrZeroExtend(TripCount1, Ty)));
+    if (!Diff || Diff->getAPInt().getMinSignedBits() > 31) {
+      LLVM_DEBUG(dbgs() << "Loop trip counts do not differ by a constant. "
+                            "Peeling is not benefical\n");
       return {false, None};
     }
-  
-    Optional<unsigned> Difference = None;
-    int Diff = TC0 - TC1;
-  
-    if (Diff > 0)
-      Difference = Diff;
-    else {
-      LLVM_DEBUG(
-          dbgs() << "Difference is less than 0. FC1 (second loop) has more "
-                    "iterations than the first one. Currently not supported\n");
+    int Difference = Diff->getAPInt().getSExtValue();
+
+    // The difference is modulo the width of the counts, so it only holds if
+    // adding it to the count of the shorter loop cannot wrap around.
+    unsigned Width = Ty->getIntegerBitWidth();
+    const auto *MaxShorter = dyn_cast<SCEVConstant>(
+        SE.getConstantMaxBackedgeTakenCount(Difference > 0 ? FC1.L : FC0.L));
+    if (!MaxShorter ||
+        MaxShorter->getAPInt().zextOrSelf(Width).ugt(
+            APInt::getMaxValue(Width) - std::abs(Difference))) {
+      LLVM_DEBUG(dbgs() << "Trip count of the longer loop may wrap around. "
+                            "Peeling is not benefical\n");
+      return {false, None};
     }
-  
+
     LLVM_DEBUG(dbgs() << "Difference in loop trip count is: " << Difference
                       << "\n");
   
     return {false, Difference};
   }
   
+  /// Prepare peeling the first iterations of \p FC0 for \p FC1 although their
+  /// guards differ (see canPeelAcrossGuards). FC0 takes the guard of FC1, so
+  /// that it runs all peeled iterations whenever it runs, and a copy of FC0
+  /// after the guarded region of FC1 runs it if only its old guard holds:
+  ///
+  ///   if (n + k > 0)                  if (n > 0)
+  ///     for (i = 0; i < n + k; ++i)     for (i = 0; i < n + k; ++i)
+  ///       A(i)                            A(i)
+  ///   if (n > 0)                ==>     if (n > 0)
+  ///     for (i = 0; i < n; ++i)           for (i = 0; i < n; ++i)
+  ///       B(i)                              B(i)
+  ///                                   if (n <= 0 && n + k > 0)
+  ///                                     for (i = 0; i < n + k; ++i)
+  ///                                       A(i)
+  void versionAcrossGuards(const FusionCandidate &FC0,
+                           const FusionCandidate &FC1) {
+    BasicBlock *GuardBlock0 = FC0.GuardBranch->getParent();
+    BasicBlock *GuardBlock1 = FC1.GuardBranch->getParent();
+    BasicBlock *Join = FC1.getNonLoopBlock();
+
+    // The guard of FC1 is computed before FC0, as fusing them would.
+    moveInstructionsToTheEnd(*GuardBlock1, *GuardBlock0, DT, PDT, DI);
+    bool EntersOnTrue = FC0.GuardBranch->getSuccessor(0) == FC0.Preheader;
+    Value *Cond0 = FC0.GuardBranch->getCondition();
+    PHINode *RunCopy =
+        PHINode::Create(Cond0->getType(), 2, "peel.run", &Join->front());
+    RunCopy->addIncoming(ConstantInt::get(Cond0->getType(), !EntersOnTrue),
+                         FC1.ExitBlock);
+    RunCopy->addIncoming(Cond0, GuardBlock1);
+    FC0.GuardBranch->setCondition(FC1.GuardBranch->getCondition());
+    if ((FC1.GuardBranch->getSuccessor(0) == FC1.Preheader) != EntersOnTrue)
+      FC0.GuardBranch->swapSuccessors();
+
+    BasicBlock *Tail = SplitBlock(Join, Join->getFirstNonPHI(), &DTU, &LI);
+    DTU.flush();
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> Blocks;
+    cloneLoopWithPreheader(Tail, Join, FC0.L, VMap, ".copy", &LI, &DT, Blocks);
+    remapInstructionsInBlocks(Blocks, VMap);
+    BasicBlock *CopyPreheader = cast<BasicBlock>(VMap[FC0.Preheader]);
+    BasicBlock *CopyLatch = cast<BasicBlock>(VMap[FC0.Latch]);
+    ReplaceInstWithInst(
+        Join->getTerminator(),
+        EntersOnTrue ? BranchInst::Create(CopyPreheader, Tail, RunCopy)
+                     : BranchInst::Create(Tail, CopyPreheader, RunCopy));
+    CopyLatch->getTerminator()->replaceUsesOfWith(FC0.ExitBlock, Tail);
+    SplitEdge(CopyLatch, Tail, &DT, &LI);
+
+    PDT.recalculate(*FC0.Header->getParent());
+    SE.forgetLoop(FC0.L);
+    FUSION_TRACE(TRACE_FUSION, 1,
+                 "loop " << FC0.L->getName() << " copied below loop "
+                         << FC1.L->getName() << " for its old guard");
+  }
+
   void peelFusionCandidate(FusionCandidate &FC0, const FusionCandidate &FC1,
                             unsigned PeelCount) {
     assert(FC0.AbleToPeel && "Should be able to peel loop");
@@ -998,6 +3477,8 @@ private:
     LLVM_DEBUG(dbgs() << "Attempting to peel first " << PeelCount
                       << " iterations of the first loop. \n");
   
+    BasicBlock *NonLoopBlock =
+        FC0.GuardBranch ? FC0.getNonLoopBlock() : nullptr;
     FC0.Peeled = peelLoop(FC0.L, PeelCount, &LI, &SE, &DT, &AC, true);
     if (FC0.Peeled) {
       LLVM_DEBUG(dbgs() << "Done Peeling\n");
@@ -1044,24 +3525,1032 @@ private:
             Succ = CurrentBranch->getSuccessor(1);
           ReplaceInstWithInst(CurrentBranch, BranchInst::Create(Succ));
         }
-  
-        DTU.applyUpdates(TreeUpdates);
-        DTU.flush();
+  
+        DTU.applyUpdates(TreeUpdates);
+        DTU.flush();
+      }
+
+      // The guard of a guarded loop has to branch to its preheader, so the
+      // peeled iterations, straight-line code by now, become the preheader.
+      if (FC0.GuardBranch) {
+        BasicBlock *PH = FC0.GuardBranch->getSuccessor(
+            FC0.GuardBranch->getSuccessor(0) == NonLoopBlock);
+        while (PH->getSingleSuccessor() != FC0.Header &&
+               MergeBlockIntoPredecessor(PH->getSingleSuccessor(), &DTU, &LI))
+          ;
+        DTU.flush();
+        PDT.recalculate(*FC0.Header->getParent());
+        FC0.updateAfterPeeling();
+      }
+      LLVM_DEBUG(
+          dbgs() << "Sucessfully peeled " << FC0.PP.PeelCount
+                  << " iterations from the first loop.\n"
+                    "Both Loops have the same number of iterations now.\n");
+    }
+  }
+  
+  /// Return the number of instructions added by peeling \p Count iterations
+  /// of \p FC, the leading ones if \p Leading is true, which peelLoop copies
+  /// one by one, and the trailing ones otherwise, which peelTrailingIterations
+  /// puts into a single copy of the loop. Peeling the leading iterations
+  /// \p AcrossGuards copies the whole loop as well (see versionAcrossGuards).
+  /// Returns None if the loop cannot be peeled that way.
+  Optional<unsigned> getPeelCost(const FusionCandidate &FC, unsigned Count,
+                                 bool Leading, bool AcrossGuards) const {
+    if (!FC.AbleToPeel)
+      return None;
+    // The peeled iterations of a guarded loop become its preheader, which
+    // requires that they do not branch.
+    if (Leading && FC.GuardBranch &&
+        any_of(FC.L->blocks(), [&](BasicBlock *BB) {
+          return BB != FC.Latch && !BB->getSingleSuccessor();
+        }))
+      return None;
+    if (!Leading && (FC.ExitingBlock != FC.Latch ||
+                     !cast<BranchInst>(FC.Latch->getTerminator())
+                          ->isConditional() ||
+                     !isSafeToExpandAt(getTripCountAfterPeeling(FC, Count),
+                                       FC.Preheader->getTerminator(), SE)))
+      return None;
+    // The epilogue of a guarded loop runs after its guarded region.
+    if (!Leading && FC.GuardBranch &&
+        !canRunAfterGuardedRegion(FC, FC.getNonLoopBlock(),
+                                  /*WholeLoop=*/false))
+      return None;
+
+    Optional<unsigned> Size = getLoopSize(FC);
+    if (!Size)
+      return None;
+    // The copy gets a preheader, and the loop a new counter that stops it.
+    if (Leading)
+      return AcrossGuards ? (Count + 1) * *Size : Count * *Size;
+    return *Size + 4;
+  }
+
+  /// Return the number of instructions in \p FC, or None if it cannot be
+  /// copied.
+  Optional<unsigned> getLoopSize(const FusionCandidate &FC) const {
+    unsigned Size = 0;
+    for (BasicBlock *BB : FC.L->blocks()) {
+      for (Instruction &I : *BB) {
+        if (I.getType()->isTokenTy())
+          return None;
+        if (const CallBase *CB = dyn_cast<CallBase>(&I))
+          if (CB->cannotDuplicate() || CB->isConvergent())
+            return None;
+      }
+      Size += BB->size();
+    }
+    return Size;
+  }
+
+  /// Return the number of iterations \p FC runs once its last \p PeelCount
+  /// iterations are peeled off.
+  const SCEV *getTripCountAfterPeeling(const FusionCandidate &FC,
+                                       unsigned PeelCount) const {
+    const SCEV *BackedgeTakenCount = SE.getBackedgeTakenCount(FC.L);
+    return SE.getAddExpr(
+        BackedgeTakenCount,
+        SE.getConstant(BackedgeTakenCount->getType(), 1 - int64_t(PeelCount),
+                       /*isSigned=*/true));
+  }
+
+  /// Peel the last \p PeelCount iterations of \p FC1, which has that many
+  /// more than \p FC0, off into an epilogue loop, a copy of \p FC1 that
+  /// continues where it stops. If the first \p LeadingPeelCount iterations
+  /// of FC0 are peeled afterwards, FC0 keeps that many more:
+  ///
+  ///   for (i = 0; i < n + k; ++i)        for (i = 0; i < n; ++i)
+  ///     B(i)                     ==>       B(i)
+  ///                                      for (; i < n + k; ++i)
+  ///                                        B(i)
+  ///
+  /// Unlike peeling the leading iterations of FC0, this keeps the iterations
+  /// of both loops aligned, so the dependences checked for fusing them do not
+  /// change, and the peeled iterations still run after all of FC0. \p FC1
+  /// keeps its blocks: its latch exits on a new counter, and the epilogue is
+  /// put between its exit block and the code that followed it.
+  ///
+  /// The exit block of a guarded FC1 has to lead to the non-loop successor
+  /// of its guard, so the epilogue is put after the guarded region instead,
+  /// guarded by the old guard of FC1. If that guard differs from the one of
+  /// FC0, as for n > 0 and n + k > 0, FC1 takes the guard of FC0 (see
+  /// canPeelAcrossGuards), and the epilogue runs all iterations of FC1 if
+  /// FC0 was skipped.
+  void peelTrailingIterations(const FusionCandidate &FC0, FusionCandidate &FC1,
+                              unsigned PeelCount,
+                              [[maybe_unused]] unsigned LeadingPeelCount = 0) {
+    LLVM_DEBUG(dbgs() << "Attempting to peel last " << PeelCount
+                      << " iterations of the second loop. \n");
+
+    bool AcrossGuards = FC1.GuardBranch && !haveIdenticalGuards(FC0, FC1);
+    splitTrailingIterations(
+        FC1, getTripCountAfterPeeling(FC1, PeelCount), /*More=*/nullptr,
+        AcrossGuards ? FC0.GuardBranch->getCondition() : nullptr,
+        AcrossGuards && FC0.GuardBranch->getSuccessor(0) == FC0.Preheader);
+    ++SecondLoopsPeeled;
+    FUSION_TRACE(TRACE_FUSION, 1,
+                 "last " << PeelCount << " iterations of loop "
+                         << FC1.L->getName() << " peeled for loop "
+                         << FC0.L->getName()
+                         << (AcrossGuards ? " across guards" : ""));
+
+#ifndef NDEBUG
+    auto IdenticalTripCount = haveIdenticalTripCounts(FC0, FC1);
+    assert(IdenticalTripCount.second &&
+           *IdenticalTripCount.second == int(LeadingPeelCount) &&
+           "Loops should have identical trip counts after peeling");
+#endif
+    FC1.verify();
+  }
+
+  /// Return the number of instructions added by aligning \p FC0 and \p FC1,
+  /// whose trip counts differ by \p Difference, such that FC1 runs \p Shift
+  /// iterations behind FC0 (see alignFusionCandidates), or None if they
+  /// cannot be aligned that way.
+  Optional<unsigned> getAlignmentCost(const FusionCandidate &FC0,
+                                      const FusionCandidate &FC1,
+                                      unsigned Shift, int Difference) const {
+    assert(int(Shift) > Difference && "Loops need no alignment");
+    // Each peeled iteration of a loop nest is a copy of its inner loops.
+    if (!FC0.L->isInnermost() || !FC1.L->isInnermost())
+      return None;
+    // The peeled iterations of FC0 run unconditionally, and the fused loop
+    // at least once.
+    const SCEV *BTC0 = SE.getBackedgeTakenCount(FC0.L);
+    if (isa<SCEVCouldNotCompute>(BTC0) ||
+        !SE.isKnownPredicate(ICmpInst::ICMP_UGE, BTC0,
+                             SE.getConstant(BTC0->getType(), Shift)))
+      return None;
+    Optional<unsigned> Leading = getPeelCost(FC0, Shift, /*Leading=*/true,
+                                             /*AcrossGuards=*/false);
+    Optional<unsigned> Trailing =
+        getPeelCost(FC1, Shift - Difference, /*Leading=*/false,
+                    /*AcrossGuards=*/false);
+    if (!Leading || !Trailing)
+      return None;
+    return *Leading + *Trailing;
+  }
+
+  /// Align \p FC0 and \p FC1, whose trip counts differ by \p Difference, so
+  /// that the fused loop runs iteration i + \p Shift of FC0 with iteration i
+  /// of FC1. The first Shift iterations of FC0 are peeled in front of it and
+  /// the last ones of FC1 run in an epilogue loop after it:
+  ///
+  ///   for (i = 0; i < n; ++i)          A(0) ... A(s - 1)
+  ///     A(i)                    ==>    for (i = s; i < n; ++i)
+  ///   for (i = 0; i < n; ++i)            A(i)
+  ///     B(i)                           for (i = 0; i < n - s; ++i)
+  ///                                      B(i)
+  ///                                    for (; i < n; ++i)
+  ///                                      B(i)
+  ///
+  /// This keeps a dependence from iteration i0 of FC0 to iteration i1 of FC1
+  /// as long as i1 - i0 >= -Shift, so a stencil reading A(i + 1) can be fused
+  /// with the loop that writes A(i).
+  void alignFusionCandidates(FusionCandidate &FC0, FusionCandidate &FC1,
+                             unsigned Shift, int Difference) {
+    peelTrailingIterations(FC0, FC1, Shift - Difference, Shift);
+    peelFusionCandidate(FC0, FC1, Shift);
+    ++LoopsAligned;
+    FUSION_TRACE(TRACE_FUSION, 1,
+                 "loops " << FC0.L->getName() << " and " << FC1.L->getName()
+                          << " aligned by " << Shift << " iterations");
+  }
+
+  /// Let \p FC stop after \p TripCount iterations and run the remaining ones
+  /// in an epilogue loop, as peelTrailingIterations describes. If \p More is
+  /// given, FC may not have iterations left, and the epilogue only runs if
+  /// More holds. If \p GuardCond is given, FC is entered iff GuardCond is
+  /// \p GuardEntersOnTrue, and its old guard guards the epilogue if FC was
+  /// skipped.
+  void splitTrailingIterations(FusionCandidate &FC, const SCEV *TripCount,
+                               Value *More, Value *GuardCond,
+                               bool GuardEntersOnTrue) {
+    Loop *L = FC.L;
+    BasicBlock *Exit = FC.ExitBlock;
+    bool Guarded = FC.GuardBranch;
+    bool Conditional = Guarded || More;
+    DTU.flush();
+    formLCSSA(*L, DT, &LI, &SE);
+    SE.forgetLoop(L);
+
+    // The values live out of FC, and the ones its header phis continue
+    // with, are taken from the exit block.
+    SmallVector<PHINode *, 8> LiveOuts(make_pointer_range(Exit->phis()));
+    DenseMap<PHINode *, Value *> Resume;
+    for (PHINode &PN : FC.Header->phis()) {
+      Value *V = PN.getIncomingValueForBlock(FC.Latch);
+      auto *I = dyn_cast<Instruction>(V);
+      if (I && L->contains(I)) {
+        PHINode *ResumePN =
+            PHINode::Create(V->getType(), 1, PN.getName() + ".peel",
+                            &Exit->front());
+        ResumePN->addIncoming(V, FC.Latch);
+        V = ResumePN;
+      }
+      Resume[&PN] = V;
+    }
+
+    // After the guarded region, the epilogue starts where FC stopped, or
+    // from the start if FC was skipped, and runs if FC did and has
+    // iterations left, or if its old guard holds.
+    BasicBlock *EpiDom = Exit;
+    BasicBlock *GuardBlock = nullptr;
+    Value *RunEpilogue = More;
+    bool EntersOnTrue = true;
+    SmallVector<PHINode *, 8> JoinPHIs;
+    if (Guarded) {
+      EpiDom = FC.getNonLoopBlock();
+      GuardBlock = FC.GuardBranch->getParent();
+      for (PHINode &PN : EpiDom->phis())
+        JoinPHIs.push_back(&PN);
+      for (PHINode &PN : FC.Header->phis()) {
+        PHINode *ResumePN = PHINode::Create(
+            PN.getType(), 2, PN.getName() + ".resume", &EpiDom->front());
+        ResumePN->addIncoming(Resume[&PN], Exit);
+        ResumePN->addIncoming(PN.getIncomingValueForBlock(FC.Preheader),
+                              GuardBlock);
+        Resume[&PN] = ResumePN;
+      }
+      EntersOnTrue = FC.GuardBranch->getSuccessor(0) == FC.Preheader;
+      Type *BoolTy = FC.GuardBranch->getCondition()->getType();
+      Value *Ran = ConstantInt::get(BoolTy, EntersOnTrue);
+      if (More)
+        Ran = EntersOnTrue ? More
+                           : BinaryOperator::CreateNot(
+                                 More, "split.more.not",
+                                 GuardBlock->getTerminator());
+      PHINode *RunPN =
+          PHINode::Create(BoolTy, 2, "peel.run", &EpiDom->front());
+      RunPN->addIncoming(Ran, Exit);
+      RunPN->addIncoming(FC.GuardBranch->getCondition(), GuardBlock);
+      RunEpilogue = RunPN;
+
+      if (GuardCond) {
+        FC.GuardBranch->setCondition(GuardCond);
+        if (GuardEntersOnTrue != EntersOnTrue)
+          FC.GuardBranch->swapSuccessors();
+      }
+    }
+
+    BasicBlock *Tail = SplitBlock(EpiDom, EpiDom->getFirstNonPHI(), &DTU, &LI);
+    DTU.flush();
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> Blocks;
+    cloneLoopWithPreheader(Tail, EpiDom, L, VMap, ".epil", &LI, &DT, Blocks);
+    BasicBlock *EpiPreheader = cast<BasicBlock>(VMap[FC.Preheader]);
+    BasicBlock *EpiLatch = cast<BasicBlock>(VMap[FC.Latch]);
+
+    // The code in the preheader of FC runs once, before FC. After the
+    // guarded region, FC may not have run, and the epilogue computes it
+    // again.
+    for (Instruction &I : *FC.Preheader)
+      if (!Guarded && !I.isTerminator()) {
+        cast<Instruction>(VMap[&I])->eraseFromParent();
+        VMap[&I] = &I;
+      }
+    remapInstructionsInBlocks(Blocks, VMap);
+    for (PHINode &PN : FC.Header->phis())
+      cast<PHINode>(VMap[&PN])->setIncomingValueForBlock(EpiPreheader,
+                                                         Resume[&PN]);
+
+    // EpiDom -> epilogue -> Tail, and the code after FC uses the values of
+    // the epilogue.
+    EpiLatch->getTerminator()->replaceUsesOfWith(Exit, Tail);
+    if (!Conditional) {
+      Exit->getTerminator()->replaceUsesOfWith(Tail, EpiPreheader);
+      for (PHINode *LiveOut : LiveOuts) {
+        Value *V = LiveOut->getIncomingValueForBlock(FC.Latch);
+        Value *EpiV = VMap.lookup(V);
+        PHINode *EpiLiveOut =
+            PHINode::Create(LiveOut->getType(), 1,
+                            LiveOut->getName() + ".epil", &Tail->front());
+        EpiLiveOut->addIncoming(EpiV ? EpiV : V, EpiLatch);
+        LiveOut->replaceAllUsesWith(EpiLiveOut);
+        LiveOut->eraseFromParent();
+      }
+    } else {
+      ReplaceInstWithInst(EpiDom->getTerminator(),
+                          EntersOnTrue
+                              ? BranchInst::Create(EpiPreheader, Tail,
+                                                   RunEpilogue)
+                              : BranchInst::Create(Tail, EpiPreheader,
+                                                   RunEpilogue));
+      BasicBlock *EpiExit = SplitEdge(EpiLatch, Tail, &DT, &LI);
+      // The values after FC, or after the guarded region, are the ones of
+      // the epilogue if it ran.
+      for (PHINode *JoinPN : Guarded ? JoinPHIs : LiveOuts) {
+        Value *V = Guarded ? JoinPN->getIncomingValueForBlock(Exit) : JoinPN;
+        auto *LiveOut = dyn_cast<PHINode>(V);
+        if (LiveOut && LiveOut->getParent() == Exit)
+          V = LiveOut->getIncomingValueForBlock(FC.Latch);
+        Value *EpiV = VMap.lookup(V);
+        if (!EpiV)
+          EpiV = V;
+        auto *EpiI = dyn_cast<Instruction>(EpiV);
+        if (EpiI && LI.getLoopFor(EpiI->getParent()) &&
+            !LI.getLoopFor(EpiI->getParent())->contains(EpiExit)) {
+          PHINode *EpiLiveOut =
+              PHINode::Create(EpiV->getType(), 1, JoinPN->getName() + ".epil",
+                              &EpiExit->front());
+          EpiLiveOut->addIncoming(EpiV, EpiLatch);
+          EpiV = EpiLiveOut;
+        }
+        PHINode *TailPN = PHINode::Create(
+            JoinPN->getType(), 2, JoinPN->getName() + ".peel", &Tail->front());
+        JoinPN->replaceAllUsesWith(TailPN);
+        TailPN->addIncoming(JoinPN, EpiDom);
+        TailPN->addIncoming(EpiV, EpiExit);
+      }
+    }
+
+    stopAfterIterations(FC, TripCount);
+
+    // Peeling does not update the PDT
+    if (!Conditional)
+      DT.changeImmediateDominator(Tail, EpiLatch);
+    PDT.recalculate(*FC.Header->getParent());
+    SE.forgetLoop(L);
+  }
+
+  /// Let \p FC exit after \p TripCount iterations, on a new counter, instead
+  /// of on its old exit condition.
+  void stopAfterIterations(const FusionCandidate &FC, const SCEV *TripCount) {
+    auto *LatchBr = cast<BranchInst>(FC.Latch->getTerminator());
+    SCEVExpander Expander(SE, FC.Header->getModule()->getDataLayout(),
+                          "peel");
+    Value *End = Expander.expandCodeFor(TripCount, nullptr,
+                                        FC.Preheader->getTerminator());
+    Type *Ty = End->getType();
+    PHINode *Counter =
+        PHINode::Create(Ty, 2, "peel.iv", &FC.Header->front());
+    Instruction *Next = BinaryOperator::CreateNUWAdd(
+        Counter, ConstantInt::get(Ty, 1), "peel.iv.next", LatchBr);
+    Counter->addIncoming(ConstantInt::get(Ty, 0), FC.Preheader);
+    Counter->addIncoming(Next, FC.Latch);
+    Instruction *Cond = new ICmpInst(
+        LatchBr,
+        LatchBr->getSuccessor(0) == FC.Header ? ICmpInst::ICMP_NE
+                                              : ICmpInst::ICMP_EQ,
+        Next, End, "peel.cond");
+    Value *OldCond = LatchBr->getCondition();
+    LatchBr->setCondition(Cond);
+    RecursivelyDeleteTriviallyDeadInstructions(OldCond);
+  }
+
+  /// Return the backedge-taken counts of \p FC0 and \p FC1 in the wider of
+  /// their types, or None if SE cannot compute them.
+  Optional<std::pair<const SCEV *, const SCEV *>>
+  getBackedgeTakenCounts(const FusionCandidate &FC0,
+                         const FusionCandidate &FC1) const {
+    const SCEV *BTC0 = SE.getBackedgeTakenCount(FC0.L);
+    const SCEV *BTC1 = SE.getBackedgeTakenCount(FC1.L);
+    if (isa<SCEVCouldNotCompute>(BTC0) || isa<SCEVCouldNotCompute>(BTC1))
+      return None;
+    Type *Ty = SE.getWiderType(BTC0->getType(), BTC1->getType());
+    return std::make_pair(SE.getNoopOrZeroExtend(BTC0, Ty),
+                          SE.getNoopOrZeroExtend(BTC1, Ty));
+  }
+
+  /// Return whether splitIndexSets gives \p FC0 and \p FC1, which take
+  /// \p BTC0 and \p BTC1 backedges, a remainder loop. Each one that may run
+  /// more iterations than the other one needs it, and both do if their
+  /// guards differ.
+  std::pair<bool, bool> getLoopsToSplit(const FusionCandidate &FC0,
+                                        const FusionCandidate &FC1,
+                                        const SCEV *BTC0,
+                                        const SCEV *BTC1) const {
+    if (FC0.GuardBranch && !haveIdenticalGuards(FC0, FC1))
+      return {true, true};
+    return {!SE.isKnownPredicate(ICmpInst::ICMP_ULE, BTC0, BTC1),
+            !SE.isKnownPredicate(ICmpInst::ICMP_ULE, BTC1, BTC0)};
+  }
+
+  /// Return the number of instructions splitIndexSets adds to fuse \p FC0
+  /// and \p FC1, or None if their index sets cannot be split.
+  ///
+  /// The trip counts of both loops are computed at the guard or in the
+  /// preheader of FC0. The remainder of FC1 is put after it, as the epilogue
+  /// of peelTrailingIterations is, but the one of FC0 goes after FC1 as
+  /// well: FC0 must not have values used after it, the code around FC1 must
+  /// not touch memory, and the header phis of FC0 have to be affine, as the
+  /// remainder starts with values computed from the iterations FC0 ran.
+  Optional<unsigned> getSplitCost(const FusionCandidate &FC0,
+                                  const FusionCandidate &FC1) const {
+    if (!FC0.GuardBranch != !FC1.GuardBranch)
+      return None;
+    auto BTCs = getBackedgeTakenCounts(FC0, FC1);
+    Instruction *IP = FC0.GuardBranch ? FC0.GuardBranch
+                                      : FC0.Preheader->getTerminator();
+    if (!BTCs || !isSafeToExpandAt(BTCs->first, IP, SE) ||
+        !isSafeToExpandAt(BTCs->second, IP, SE))
+      return None;
+
+    auto Split = getLoopsToSplit(FC0, FC1, BTCs->first, BTCs->second);
+    if (!Split.first && !Split.second)
+      return None;
+    unsigned Cost = 0;
+    for (const FusionCandidate *FC : {&FC0, &FC1}) {
+      if (!(FC == &FC0 ? Split.first : Split.second))
+        continue;
+      Optional<unsigned> Size = getLoopSize(*FC);
+      if (!Size || FC->ExitingBlock != FC->Latch ||
+          !cast<BranchInst>(FC->Latch->getTerminator())->isConditional() ||
+          (FC->GuardBranch &&
+           !canRunAfterGuardedRegion(*FC, FC->getNonLoopBlock(),
+                                     /*WholeLoop=*/false)))
+        return None;
+      // The copy gets a preheader, and the loop a new counter that stops it.
+      Cost += *Size + 4;
+    }
+    if (!Split.first)
+      return Cost;
+
+    for (BasicBlock *BB : FC0.L->blocks())
+      for (Instruction &I : *BB)
+        for (User *U : I.users()) {
+          auto *UI = cast<Instruction>(U);
+          if (!FC0.L->contains(UI) && !(isa<PHINode>(UI) && UI->use_empty()))
+            return None;
+        }
+    for (PHINode &PN : FC0.Header->phis()) {
+      const auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&PN));
+      if (!PN.getType()->isIntegerTy() || !AR || AR->getLoop() != FC0.L ||
+          !AR->isAffine() || !isSafeToExpandAt(AR->getStart(), IP, SE) ||
+          !isSafeToExpandAt(AR->getStepRecurrence(SE), IP, SE))
+        return None;
+    }
+    if (FC0.GuardBranch && !FC0.getNonLoopBlock()->phis().empty())
+      return None;
+    SmallVector<BasicBlock *, 4> Passed = {FC0.ExitBlock, FC1.Preheader};
+    if (FC1.GuardBranch) {
+      Passed.push_back(FC1.GuardBranch->getParent());
+      Passed.push_back(FC1.ExitBlock);
+    }
+    for (BasicBlock *BB : Passed)
+      for (Instruction &I : *BB)
+        if (I.mayReadOrWriteMemory() || I.mayHaveSideEffects())
+          return None;
+    return Cost;
+  }
+
+  /// Split \p FC0 and \p FC1, whose trip counts differ by a runtime amount
+  /// or one too large to peel, into parts that run as many iterations as the
+  /// shorter loop, which are fused, and remainder loops (see getSplitCost):
+  ///
+  ///   for (i = 0; i < n; ++i)          for (i = 0; i < min(n, m); ++i)
+  ///     A(i)                              A(i)
+  ///   for (j = 0; j < m; ++j)    ==>    for (j = 0; j < min(n, m); ++j)
+  ///     B(j)                              B(j)
+  ///                                     for (; i < n; ++i)
+  ///                                       A(i)
+  ///                                     for (; j < m; ++j)
+  ///                                       B(j)
+  ///
+  /// Only a loop that may be the longer one gets a remainder, which runs if
+  /// iterations are left. The remainder of FC0 only moves past iterations of
+  /// FC1 with smaller indices, which fusion moves them past anyway, so the
+  /// dependences checked for fusion cover it. If the guards of FC0 and FC1
+  /// differ, as for n > 0 and m > 0, both loops are entered if both guards
+  /// hold, and a remainder runs all iterations of its loop if only its own
+  /// guard does.
+  void splitIndexSets(FusionCandidate &FC0, FusionCandidate &FC1) {
+    auto BTCs = *getBackedgeTakenCounts(FC0, FC1);
+    auto Split = getLoopsToSplit(FC0, FC1, BTCs.first, BTCs.second);
+    Instruction *IP = FC0.Preheader->getTerminator();
+    Value *GuardCond = nullptr;
+    if (FC0.GuardBranch) {
+      IP = FC0.GuardBranch;
+      if (!haveIdenticalGuards(FC0, FC1)) {
+        // The guard of FC1 is computed before FC0, as fusing them would.
+        moveInstructionsToTheEnd(*FC1.GuardBranch->getParent(),
+                                 *FC0.GuardBranch->getParent(), DT, PDT, DI);
+        auto GetEntered = [&](const FusionCandidate &FC) -> Value * {
+          Value *Cond = FC.GuardBranch->getCondition();
+          if (FC.GuardBranch->getSuccessor(0) == FC.Preheader)
+            return Cond;
+          return BinaryOperator::CreateNot(Cond, "split.entered", IP);
+        };
+        GuardCond = BinaryOperator::CreateAnd(GetEntered(FC0), GetEntered(FC1),
+                                              "split.guard", IP);
+      }
+    }
+
+    // Both loops run Last + 1 iterations. That is 0 if Last is the largest
+    // value of its type, which the counters of stopAfterIterations handle.
+    SCEVExpander Expander(SE, FC0.Header->getModule()->getDataLayout(),
+                          "split");
+    const SCEV *LastSCEV = SE.getUMinExpr(BTCs.first, BTCs.second);
+    Type *Ty = LastSCEV->getType();
+    Value *Last = Expander.expandCodeFor(LastSCEV, Ty, IP);
+    Value *End = BinaryOperator::CreateAdd(Last, ConstantInt::get(Ty, 1),
+                                           "split.end", IP);
+    auto GetMore = [&](const SCEV *BTC) -> Value * {
+      if (SE.isKnownPredicate(ICmpInst::ICMP_ULT, LastSCEV, BTC))
+        return nullptr;
+      return new ICmpInst(IP, ICmpInst::ICMP_ULT, Last,
+                          Expander.expandCodeFor(BTC, Ty, IP), "split.more");
+    };
+    Value *More0 = Split.first ? GetMore(BTCs.first) : nullptr;
+    Value *More1 = Split.second ? GetMore(BTCs.second) : nullptr;
+
+    FUSION_TRACE(TRACE_FUSION, 1,
+                 "loops " << FC0.L->getName() << " and " << FC1.L->getName()
+                          << " split at the smaller trip count"
+                          << (GuardCond ? " across guards" : ""));
+    // The remainder of FC0 goes in front of the one of FC1.
+    if (Split.second) {
+      splitTrailingIterations(FC1, SE.getUnknown(End), More1, GuardCond,
+                              /*GuardEntersOnTrue=*/true);
+      ++IndexSetsSplit;
+      FC1.verify();
+    }
+    if (Split.first)
+      splitFirstCandidate(FC0, FC1, End, More0, GuardCond);
+
+#ifndef NDEBUG
+    assert(haveIdenticalTripCounts(FC0, FC1).first &&
+           "Loops should have identical trip counts after splitting");
+#endif
+  }
+
+  /// Let \p FC0 stop after \p End iterations and run the remaining ones in a
+  /// remainder loop after \p FC1 (see splitIndexSets). If \p More is given,
+  /// FC0 may not have iterations left, and the remainder only runs if More
+  /// holds. If \p GuardCond is given, FC0 is entered iff it holds, and the
+  /// remainder runs all iterations if FC0 was skipped but its old guard
+  /// holds.
+  void splitFirstCandidate(FusionCandidate &FC0, const FusionCandidate &FC1,
+                           Value *End, Value *More, Value *GuardCond) {
+    Loop *L = FC0.L;
+    SmallVector<std::pair<PHINode *, const SCEVAddRecExpr *>, 4> IVs;
+    for (PHINode &PN : FC0.Header->phis())
+      IVs.push_back({&PN, cast<SCEVAddRecExpr>(SE.getSCEV(&PN))});
+    SE.forgetLoop(L);
+
+    BasicBlock *InsertBB =
+        FC1.GuardBranch ? FC1.getNonLoopBlock() : FC1.ExitBlock;
+    BasicBlock *Tail =
+        SplitBlock(InsertBB, InsertBB->getFirstNonPHI(), &DTU, &LI);
+    DTU.flush();
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> Blocks;
+    cloneLoopWithPreheader(Tail, InsertBB, L, VMap, ".rem", &LI, &DT, Blocks);
+    BasicBlock *RemPreheader = cast<BasicBlock>(VMap[FC0.Preheader]);
+    BasicBlock *RemLatch = cast<BasicBlock>(VMap[FC0.Latch]);
+
+    // The preheader of an unguarded FC0 ran before FC1; after a guarded
+    // region, FC0 may not have run, and the remainder computes it again.
+    for (Instruction &I : *FC0.Preheader)
+      if (!FC0.GuardBranch && !I.isTerminator()) {
+        cast<Instruction>(VMap[&I])->eraseFromParent();
+        VMap[&I] = &I;
+      }
+    remapInstructionsInBlocks(Blocks, VMap);
+    RemLatch->getTerminator()->replaceUsesOfWith(FC0.ExitBlock, Tail);
+
+    // The number of iterations FC0 ran, and whether the remainder runs.
+    Instruction *IP = InsertBB->getTerminator();
+    LLVMContext &Ctx = IP->getContext();
+    Value *Done = End;
+    Value *Run = More ? More : ConstantInt::getTrue(Ctx);
+    if (FC0.GuardBranch) {
+      BranchInst *Guard = FC0.GuardBranch;
+      Value *WasEntered = Guard->getCondition();
+      if (Guard->getSuccessor(0) != FC0.Preheader)
+        WasEntered =
+            BinaryOperator::CreateNot(WasEntered, "split.entered", IP);
+      if (GuardCond) {
+        Guard->setCondition(GuardCond);
+        if (Guard->getSuccessor(0) != FC0.Preheader)
+          Guard->swapSuccessors();
+        Done = SelectInst::Create(GuardCond, End,
+                                  ConstantInt::get(End->getType(), 0),
+                                  "split.done", IP);
+        Run = SelectInst::Create(GuardCond, Run, WasEntered, "split.run", IP);
+      } else if (More) {
+        Run = BinaryOperator::CreateAnd(WasEntered, More, "split.run", IP);
+      } else {
+        Run = WasEntered;
+      }
+    }
+    if (isa<Constant>(Run)) {
+      ReplaceInstWithInst(IP, BranchInst::Create(RemPreheader));
+      BasicBlock *RemExit = SplitEdge(RemLatch, Tail, &DT, &LI);
+      DT.changeImmediateDominator(Tail, RemExit);
+    } else {
+      ReplaceInstWithInst(IP, BranchInst::Create(RemPreheader, Tail, Run));
+      SplitEdge(RemLatch, Tail, &DT, &LI);
+    }
+
+    // The header phis of the remainder continue after the iterations FC0
+    // ran.
+    SCEVExpander Expander(SE, FC0.Header->getModule()->getDataLayout(),
+                          "split");
+    for (auto &IV : IVs) {
+      PHINode *PN = IV.first;
+      const SCEVAddRecExpr *AR = IV.second;
+      const SCEV *Resume = SE.getAddExpr(
+          AR->getStart(),
+          SE.getMulExpr(AR->getStepRecurrence(SE),
+                        SE.getTruncateOrZeroExtend(SE.getUnknown(Done),
+                                                   PN->getType())));
+      cast<PHINode>(VMap[PN])->setIncomingValueForBlock(
+          RemPreheader, Expander.expandCodeFor(Resume, PN->getType(),
+                                               RemPreheader->getTerminator()));
+    }
+
+    stopAfterIterations(FC0, SE.getUnknown(End));
+    PDT.recalculate(*FC0.Header->getParent());
+    SE.forgetLoop(L);
+    ++IndexSetsSplit;
+    FC0.verify();
+  }
+
+  /// A runtime check that the bytes accessed through pointers based on Base0
+  /// in one loop, [Start0, End0), and on Base1 in the other loop, [Start1,
+  /// End1), do not overlap. The bounds are integers.
+  struct AliasCheck {
+    const SCEV *Base0, *Base1;
+    const SCEV *Start0, *End0, *Start1, *End1;
+  };
+
+  /// Return the pointer base of the load or store \p I in \p FC, and the
+  /// bytes it accesses across all iterations of the loop, or None if they
+  /// cannot be computed. Accesses in inner loops are not handled.
+  Optional<std::tuple<const SCEV *, const SCEV *, const SCEV *>>
+  getAccessedRange(const FusionCandidate &FC, Instruction &I) const {
+    Value *Ptr = getLoadStorePointerOperand(&I);
+    if (!Ptr)
+      return None;
+    const SCEV *PtrSCEV = SE.getSCEV(Ptr);
+    const SCEV *Base = SE.getPointerBase(PtrSCEV);
+    if (!isa<SCEVUnknown>(Base))
+      return None;
+    Type *IntPtrTy = DL.getIntPtrType(Ptr->getType());
+    const SCEV *First = SE.getPtrToIntExpr(PtrSCEV, IntPtrTy);
+    if (isa<SCEVCouldNotCompute>(First))
+      return None;
+
+    const SCEV *Last = First;
+    if (auto *AR = dyn_cast<SCEVAddRecExpr>(First)) {
+      const SCEV *BTC = SE.getBackedgeTakenCount(FC.L);
+      if (AR->getLoop() != FC.L || !AR->isAffine() ||
+          isa<SCEVCouldNotCompute>(BTC))
+        return None;
+      First = AR->getStart();
+      Last = AR->evaluateAtIteration(BTC, SE);
+      const SCEV *Step = AR->getStepRecurrence(SE);
+      if (SE.isKnownNonPositive(Step))
+        std::swap(First, Last);
+      else if (!SE.isKnownNonNegative(Step))
+        return None;
+    } else if (!SE.isLoopInvariant(First, FC.L)) {
+      return None;
+    }
+    uint64_t Size = DL.getTypeStoreSize(getLoadStoreType(&I));
+    return std::make_tuple(Base, First,
+                           SE.getAddExpr(Last, SE.getConstant(IntPtrTy, Size)));
+  }
+
+  /// Add the runtime check that \p I0 in \p FC0 and \p I1 in \p FC1 do
+  /// not access the same memory to \p AliasChecks, and return true, or
+  /// return false if they cannot be checked. Accesses based on the same
+  /// pointer are left to the dependence analysis. The checks of accesses
+  /// with the same pair of bases are merged into one, covering all of them.
+  bool addAliasCheck(const FusionCandidate &FC0, const FusionCandidate &FC1,
+                     Instruction &I0, Instruction &I1,
+                     SmallVectorImpl<AliasCheck> &AliasChecks) const {
+    auto Range0 = getAccessedRange(FC0, I0);
+    auto Range1 = getAccessedRange(FC1, I1);
+    if (!Range0 || !Range1 || std::get<0>(*Range0) == std::get<0>(*Range1) ||
+        std::get<1>(*Range0)->getType() != std::get<1>(*Range1)->getType())
+      return false;
+    AliasCheck New = {std::get<0>(*Range0), std::get<0>(*Range1),
+                      std::get<1>(*Range0), std::get<2>(*Range0),
+                      std::get<1>(*Range1), std::get<2>(*Range1)};
+    for (AliasCheck &C : AliasChecks)
+      if (C.Base0 == New.Base0 && C.Base1 == New.Base1) {
+        C.Start0 = SE.getUMinExpr(C.Start0, New.Start0);
+        C.End0 = SE.getUMaxExpr(C.End0, New.End0);
+        C.Start1 = SE.getUMinExpr(C.Start1, New.Start1);
+        C.End1 = SE.getUMaxExpr(C.End1, New.End1);
+        return true;
+      }
+    AliasChecks.push_back(New);
+    return true;
+  }
+
+  /// Return the number of instructions versionOnRuntimeChecks adds to fuse
+  /// \p FC0 and \p FC1, or None if they cannot be versioned on the runtime
+  /// checks that their trip counts are equal, with \p CheckTripCounts, and
+  /// that \p AliasChecks hold.
+  ///
+  /// The checks are computed at the guard or in the preheader of FC0, and
+  /// both loops are copied with the code between them. Loops whose trip
+  /// counts are known to differ are left alone, and so are loops that were
+  /// versioned before, as the checks still fail on the path that keeps them.
+  Optional<unsigned>
+  getRuntimeVersioningCost(const FusionCandidate &FC0,
+                           const FusionCandidate &FC1, bool CheckTripCounts,
+                           ArrayRef<AliasCheck> AliasChecks = None) const {
+    if (!FC0.GuardBranch != !FC1.GuardBranch ||
+        AliasChecks.size() > FusionRuntimeAliasChecks ||
+        getBooleanLoopAttribute(FC0.L, "llvm.loop.fusion.versioned") ||
+        getBooleanLoopAttribute(FC1.L, "llvm.loop.fusion.versioned"))
+      return None;
+    Instruction *IP = FC0.GuardBranch ? FC0.GuardBranch
+                                      : FC0.Preheader->getTerminator();
+    auto IsSafe = [&](const SCEV *S) { return isSafeToExpandAt(S, IP, SE); };
+    if (CheckTripCounts) {
+      auto BTCs = getBackedgeTakenCounts(FC0, FC1);
+      if (!BTCs ||
+          SE.isKnownPredicate(ICmpInst::ICMP_NE, BTCs->first, BTCs->second) ||
+          !IsSafe(BTCs->first) || !IsSafe(BTCs->second))
+        return None;
+    }
+    for (const AliasCheck &C : AliasChecks)
+      if (!IsSafe(C.Start0) || !IsSafe(C.End0) || !IsSafe(C.Start1) ||
+          !IsSafe(C.End1))
+        return None;
+
+    Optional<unsigned> Size0 = getLoopSize(FC0);
+    Optional<unsigned> Size1 = getLoopSize(FC1);
+    if (!Size0 || !Size1)
+      return None;
+    // The blocks around the loops are copied as well, and the checks take a
+    // compare and a branch, or two more compares and an and across guards,
+    // and two compares, an or and an and for each pair of ranges.
+    unsigned Cost = *Size0 + *Size1 + FC0.ExitBlock->size() + 4 +
+                    4 * AliasChecks.size();
+    if (FC0.GuardBranch)
+      Cost += FC0.Preheader->size() + FC1.GuardBranch->getParent()->size() +
+              FC1.Preheader->size() + FC1.ExitBlock->size() + 3;
+    return Cost;
+  }
+
+  /// Version \p FC0 and \p FC1 on runtime checks that their trip counts,
+  /// which cannot be matched otherwise, are equal, with \p CheckTripCounts,
+  /// and that the accesses in \p AliasChecks, which the dependence analysis
+  /// cannot tell apart, do not overlap:
+  ///
+  ///   for (i = 0; i < n; ++i)          if (n == m) {
+  ///     A(i)                              for (i = 0; i < n; ++i)
+  ///   for (j = 0; j < m; ++j)    ==>        A(i)
+  ///     B(j)                              for (j = 0; j < m; ++j)
+  ///                                         B(j)
+  ///                                     } else {
+  ///                                       for (i = 0; i < n; ++i)
+  ///                                         A(i)
+  ///                                       for (j = 0; j < m; ++j)
+  ///                                         B(j)
+  ///                                     }
+  ///
+  /// The copies run if the checks hold and are returned, to be fused by the
+  /// caller; the original loops keep running otherwise and are marked so that
+  /// they are not versioned again. If the guards of FC0 and FC1 differ, as
+  /// for n > 0 and m > 0, the check also requires that both or neither hold,
+  /// and the copy of FC1 takes the guard of FC0. Values of the loops used
+  /// after them are merged with their copies. LI, DT and PDT are updated.
+  std::pair<Loop *, Loop *>
+  versionOnRuntimeChecks(const FusionCandidate &FC0,
+                         const FusionCandidate &FC1, bool CheckTripCounts,
+                         ArrayRef<AliasCheck> AliasChecks) {
+    Function &F = *FC0.Header->getParent();
+    BranchInst *Guard0 = FC0.GuardBranch, *Guard1 = FC1.GuardBranch;
+    bool SameGuards = !Guard0 || haveIdenticalGuards(FC0, FC1);
+    // The guard of FC1 is computed before FC0, as fusing them would.
+    if (!SameGuards)
+      moveInstructionsToTheEnd(*Guard1->getParent(), *Guard0->getParent(), DT,
+                               PDT, DI);
+
+    // The check goes at the end of the block FC0, or its guard, starts in.
+    // The copies are joined with the originals after a block of their own
+    // that FC1 continues in.
+    BasicBlock *VersionBlock =
+        Guard0 ? Guard0->getParent() : FC0.Preheader;
+    BasicBlock *Entry =
+        SplitBlock(VersionBlock, VersionBlock->getTerminator(), &DTU, &LI);
+    BasicBlock *Join = Guard1 ? FC1.getNonLoopBlock() : FC1.ExitBlock;
+    SmallVector<BasicBlock *, 2> JoinPreds = {Guard1 ? FC1.ExitBlock
+                                                     : FC1.ExitingBlock};
+    if (Guard1)
+      JoinPreds.push_back(Guard1->getParent());
+    BasicBlock *Last =
+        SplitBlockPredecessors(Join, JoinPreds, ".version", &DTU, &LI,
+                               nullptr, /*PreserveLCSSA=*/true);
+    DTU.flush();
+
+    SmallSetVector<BasicBlock *, 16> Region;
+    Region.insert(Entry);
+    for (unsigned I = 0; I < Region.size(); ++I)
+      if (Region[I] != Last)
+        for (BasicBlock *Succ : successors(Region[I]))
+          Region.insert(Succ);
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 16> Blocks;
+    Loop *ParentLoop = FC0.L->getParentLoop();
+    Loop *Copies[2] = {nullptr, nullptr};
+    for (BasicBlock *BB : Region) {
+      if (VMap.count(BB))
+        continue;
+      // The preheader of an unguarded FC0 is Entry by now.
+      for (unsigned Idx : {0, 1}) {
+        Loop *L = Idx ? FC1.L : FC0.L;
+        if (BB == L->getLoopPreheader())
+          Copies[Idx] = cloneLoopWithPreheader(Join, VersionBlock, L, VMap,
+                                               ".eq", &LI, &DT, Blocks);
+      }
+      if (VMap.count(BB))
+        continue;
+      BasicBlock *Copy = CloneBasicBlock(BB, VMap, ".eq", &F);
+      Copy->moveBefore(Join);
+      VMap[BB] = Copy;
+      Blocks.push_back(Copy);
+      if (ParentLoop)
+        ParentLoop->addBasicBlockToLoop(Copy, LI);
+    }
+    remapInstructionsInBlocks(Blocks, VMap);
+
+    unsigned Growth = 0;
+    for (BasicBlock *BB : Blocks)
+      Growth += BB->size();
+
+    // Under the check, both guards hold or neither does, so the copy of FC1
+    // may take the guard of FC0.
+    if (!SameGuards) {
+      auto *GuardCopy = cast<BranchInst>(VMap[Guard1]);
+      GuardCopy->setCondition(Guard0->getCondition());
+      if ((Guard0->getSuccessor(0) == FC0.Preheader) !=
+          (Guard1->getSuccessor(0) == FC1.Preheader))
+        GuardCopy->swapSuccessors();
+    }
+
+    Instruction *IP = VersionBlock->getTerminator();
+    unsigned SizeBefore = VersionBlock->size();
+    SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "version");
+    auto Expand = [&](const SCEV *S) {
+      return Expander.expandCodeFor(S, S->getType(), IP);
+    };
+    Value *Check = nullptr;
+    auto AddCheck = [&](Value *Cond) {
+      Check = Check ? BinaryOperator::CreateAnd(Check, Cond, "version.cond", IP)
+                    : Cond;
+    };
+    Optional<std::pair<const SCEV *, const SCEV *>> BTCs;
+    if (CheckTripCounts) {
+      BTCs = getBackedgeTakenCounts(FC0, FC1);
+      AddCheck(new ICmpInst(IP, ICmpInst::ICMP_EQ, Expand(BTCs->first),
+                            Expand(BTCs->second), "version.tc"));
+    }
+    // Ranges do not overlap if one of them ends before the other one starts.
+    for (const AliasCheck &C : AliasChecks) {
+      Value *Before =
+          new ICmpInst(IP, ICmpInst::ICMP_ULE, Expand(C.End0),
+                       Expand(C.Start1), "version.before");
+      Value *After =
+          new ICmpInst(IP, ICmpInst::ICMP_ULE, Expand(C.End1),
+                       Expand(C.Start0), "version.after");
+      AddCheck(BinaryOperator::CreateOr(Before, After, "version.noalias", IP));
+    }
+    if (!SameGuards) {
+      auto GetEntered = [&](const FusionCandidate &FC) -> Value * {
+        Value *Cond = FC.GuardBranch->getCondition();
+        if (FC.GuardBranch->getSuccessor(0) == FC.Preheader)
+          return Cond;
+        return BinaryOperator::CreateNot(Cond, "version.entered", IP);
+      };
+      AddCheck(new ICmpInst(IP, ICmpInst::ICMP_EQ, GetEntered(FC0),
+                            GetEntered(FC1), "version.guard"));
+    }
+    ReplaceInstWithInst(
+        IP, BranchInst::Create(cast<BasicBlock>(VMap[Entry]), Entry, Check));
+    Growth += VersionBlock->size() - SizeBefore;
+
+    // Values of the region are used after it through the phis of the join
+    // block, or are merged with their copies there.
+    BasicBlock *LastCopy = cast<BasicBlock>(VMap[Last]);
+    for (PHINode &PN : Join->phis()) {
+      Value *V = PN.getIncomingValueForBlock(Last);
+      Value *Copy = VMap.lookup(V);
+      PN.addIncoming(Copy ? Copy : V, LastCopy);
+      SE.forgetValue(&PN);
+    }
+    SSAUpdater SSA;
+    SmallVector<Use *, 8> UsesToRewrite;
+    for (BasicBlock *BB : Region)
+      for (Instruction &I : *BB) {
+        UsesToRewrite.clear();
+        for (Use &U : I.uses()) {
+          auto *UI = cast<Instruction>(U.getUser());
+          BasicBlock *UseBB = UI->getParent();
+          if (auto *PN = dyn_cast<PHINode>(UI))
+            UseBB = PN->getIncomingBlock(U);
+          if (!Region.count(UseBB))
+            UsesToRewrite.push_back(&U);
+        }
+        if (UsesToRewrite.empty())
+          continue;
+        SE.forgetValue(&I);
+        SSA.Initialize(I.getType(), I.getName());
+        SSA.AddAvailableValue(BB, &I);
+        SSA.AddAvailableValue(cast<BasicBlock>(VMap[BB]), VMap[&I]);
+        for (Use *U : UsesToRewrite)
+          SSA.RewriteUse(*U);
       }
-      LLVM_DEBUG(
-          dbgs() << "Sucessfully peeled " << FC0.PP.PeelCount
-                  << " iterations from the first loop.\n"
-                    "Both Loops have the same number of iterations now.\n");
+
+    addStringMetadataToLoop(FC0.L, "llvm.loop.fusion.versioned", 1);
+    addStringMetadataToLoop(FC1.L, "llvm.loop.fusion.versioned", 1);
+    SE.forgetLoop(FC0.L);
+    SE.forgetLoop(FC1.L);
+    DT.recalculate(F);
+    PDT.recalculate(F);
+
+    if (CheckTripCounts)
+      ++TripCountsVersioned;
+    if (!AliasChecks.empty())
+      ++AliasChecksVersioned;
+    RuntimeAliasChecks += AliasChecks.size();
+    RuntimeVersioningGrowth += Growth;
+    RuntimeVersionBudget -= std::min(Growth, RuntimeVersionBudget);
+    std::string Checks = CheckTripCounts ? "equal trip counts" : "";
+    if (!AliasChecks.empty())
+      Checks += (CheckTripCounts ? " and " : "") +
+                utostr(AliasChecks.size()) + " alias checks";
+    FUSION_TRACE(TRACE_FUSION, 1,
+                 "loops " << FC0.L->getName() << " and " << FC1.L->getName()
+                          << " versioned on " << Checks << ", adding "
+                          << Growth << " instructions");
+    ORE.emit([&]() {
+      std::string CheckStr;
+      raw_string_ostream OS(CheckStr);
+      ListSeparator LS(" and ");
+      if (CheckTripCounts)
+        OS << LS << *BTCs->first << " == " << *BTCs->second;
+      for (const AliasCheck &C : AliasChecks)
+        OS << LS << "no overlap of " << *C.Base0 << " and " << *C.Base1;
+      if (!SameGuards)
+        OS << LS << "equal guards";
+      return OptimizationRemark(DEBUG_TYPE, "RuntimeVersioned",
+                                FC0.L->getStartLoc(), VersionBlock)
+             << "versioned " << FC0.L->getName() << " and "
+             << FC1.L->getName() << " on the runtime check "
+             << ore::NV("Check", OS.str()) << ", adding "
+             << ore::NV("Instructions", Growth) << " instructions";
+    });
+    return {Copies[0], Copies[1]};
+  }
+
+  /// Extend \p Chain, a pair of fusion candidates that passed all legality
+  /// checks, with the candidates following it in \p CandidateSet for as long
+  /// as each of them could be fused with the loop that the chain fuses into.
+  ///
+  /// Only unguarded, rotated candidates with identical trip counts form
+  /// chains, as performChainFusion expects. A candidate that does not qualify
+  /// ends the chain without a remark; it is checked again, and reported, as
+  /// the second candidate of a pair with the fused loop.
+  void extendFusionChain(
+      FusionCandidateSet &CandidateSet,
+      SmallVectorImpl<FusionCandidateSet::iterator> &Chain) {
+    auto IsChainable = [](const FusionCandidate &FC) {
+      return !FC.GuardBranch && FC.ExitingBlock == FC.Latch;
+    };
+    if (!IsChainable(*Chain[0]) || !IsChainable(*Chain[1]))
+      return;
+
+    const FusionCandidate &First = *Chain.front();
+    for (auto Next = std::next(Chain.back()); Next != CandidateSet.end();
+         ++Next) {
+      const FusionCandidate &Last = *Chain.back();
+      if (!IsChainable(*Next) || !isAdjacent(Last, *Next) ||
+          !haveIdenticalTripCounts(Last, *Next).first)
+        return;
+      // The preheader of the candidate is moved into the preheader of the
+      // first loop of the chain.
+      if (!isSafeToMoveBefore(*Next->Preheader,
+                              *First.Preheader->getTerminator(), DT, &PDT,
+                              &DI))
+        return;
+      // The candidate is fused with the body of every loop in the chain.
+      for (auto FC : Chain)
+        if (!dependencesAllowFusion(*FC, *Next))
+          return;
+      if (!isBeneficialFusion(First, *Next))
+        return;
+      Chain.push_back(Next);
     }
   }
-  
+
   /// Walk each set of control flow equivalent fusion candidates and attempt to
   /// fuse them. This does a single linear traversal of all candidates in the
   /// set. The conditions for legal fusion are checked at this point. If a pair
   /// of fusion candidates passes all legality checks, they are fused together
   /// and a new fusion candidate is created and added to the FusionCandidateSet.
   /// The original fusion candidates are then removed, as they are no longer
-  /// valid.
+  /// valid. If the candidates following the pair can be fused as well, the
+  /// whole chain is fused at once (see extendFusionChain).
   bool fuseCandidates() {
     bool Fused = false;
     LLVM_DEBUG(printFusionCandidates(FusionCandidates));
@@ -1072,10 +4561,11 @@ private:
       LLVM_DEBUG(dbgs() << "Attempting fusion on Candidate Set:\n"
                         << CandidateSet << "\n");
   
-      for (auto FC0 = CandidateSet.begin(); FC0 != CandidateSet.end(); ++FC0) {
+      for (auto FC0 = CandidateSet.begin(); FC0 != CandidateSet.end();) {
         assert(!LDT.isRemovedLoop(FC0->L) &&
                 "Should not have removed loops in CandidateSet!");
         auto FC1 = FC0;
+        bool Versioned = false;
         for (++FC1; FC1 != CandidateSet.end(); ++FC1) {
           assert(!LDT.isRemovedLoop(FC1->L) &&
                   "Should not have removed loops in CandidateSet!");
@@ -1089,23 +4579,72 @@ private:
           // Check if the candidates have identical tripcounts (first value of
           // pair), and if not check the difference in the tripcounts between
           // the loops (second value of pair). The difference is not equal to
-          // None iff the loops iterate a constant number of times, and have a
-          // single exit.
-          std::pair<bool, Optional<unsigned>> IdenticalTripCountRes =
+          // None iff the trip counts differ by a constant.
+          std::pair<bool, Optional<int>> IdenticalTripCountRes =
               haveIdenticalTripCounts(*FC0, *FC1);
           bool SameTripCount = IdenticalTripCountRes.first;
-          Optional<unsigned> TCDifference = IdenticalTripCountRes.second;
-  
-          // Here we are checking that FC0 (the first loop) can be peeled, and
-          // both loops have different tripcounts.
-          if (FC0->AbleToPeel && !SameTripCount && TCDifference) {
-            if (*TCDifference > FusionPeelMaxCount) {
-              LLVM_DEBUG(dbgs()
-                          << "Difference in loop trip counts: " << *TCDifference
-                          << " is greater than maximum peel count specificed: "
-                          << FusionPeelMaxCount << "\n");
+          Optional<int> TCDifference = IdenticalTripCountRes.second;
+  
+          // Here we are checking that the loop with more iterations can be
+          // peeled, the leading iterations of FC0 or the trailing ones of FC1,
+          // and both loops have different tripcounts. Otherwise, the index
+          // sets of the loops may still be split, or both loops versioned on
+          // their trip counts being equal.
+          bool AcrossGuards = false;
+          bool Split = false;
+          bool Version = false;
+          if (!SameTripCount) {
+            Optional<unsigned> Cost;
+            if (TCDifference && *TCDifference) {
+              const FusionCandidate &Longer = *TCDifference > 0 ? *FC0 : *FC1;
+              AcrossGuards = FC0->GuardBranch && FC1->GuardBranch &&
+                             !haveIdenticalGuards(*FC0, *FC1);
+              Cost = getPeelCost(Longer, std::abs(*TCDifference),
+                                 *TCDifference > 0, AcrossGuards);
+            }
+            if (FusionSplitIndexSets && (!Cost || *Cost > FusionPeelMaxCost)) {
+              Optional<unsigned> SplitCost = getSplitCost(*FC0, *FC1);
+              if (SplitCost && (!Cost || *SplitCost < *Cost)) {
+                Cost = SplitCost;
+                Split = true;
+              }
+            }
+            unsigned MaxCost = FusionPeelMaxCost;
+            if ((!Cost || *Cost > MaxCost) && RuntimeVersionBudget) {
+              if (Optional<unsigned> VersionCost = getRuntimeVersioningCost(
+                      *FC0, *FC1, /*CheckTripCounts=*/true)) {
+                Cost = VersionCost;
+                MaxCost = RuntimeVersionBudget;
+                Split = false;
+                Version = true;
+              }
+            }
+            const char *How = Version ? "versioned" : Split ? "split" : "peeled";
+            if (!Cost || *Cost > MaxCost) {
+              if (Cost || (TCDifference && *TCDifference)) {
+                LLVM_DEBUG(dbgs()
+                           << "Difference in loop trip counts cannot be "
+                           << How << " within the maximum cost specified: "
+                           << MaxCost << "\n");
+                FUSION_TRACE(TRACE_FUSION, 1,
+                             "loops " << FC0->L->getName() << " and "
+                                      << FC1->L->getName() << " not " << How
+                                      << ": "
+                                      << (Cost ? (Version ? "versioning adds "
+                                                  : Split ? "splitting adds "
+                                                          : "peeling adds ") +
+                                                     utostr(*Cost) +
+                                                     " instructions"
+                                               : std::string("cannot peel")));
+              }
+            } else if (!AllowPeeling && !isSitePair(FC0->L, FC1->L)) {
+              PeelingDeferred = true;
+              FUSION_TRACE(TRACE_FUSION, 1,
+                           "loops " << FC0->L->getName() << " and "
+                                    << FC1->L->getName() << " not " << How
+                                    << " yet: other fusions first");
             } else {
-              // Dependent on peeling being performed on the first loop, and
+              // Dependent on peeling being performed on the longer loop, and
               // assuming all other conditions for fusion return true.
               SameTripCount = true;
             }
@@ -1119,13 +4658,38 @@ private:
             continue;
           }
   
+          // Dependences of a negative distance, where FC1 uses what later
+          // iterations of FC0 compute, are kept by aligning the loops, unless
+          // the trip counts need more than peeling. Loops with different
+          // guards are only aligned by peeling the longer FC0.
+          bool MayAlign = FusionAlignLoops && !Split && !Version &&
+                          TCDifference &&
+                          (!AcrossGuards || *TCDifference > 0);
+
           if (!isAdjacent(*FC0, *FC1)) {
-            LLVM_DEBUG(dbgs()
-                        << "Fusion candidates are not adjacent. Not fusing.\n");
-            reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1, NonAdjacent);
-            continue;
+            if (!moveInterveningCode(CandidateSet, FC0, FC1, MayAlign)) {
+              LLVM_DEBUG(dbgs() << "Fusion candidates are not adjacent. Not "
+                                   "fusing.\n");
+              reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
+                                                         NonAdjacent);
+              continue;
+            }
+            Fused = true;
           }
   
+          // A lone guard that is known to hold is removed, leaving a pair of
+          // unguarded candidates. The function has changed even if they are
+          // not fused in the end.
+          if (!FC0->GuardBranch != !FC1->GuardBranch &&
+              removeImpliedGuard(CandidateSet, FC0, FC1)) {
+            Fused = true;
+            if (!isAdjacent(*FC0, *FC1)) {
+              reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
+                                                         NonAdjacent);
+              continue;
+            }
+          }
+
           if (!FC0->GuardBranch && FC1->GuardBranch) {
             LLVM_DEBUG(dbgs() << "The second candidate is guarded while the "
                                   "first one is not. Not fusing.\n");
@@ -1133,11 +4697,24 @@ private:
                 *FC0, *FC1, OnlySecondCandidateIsGuarded);
             continue;
           }
+
+          if (FC0->GuardBranch && !FC1->GuardBranch) {
+            LLVM_DEBUG(dbgs() << "The first candidate is guarded while the "
+                                 "second one is not. Not fusing.\n");
+            reportLoopFusion<OptimizationRemarkMissed>(
+                *FC0, *FC1, OnlyFirstCandidateIsGuarded);
+            continue;
+          }
   
-          // Ensure that FC0 and FC1 have identical guards.
+          // Ensure that FC0 and FC1 have identical guards, unless the longer
+          // one is peeled and can take the guard of the other one, or both
+          // are split and take both guards, or versioned on the guards being
+          // equal as well.
           // If one (or both) are not guarded, this check is not necessary.
           if (FC0->GuardBranch && FC1->GuardBranch &&
-              !haveIdenticalGuards(*FC0, *FC1) && !TCDifference) {
+              !haveIdenticalGuards(*FC0, *FC1) && !Split && !Version &&
+              !(TCDifference && *TCDifference &&
+                canPeelAcrossGuards(*FC0, *FC1, *TCDifference > 0))) {
             LLVM_DEBUG(dbgs() << "Fusion candidates do not have identical "
                                   "guards. Not Fusing.\n");
             reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
@@ -1145,6 +4722,14 @@ private:
             continue;
           }
   
+          // Instructions in the preheader or guard block of FC1 that cannot
+          // be hoisted into the ones of FC0 may still be sunk below FC1.
+          if (!isSafeToMoveBefore(*FC1->getEntryBlock(),
+                                  *FC0->getEntryBlock()->getTerminator(), DT,
+                                  &PDT, &DI) &&
+              moveInterveningCode(CandidateSet, FC0, FC1, MayAlign))
+            Fused = true;
+
           if (!isSafeToMoveBefore(*FC1->Preheader,
                                   *FC0->Preheader->getTerminator(), DT, &PDT,
                                   &DI)) {
@@ -1181,14 +4766,106 @@ private:
             }
           }
   
+          // The code between the loops may have changed since the index sets
+          // were found to be splittable, or the loops to be versionable.
+          if ((Split && !getSplitCost(*FC0, *FC1)) ||
+              (Version && !getRuntimeVersioningCost(
+                              *FC0, *FC1, /*CheckTripCounts=*/true))) {
+            LLVM_DEBUG(dbgs() << "Fusion candidates cannot be split or "
+                                 "versioned. Not fusing.\n");
+            reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
+                                                       NonEqualTripCount);
+            continue;
+          }
+
           // Check the dependencies across the loops and do not fuse if it would
-          // violate them.
-          if (!dependencesAllowFusion(*FC0, *FC1)) {
+          // violate them, unless the accesses that may depend on each other
+          // can be checked not to overlap at runtime, to fuse the loops in a
+          // version of them that runs if the checks hold. The trip counts
+          // may be checked in the same go, but peeled or split loops are not
+          // versioned as well. Dependences of a negative distance are kept
+          // by aligning the loops instead, see MayAlign.
+          SmallVector<AliasCheck, 4> AliasChecks;
+          bool MayVersion = RuntimeVersionBudget && FusionRuntimeAliasChecks &&
+                            !Split && !(TCDifference && *TCDifference);
+          unsigned Shift = 0;
+          if (!dependencesAllowFusion(*FC0, *FC1,
+                                      MayVersion ? &AliasChecks : nullptr,
+                                      MayAlign ? &Shift : nullptr)) {
             LLVM_DEBUG(dbgs() << "Memory dependencies do not allow fusion!\n");
             reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
                                                         InvalidDependencies);
             continue;
           }
+          // Peeling the leading iterations of FC0 for its longer trip count
+          // aligns the loops by as many iterations already.
+          bool Align = false;
+          if (Shift && int(Shift) > *TCDifference) {
+            Optional<unsigned> Cost;
+            if (!AcrossGuards)
+              Cost = getAlignmentCost(*FC0, *FC1, Shift, *TCDifference);
+            if (!AliasChecks.empty() || !Cost || *Cost > FusionPeelMaxCost) {
+              LLVM_DEBUG(dbgs() << "Fusion candidates cannot be aligned. Not "
+                                   "fusing.\n");
+              FUSION_TRACE(TRACE_FUSION, 1,
+                           "loops " << FC0->L->getName() << " and "
+                                    << FC1->L->getName() << " not aligned: "
+                                    << (!AliasChecks.empty()
+                                            ? std::string("needs alias checks")
+                                        : Cost ? "peeling adds " +
+                                                     utostr(*Cost) +
+                                                     " instructions"
+                                               : std::string("cannot peel")));
+              reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
+                                                         InvalidDependencies);
+              continue;
+            }
+            if (!AllowPeeling && !isSitePair(FC0->L, FC1->L)) {
+              PeelingDeferred = true;
+              FUSION_TRACE(TRACE_FUSION, 1,
+                           "loops " << FC0->L->getName() << " and "
+                                    << FC1->L->getName()
+                                    << " not aligned yet: other fusions first");
+              reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
+                                                         InvalidDependencies);
+              continue;
+            }
+            Align = true;
+          }
+          bool CheckTripCounts = Version;
+          if (!AliasChecks.empty()) {
+            Optional<unsigned> Cost =
+                getRuntimeVersioningCost(*FC0, *FC1, CheckTripCounts,
+                                         AliasChecks);
+            if (!Cost || *Cost > RuntimeVersionBudget) {
+              LLVM_DEBUG(dbgs() << "Memory dependencies cannot be checked at "
+                                   "runtime. Not fusing.\n");
+              FUSION_TRACE(TRACE_FUSION, 1,
+                           "loops " << FC0->L->getName() << " and "
+                                    << FC1->L->getName()
+                                    << " not versioned: "
+                                    << (Cost ? "versioning adds " +
+                                                   utostr(*Cost) +
+                                                   " instructions"
+                                             : std::string(
+                                                   "cannot check accesses")));
+              reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
+                                                         InvalidDependencies);
+              continue;
+            }
+            if (!AllowPeeling && !isSitePair(FC0->L, FC1->L)) {
+              PeelingDeferred = true;
+              FUSION_TRACE(TRACE_FUSION, 1,
+                           "loops " << FC0->L->getName() << " and "
+                                    << FC1->L->getName()
+                                    << " not versioned yet: other fusions "
+                                       "first");
+              reportLoopFusion<OptimizationRemarkMissed>(*FC0, *FC1,
+                                                         InvalidDependencies);
+              continue;
+            }
+            Version = true;
+          }
   
           bool BeneficialToFuse = isBeneficialFusion(*FC0, *FC1);
           LLVM_DEBUG(dbgs()
@@ -1207,31 +4884,84 @@ private:
                             << *FC1 << "\n");
   
           FusionCandidate FC0Copy = *FC0;
+          FusionCandidate FC1Copy = *FC1;
           // Peel the loop after determining that fusion is legal. The Loops
           // will still be safe to fuse after the peeling is performed.
-          bool Peel = TCDifference && *TCDifference > 0;
-          if (Peel)
+          bool Peel =
+              Split || Version || Align || (TCDifference && *TCDifference);
+          if (Split) {
+            splitIndexSets(FC0Copy, FC1Copy);
+          } else if (Version) {
+            // The loops are copied when they are fused, see below.
+          } else if (Align) {
+            alignFusionCandidates(FC0Copy, FC1Copy, Shift, *TCDifference);
+          } else if (Peel && *TCDifference > 0) {
+            if (FC0->GuardBranch && !haveIdenticalGuards(*FC0, *FC1))
+              versionAcrossGuards(*FC0, *FC1);
             peelFusionCandidate(FC0Copy, *FC1, *TCDifference);
+          } else if (Peel)
+            peelTrailingIterations(*FC0, FC1Copy, -*TCDifference);
+
+          // Take along the candidates following FC1 that can be fused as well,
+          // to fuse all of them at once.
+          SmallVector<FusionCandidateSet::iterator, 4> Chain = {FC0, FC1};
+          if (FusionChains && !Peel)
+            extendFusionChain(CandidateSet, Chain);
   
           // Report fusion to the Optimization Remarks.
           // Note this needs to be done *before* performFusion because
           // performFusion will change the original loops, making it not
           // possible to identify them after fusion is complete.
-          reportLoopFusion<OptimizationRemark>((Peel ? FC0Copy : *FC0), *FC1,
-                                                FuseCounter);
+          for (auto FC : drop_begin(Chain))
+            reportLoopFusion<OptimizationRemark>(FC0Copy, *FC, FuseCounter);
+
+          Loop *FusedLoop;
+          if (Version) {
+            auto Copies =
+                versionOnRuntimeChecks(*FC0, *FC1, CheckTripCounts, AliasChecks);
+            FusionCandidate Copy0(Copies.first, &DT, &PDT, ORE, FC0->PP);
+            FusionCandidate Copy1(Copies.second, &DT, &PDT, ORE, FC1->PP);
+            Copy0.verify();
+            Copy1.verify();
+            FusedLoop = performFusion(Copy0, Copy1);
+          } else if (Chain.size() > 2) {
+            SmallVector<FusionCandidate, 4> ChainCands;
+            for (auto FC : Chain)
+              ChainCands.push_back(*FC);
+            FusedLoop = performChainFusion(ChainCands);
+            ++ChainsFused;
+          } else {
+            FusedLoop = performFusion(FC0Copy, FC1Copy);
+          }
   
-          FusionCandidate FusedCand(
-              performFusion((Peel ? FC0Copy : *FC0), *FC1), &DT, &PDT, ORE,
-              FC0Copy.PP);
+          FusionCandidate FusedCand(FusedLoop, &DT, &PDT, ORE, FC0Copy.PP);
           FusedCand.verify();
           assert(FusedCand.isEligibleForFusion(SE) &&
                   "Fused candidate should be eligible for fusion!");
   
           // Notify the loop-depth-tree that these loops are not valid objects
-          LDT.removeLoop(FC1->L);
-  
-          CandidateSet.erase(FC0);
-          CandidateSet.erase(FC1);
+          // and remember where the loops went, to check the prepass rewrites.
+          for (auto FC : drop_begin(Chain)) {
+            LDT.removeLoop(FC->L);
+            FusedInto[FC->L] = FusedCand.L;
+          }
+          if (FC0->L != FusedCand.L)
+            FusedInto[FC0->L] = FusedCand.L;
+  
+          // The copies that were fused are not control flow equivalent to the
+          // other candidates, and neither are the versioned loops any more.
+          // Go on with the candidates after them.
+          if (Version) {
+            auto Next = std::next(FC1);
+            CandidateSet.erase(FC0);
+            CandidateSet.erase(FC1);
+            FC0 = Next;
+            Versioned = Fused = true;
+            break;
+          }
+
+          for (auto FC : Chain)
+            CandidateSet.erase(FC);
   
           auto InsertPos = CandidateSet.insert(FusedCand);
   
@@ -1242,12 +4972,19 @@ private:
           // of the FC1 loop will attempt to fuse the new (fused) loop with the
           // remaining candidates in the current candidate set.
           FC0 = FC1 = InsertPos.first;
+
+          // The exit block of a peeled FC1 may have been the preheader of
+          // the next candidate.
+          if (Peel)
+            updateCandidates(CandidateSet, {}, FC0, FC1);
   
           LLVM_DEBUG(dbgs() << "Candidate Set (after fusion): " << CandidateSet
                             << "\n");
   
           Fused = true;
         }
+        if (!Versioned)
+          ++FC0;
       }
     }
     return Fused;
@@ -1320,10 +5057,12 @@ private:
     //       L0) and the other is not. We could check if it is monotone and test
     //       the beginning and end value instead.
   
+    // Recurrences of L1 itself are fine, even if the headers of guarded loops
+    // do not dominate each other.
     BasicBlock *L0Header = L0.getHeader();
     auto HasNonLinearDominanceRelation = [&](const SCEV *S) {
       const SCEVAddRecExpr *AddRec = dyn_cast<SCEVAddRecExpr>(S);
-      if (!AddRec)
+      if (!AddRec || AddRec->getLoop() == &L1)
         return false;
       return !DT.dominates(L0Header, AddRec->getLoop()->getHeader()) &&
               !DT.dominates(AddRec->getLoop()->getHeader(), L0Header);
@@ -1343,6 +5082,237 @@ private:
     return IsAlwaysGE;
   }
   
+  /// The iterations of two fusion candidates in which a pair of their
+  /// accesses touch the same memory, as the range of dependence distances
+  /// i1 - i0 between iteration i0 of the first loop and i1 of the second one.
+  struct AffineDependence {
+    /// Whether the accesses never touch the same memory
+    bool Independent = false;
+    /// The bounds of the distance, None if unbounded
+    Optional<int64_t> MinDistance, MaxDistance;
+  };
+
+  /// Return true if the subscript \p S is known to stay in [0, \p Size) in
+  /// every iteration of the loops it iterates over, checking the first and
+  /// the last iteration of each of them.
+  bool isKnownInBounds(const SCEV *S, const SCEV *Size) const {
+    const SCEV *First = S, *Last = S;
+    auto IsNonDecreasing = [&](const SCEVAddRecExpr *AR) {
+      return AR->isAffine() && SE.isKnownNonNegative(AR->getStepRecurrence(SE));
+    };
+    while (auto *AR = dyn_cast<SCEVAddRecExpr>(First)) {
+      if (!IsNonDecreasing(AR))
+        return false;
+      First = AR->getStart();
+    }
+    while (auto *AR = dyn_cast<SCEVAddRecExpr>(Last)) {
+      const SCEV *BTC = SE.getBackedgeTakenCount(AR->getLoop());
+      if (!IsNonDecreasing(AR) || isa<SCEVCouldNotCompute>(BTC))
+        return false;
+      Last = AR->evaluateAtIteration(BTC, SE);
+    }
+    return SE.isKnownNonNegative(First) &&
+           SE.isKnownNegative(SE.getMinusSCEV(Last, Size));
+  }
+
+  /// Replace the addresses in \p Subscripts0 of \p I0 and \p Subscripts1 of
+  /// \p I1 by their subscripts if they access one array whose dimensions are
+  /// only known at runtime, as A[i * m + j] for A[i][j] with a row size m.
+  /// Such addresses are not affine, but their subscripts may be. Return
+  /// false if they cannot be split, or if a subscript could run past the
+  /// size of its dimension into the next row.
+  bool delinearizeAccesses(Instruction &I0, Instruction &I1,
+                           SmallVectorImpl<const SCEV *> &Subscripts0,
+                           SmallVectorImpl<const SCEV *> &Subscripts1) const {
+    if (getLoadStoreType(&I0) != getLoadStoreType(&I1))
+      return false;
+    const SCEV *Base = SE.getPointerBase(Subscripts0.front());
+    if (Base != SE.getPointerBase(Subscripts1.front()))
+      return false;
+    auto *AR0 = dyn_cast<SCEVAddRecExpr>(
+        SE.getMinusSCEV(Subscripts0.front(), Base));
+    auto *AR1 = dyn_cast<SCEVAddRecExpr>(
+        SE.getMinusSCEV(Subscripts1.front(), Base));
+    if (!AR0 || !AR1)
+      return false;
+
+    // Both accesses must agree on the sizes of the dimensions.
+    SmallVector<const SCEV *, 4> Terms, Sizes;
+    collectParametricTerms(SE, AR0, Terms);
+    collectParametricTerms(SE, AR1, Terms);
+    findArrayDimensions(SE, Terms, Sizes, SE.getElementSize(&I0));
+    SmallVector<const SCEV *, 4> Subs0, Subs1;
+    computeAccessFunctions(SE, AR0, Subs0, Sizes);
+    computeAccessFunctions(SE, AR1, Subs1, Sizes);
+    if (Subs0.size() < 2 || Subs0.size() != Subs1.size())
+      return false;
+    // Sizes[Dim - 1] is the size of dimension Dim; the first one is unbounded.
+    for (unsigned Dim = 1; Dim < Subs0.size(); ++Dim)
+      if (!isKnownInBounds(Subs0[Dim], Sizes[Dim - 1]) ||
+          !isKnownInBounds(Subs1[Dim], Sizes[Dim - 1]))
+        return false;
+
+    Subscripts0.assign(Subs0.begin(), Subs0.end());
+    Subscripts1.assign(Subs1.begin(), Subs1.end());
+    return true;
+  }
+
+  /// Return the dependence between the load or store \p I0 in \p FC0 and
+  /// \p I1 in \p FC1, or None if their addresses are not affine.
+  ///
+  /// Each address must be a pointer plus a constant multiple of the
+  /// iteration of each loop around it, up to the candidate and down to the
+  /// loops nested in it; the pointers must only differ by a constant. The
+  /// loops around the candidates run the same iteration for both accesses,
+  /// the others have iterations of their own, bounded by their constant
+  /// maximum trip counts, and the accesses must overlap:
+  ///
+  ///   1 - Size0 <= Ptr0 - Ptr1 <= Size1 - 1
+  ///
+  /// which is an equality if the sizes are the same and divide the rest.
+  /// Accesses of an array with runtime dimensions are delinearized instead,
+  /// and each of their subscripts must be affine and equal.
+  Optional<AffineDependence> getAffineDependence(const FusionCandidate &FC0,
+                                                 const FusionCandidate &FC1,
+                                                 Instruction &I0,
+                                                 Instruction &I1) const {
+    Value *Ptr0 = getLoadStorePointerOperand(&I0);
+    Value *Ptr1 = getLoadStorePointerOperand(&I1);
+    if (!Ptr0 || !Ptr1 || Ptr0->getType() != Ptr1->getType())
+      return None;
+    int64_t Size0 = DL.getTypeStoreSize(getLoadStoreType(&I0));
+    int64_t Size1 = DL.getTypeStoreSize(getLoadStoreType(&I1));
+    if (!Size0 || !Size1)
+      return None;
+
+    // Distinct objects, such as two globals, do not overlap at all.
+    SmallVector<const SCEV *, 4> Subscripts[2] = {{SE.getSCEV(Ptr0)},
+                                                  {SE.getSCEV(Ptr1)}};
+    auto *Base0 = dyn_cast<SCEVUnknown>(SE.getPointerBase(Subscripts[0][0]));
+    auto *Base1 = dyn_cast<SCEVUnknown>(SE.getPointerBase(Subscripts[1][0]));
+    if (Base0 && Base1 && Base0 != Base1 &&
+        isIdentifiedObject(Base0->getValue()) &&
+        isIdentifiedObject(Base1->getValue())) {
+      AffineDependence Dep;
+      Dep.Independent = true;
+      return Dep;
+    }
+    bool Delinearized = delinearizeAccesses(I0, I1, Subscripts[0],
+                                            Subscripts[1]);
+
+    // Variable 0 is the distance d, variable K + 1 the iteration of
+    // Loops[K], starting with i0, the one of FC0; FC1 runs i1 = i0 + d.
+    // Subscript Dim of Ptr0 - Ptr1 is Deltas[Dim] . x + Offsets[Dim].
+    SmallVector<const Loop *, 8> Loops = {FC0.L};
+    SmallVector<SmallDenseMap<unsigned, int64_t, 8>, 4> Deltas;
+    SmallVector<int64_t, 4> Offsets;
+    for (unsigned Dim = 0; Dim < Subscripts[0].size(); ++Dim) {
+      SmallDenseMap<unsigned, int64_t, 8> &Delta = Deltas.emplace_back();
+      const SCEV *Rest[2];
+      for (unsigned Idx : {0, 1}) {
+        const FusionCandidate &FC = Idx ? FC1 : FC0;
+        const SCEV *S = Subscripts[Idx][Dim];
+        while (auto *AR = dyn_cast<SCEVAddRecExpr>(S)) {
+          auto *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+          const Loop *L = AR->getLoop();
+          if (!AR->isAffine() || !Step ||
+              Step->getAPInt().getMinSignedBits() > 32 ||
+              !(L->contains(FC.L) || FC.L->contains(L)))
+            return None;
+          // The loops around the candidates are shared, the ones nested in
+          // them are not.
+          if (L == FC.L)
+            L = FC0.L;
+          unsigned K = find(Loops, L) - Loops.begin();
+          if (K == Loops.size())
+            Loops.push_back(L);
+          // Ptr1 has i0 + d for i1.
+          int64_t C = Step->getAPInt().getSExtValue();
+          if (Idx) {
+            C = -C;
+            if (K == 0)
+              Delta[0] += C;
+          }
+          Delta[K + 1] += C;
+          S = AR->getStart();
+        }
+        Rest[Idx] = S;
+      }
+      auto *Diff = dyn_cast<SCEVConstant>(SE.getMinusSCEV(Rest[0], Rest[1]));
+      if (!Diff || Diff->getAPInt().getMinSignedBits() > 48)
+        return None;
+      Offsets.push_back(Diff->getAPInt().getSExtValue());
+    }
+
+    unsigned NumVars = Loops.size() + 1;
+    LinearSystem System(NumVars);
+    // The iterations of the loops, with i0 + d for FC1, run from 0 to their
+    // maximum backedge-taken count.
+    auto GetMaxIteration = [&](const Loop *L) -> Optional<int64_t> {
+      auto *BTC =
+          dyn_cast<SCEVConstant>(SE.getConstantMaxBackedgeTakenCount(L));
+      if (!BTC || BTC->getAPInt().getActiveBits() > 32)
+        return None;
+      return BTC->getAPInt().getZExtValue();
+    };
+    for (unsigned Var = 1; Var < NumVars; ++Var)
+      System.addBounds(Var, 0, GetMaxIteration(Loops[Var - 1]));
+    SmallVector<int64_t, 8> Iter1(NumVars, 0);
+    Iter1[0] = Iter1[1] = -1;
+    System.addLE(Iter1, 0);
+    if (Optional<int64_t> Max1 = GetMaxIteration(FC1.L)) {
+      Iter1[0] = Iter1[1] = 1;
+      System.addLE(Iter1, *Max1);
+    }
+
+    for (unsigned Dim = 0; Dim < Deltas.size(); ++Dim) {
+      SmallVector<int64_t, 8> Delta(NumVars, 0);
+      for (const auto &VarCoeff : Deltas[Dim])
+        Delta[VarCoeff.first] = VarCoeff.second;
+      int64_t Offset = Offsets[Dim];
+      // Subscripts are in elements and must all be equal.
+      if (Delinearized) {
+        System.addEQ(Delta, -Offset);
+        continue;
+      }
+      bool Aligned = Size0 == Size1 && Offset % Size0 == 0 &&
+                     all_of(Delta, [&](int64_t C) { return C % Size0 == 0; });
+      if (Aligned) {
+        // Delta . x + Offset == 0 in units of the access size.
+        for (int64_t &C : Delta)
+          C /= Size0;
+        System.addEQ(Delta, -Offset / Size0);
+      } else {
+        System.addLE(Delta, Size1 - 1 - Offset);
+        for (int64_t &C : Delta)
+          C = -C;
+        System.addLE(Delta, Size0 - 1 + Offset);
+      }
+    }
+
+    AffineDependence Dep;
+    Dep.Independent = !System.project(0, Dep.MinDistance, Dep.MaxDistance);
+    return Dep;
+  }
+
+  /// Return true if the accesses \p I0 in \p FC0 and \p I1 in \p FC1 allow
+  /// fusion once FC1 runs \p Shift iterations behind FC0, and raise Shift
+  /// to the negated minimum distance of their dependence if it is larger.
+  /// Aligning the loops peels at least one instruction per iteration, so
+  /// distances beyond the maximum peeling cost are not considered.
+  bool addAlignment(const FusionCandidate &FC0, const FusionCandidate &FC1,
+                    Instruction &I0, Instruction &I1, unsigned &Shift) const {
+    Optional<AffineDependence> Dep = getAffineDependence(FC0, FC1, I0, I1);
+    if (!Dep)
+      return false;
+    if (Dep->Independent)
+      return true;
+    if (!Dep->MinDistance || *Dep->MinDistance < -int64_t(FusionPeelMaxCost))
+      return false;
+    Shift = std::max<int64_t>(Shift, -*Dep->MinDistance);
+    return true;
+  }
+
   /// Return true if the dependences between @p I0 (in @p L0) and @p I1 (in
   /// @p L1) allow loop fusion of @p L0 and @p L1. The dependence analyses
   /// specified by @p DepChoice are used to determine this.
@@ -1378,40 +5348,74 @@ private:
         LLVM_DEBUG(
             dbgs() << "TODO: Implement pred/succ dependence handling!\n");
   
-      // TODO: Can we actually use the dependence info analysis here?
+      // The candidates are siblings, so the levels of the dependence are the
+      // loops around them. Fusion only reorders accesses within one
+      // iteration of each of these. If a level cannot be '=', then I0 and
+      // I1 always run in different iterations of that loop, in the same
+      // order after fusion, whether the distance is positive or negative.
+      assert(DepResult->getLevels() < FC0.L->getLoopDepth() &&
+             "Fusion candidates share a loop");
+      for (unsigned Level = 1; Level <= DepResult->getLevels(); ++Level)
+        if (!(DepResult->getDirection(Level) & Dependence::DVEntry::EQ))
+          return true;
+
+      // DA has no level for the candidates themselves, so it cannot tell a
+      // forward dependence between them from a backward one.
       return false;
     }
   
+    case FUSION_DEPENDENCE_ANALYSIS_AFFINE: {
+      // Fusion runs iteration i0 of FC0 before iteration i1 of FC1 if
+      // i0 <= i1, so the distance must not be negative.
+      Optional<AffineDependence> Dep = getAffineDependence(FC0, FC1, I0, I1);
+      return Dep && (Dep->Independent ||
+                     (Dep->MinDistance &&
+                      *Dep->MinDistance >= (AnyDep ? 1 : 0)));
+    }
+
     case FUSION_DEPENDENCE_ANALYSIS_ALL:
       return dependencesAllowFusion(FC0, FC1, I0, I1, AnyDep,
                                     FUSION_DEPENDENCE_ANALYSIS_SCEV) ||
               dependencesAllowFusion(FC0, FC1, I0, I1, AnyDep,
-                                    FUSION_DEPENDENCE_ANALYSIS_DA);
+                                    FUSION_DEPENDENCE_ANALYSIS_DA) ||
+              dependencesAllowFusion(FC0, FC1, I0, I1, AnyDep,
+                                    FUSION_DEPENDENCE_ANALYSIS_AFFINE);
     }
   
     llvm_unreachable("Unknown fusion dependence analysis choice!");
   }
   
   /// Perform a dependence check and return if @p FC0 and @p FC1 can be fused.
+  /// With @p AliasChecks, accesses that may depend on each other do not
+  /// prevent fusion if they can be checked not to overlap at runtime, and
+  /// the checks are added to it. With @p Shift, dependences of a negative
+  /// distance do not prevent fusion either, and Shift is set to the number
+  /// of iterations FC1 has to run behind FC0 for them (see
+  /// alignFusionCandidates).
   bool dependencesAllowFusion(const FusionCandidate &FC0,
-                              const FusionCandidate &FC1) {
+                              const FusionCandidate &FC1,
+                              SmallVectorImpl<AliasCheck> *AliasChecks =
+                                  nullptr,
+                              unsigned *Shift = nullptr) {
     LLVM_DEBUG(dbgs() << "Check if " << FC0 << " can be fused with " << FC1
                       << "\n");
     assert(FC0.L->getLoopDepth() == FC1.L->getLoopDepth());
     assert(DT.dominates(FC0.getEntryBlock(), FC1.getEntryBlock()));
   
+    auto Allowed = [&](Instruction &I0, Instruction &I1) {
+      return dependencesAllowFusion(FC0, FC1, I0, I1, /* AnyDep */ false,
+                                    FusionDependenceAnalysis) ||
+             (Shift && addAlignment(FC0, FC1, I0, I1, *Shift)) ||
+             (AliasChecks && addAliasCheck(FC0, FC1, I0, I1, *AliasChecks));
+    };
     for (Instruction *WriteL0 : FC0.MemWrites) {
       for (Instruction *WriteL1 : FC1.MemWrites)
-        if (!dependencesAllowFusion(FC0, FC1, *WriteL0, *WriteL1,
-                                    /* AnyDep */ false,
-                                    FusionDependenceAnalysis)) {
+        if (!Allowed(*WriteL0, *WriteL1)) {
           InvalidDependencies++;
           return false;
         }
       for (Instruction *ReadL1 : FC1.MemReads)
-        if (!dependencesAllowFusion(FC0, FC1, *WriteL0, *ReadL1,
-                                    /* AnyDep */ false,
-                                    FusionDependenceAnalysis)) {
+        if (!Allowed(*WriteL0, *ReadL1)) {
           InvalidDependencies++;
           return false;
         }
@@ -1419,16 +5423,12 @@ private:
   
     for (Instruction *WriteL1 : FC1.MemWrites) {
       for (Instruction *WriteL0 : FC0.MemWrites)
-        if (!dependencesAllowFusion(FC0, FC1, *WriteL0, *WriteL1,
-                                    /* AnyDep */ false,
-                                    FusionDependenceAnalysis)) {
+        if (!Allowed(*WriteL0, *WriteL1)) {
           InvalidDependencies++;
           return false;
         }
       for (Instruction *ReadL0 : FC0.MemReads)
-        if (!dependencesAllowFusion(FC0, FC1, *ReadL0, *WriteL1,
-                                    /* AnyDep */ false,
-                                    FusionDependenceAnalysis)) {
+        if (!Allowed(*ReadL0, *WriteL1)) {
           InvalidDependencies++;
           return false;
         }
@@ -1478,17 +5478,22 @@ private:
   /// NonLoopBlock). In other words, the the first successor of both loops must
   /// both go into the loop (i.e., the preheader) or go around the loop (i.e.,
   /// the NonLoopBlock). The same must be true for the second successor.
+  /// Guards on different conditions are still considered the same if
+  /// ScalarEvolution can prove them equivalent (see haveEquivalentGuards).
   bool haveIdenticalGuards(const FusionCandidate &FC0,
                             const FusionCandidate &FC1) const {
     assert(FC0.GuardBranch && FC1.GuardBranch &&
             "Expecting FC0 and FC1 to be guarded loops.");
   
-    if (auto FC0CmpInst =
-            dyn_cast<Instruction>(FC0.GuardBranch->getCondition()))
-      if (auto FC1CmpInst =
-              dyn_cast<Instruction>(FC1.GuardBranch->getCondition()))
-        if (!FC0CmpInst->isIdenticalTo(FC1CmpInst))
-          return false;
+    Value *FC0Cond = FC0.GuardBranch->getCondition();
+    Value *FC1Cond = FC1.GuardBranch->getCondition();
+    if (FC0Cond != FC1Cond) {
+      auto FC0CmpInst = dyn_cast<Instruction>(FC0Cond);
+      auto FC1CmpInst = dyn_cast<Instruction>(FC1Cond);
+      if (!FC0CmpInst || !FC1CmpInst || !FC0CmpInst->isIdenticalTo(FC1CmpInst))
+        return haveEquivalentGuards(FC0.GuardBranch, FC0.Preheader,
+                                    FC1.GuardBranch, FC1.Preheader);
+    }
   
     // The compare instructions are identical.
     // Now make sure the successor of the guards have the same flow into/around
@@ -1499,6 +5504,175 @@ private:
       return (FC1.GuardBranch->getSuccessor(1) == FC1.Preheader);
   }
   
+  /// Get the condition under which \p Guard branches to its successor
+  /// \p Entry as a predicate \p Pred on \p LHS and \p RHS. Returns false if
+  /// the guard does not branch on an integer compare.
+  bool getGuardEntryCondition(const BranchInst *Guard, const BasicBlock *Entry,
+                              ICmpInst::Predicate &Pred, const SCEV *&LHS,
+                              const SCEV *&RHS) const {
+    ICmpInst *Cmp = dyn_cast<ICmpInst>(Guard->getCondition());
+    if (!Cmp || !SE.isSCEVable(Cmp->getOperand(0)->getType()))
+      return false;
+    Pred = Guard->getSuccessor(0) == Entry ? Cmp->getPredicate()
+                                           : Cmp->getInversePredicate();
+    LHS = SE.getSCEV(Cmp->getOperand(0));
+    RHS = SE.getSCEV(Cmp->getOperand(1));
+    return true;
+  }
+
+  /// Determine if \p Guard0 branches to \p Entry0 under the same conditions as
+  /// the later \p Guard1 branches to \p Entry1, even though the conditions are
+  /// computed differently, e.g., after LoopRotate created one of the guards
+  /// from the exit condition of its loop.
+  ///
+  /// Either both guards compare the same SCEVs, or the entry condition of
+  /// \p Guard1 has to hold on entry to \p Entry0 and vice versa, which is
+  /// proved with ScalarEvolution from the conditions dominating the entry
+  /// blocks, including the guards themselves. The operands of \p Guard1 have
+  /// to be available at \p Guard0, so that they have the same value at both
+  /// guards.
+  bool haveEquivalentGuards(const BranchInst *Guard0, BasicBlock *Entry0,
+                            const BranchInst *Guard1,
+                            BasicBlock *Entry1) const {
+    ICmpInst::Predicate Pred0, Pred1;
+    const SCEV *LHS0, *RHS0, *LHS1, *RHS1;
+    if (!getGuardEntryCondition(Guard0, Entry0, Pred0, LHS0, RHS0) ||
+        !getGuardEntryCondition(Guard1, Entry1, Pred1, LHS1, RHS1))
+      return false;
+
+    const BasicBlock *GuardBlock0 = Guard0->getParent();
+    if (!SE.dominates(LHS1, GuardBlock0) || !SE.dominates(RHS1, GuardBlock0))
+      return false;
+
+    // The same condition, computed by different instructions.
+    if (Pred0 == Pred1 && LHS0 == LHS1 && RHS0 == RHS1)
+      return true;
+    if (Pred1 == ICmpInst::getSwappedPredicate(Pred0) && LHS0 == RHS1 &&
+        RHS0 == LHS1)
+      return true;
+    if (Pred0 == Pred1 && ICmpInst::isEquality(Pred0)) {
+      const SCEV *Diff0 = SE.getMinusSCEV(LHS0, RHS0);
+      if (Diff0 == SE.getMinusSCEV(LHS1, RHS1) ||
+          Diff0 == SE.getMinusSCEV(RHS1, LHS1))
+        return true;
+    }
+
+    return SE.isBasicBlockEntryGuardedByCond(Entry0, Pred1, LHS1, RHS1) &&
+           SE.isBasicBlockEntryGuardedByCond(Entry1, Pred0, LHS0, RHS0);
+  }
+
+  /// Determine if \p A <= \p B (signed) because they add constants to the
+  /// same value without signed wrap, as n - 1 <= n. ScalarEvolution does not
+  /// take the no-wrap flags of the instructions into account, and
+  /// ValueTracking only the one of B.
+  static bool isKnownSLEByOffset(Value *A, Value *B) {
+    using namespace PatternMatch;
+    auto Split = [](Value *V, APInt &Offset) {
+      const APInt *C;
+      Value *X;
+      Offset = APInt(V->getType()->getScalarSizeInBits(), 0);
+      if (match(V, m_NSWAdd(m_Value(X), m_APInt(C))))
+        Offset = *C;
+      else if (match(V, m_NSWSub(m_Value(X), m_APInt(C))) &&
+               !C->isMinSignedValue())
+        Offset = -*C;
+      else
+        return V;
+      return X;
+    };
+    if (!A->getType()->isIntegerTy())
+      return false;
+    APInt OffsetA, OffsetB;
+    return Split(A, OffsetA) == Split(B, OffsetB) && OffsetA.sle(OffsetB);
+  }
+
+  /// Determine if \p FC1 is entered whenever \p FC0 is, both being guarded,
+  /// as for the guards n > 0 and n + 1 > 0.
+  bool isGuardImplied(const FusionCandidate &FC0,
+                      const FusionCandidate &FC1) const {
+    const BranchInst *Guard0 = FC0.GuardBranch, *Guard1 = FC1.GuardBranch;
+    Optional<bool> Implied = isImpliedCondition(
+        Guard0->getCondition(), Guard1->getCondition(),
+        FC0.Preheader->getModule()->getDataLayout(),
+        Guard0->getSuccessor(0) == FC0.Preheader);
+    if (Implied && *Implied == (Guard1->getSuccessor(0) == FC1.Preheader))
+      return true;
+
+    // Both guards as LHS < RHS or LHS <= RHS, so that the one of FC0 implies
+    // the one of FC1 if LHS1 <= LHS0 and RHS0 <= RHS1.
+    auto GetCondition = [](const BranchInst *Guard, const BasicBlock *Entry,
+                           Value *&LHS, Value *&RHS) {
+      auto *Cmp = dyn_cast<ICmpInst>(Guard->getCondition());
+      if (!Cmp)
+        return ICmpInst::BAD_ICMP_PREDICATE;
+      ICmpInst::Predicate Pred = Guard->getSuccessor(0) == Entry
+                                     ? Cmp->getPredicate()
+                                     : Cmp->getInversePredicate();
+      LHS = Cmp->getOperand(0);
+      RHS = Cmp->getOperand(1);
+      if (Pred == ICmpInst::ICMP_SGT || Pred == ICmpInst::ICMP_SGE) {
+        std::swap(LHS, RHS);
+        Pred = ICmpInst::getSwappedPredicate(Pred);
+      }
+      return Pred;
+    };
+    Value *LHS0 = nullptr, *RHS0 = nullptr, *LHS1 = nullptr, *RHS1 = nullptr;
+    ICmpInst::Predicate Pred0 = GetCondition(Guard0, FC0.Preheader, LHS0, RHS0);
+    ICmpInst::Predicate Pred1 = GetCondition(Guard1, FC1.Preheader, LHS1, RHS1);
+    if ((Pred0 == ICmpInst::ICMP_SLT || Pred0 == ICmpInst::ICMP_SLE) &&
+        (Pred1 == ICmpInst::ICMP_SLE ||
+         (Pred0 == ICmpInst::ICMP_SLT && Pred1 == ICmpInst::ICMP_SLT)) &&
+        isKnownSLEByOffset(LHS1, LHS0) && isKnownSLEByOffset(RHS0, RHS1))
+      return true;
+
+    ICmpInst::Predicate Pred;
+    const SCEV *LHS, *RHS;
+    return getGuardEntryCondition(Guard1, FC1.Preheader, Pred, LHS, RHS) &&
+           SE.dominates(LHS, Guard0->getParent()) &&
+           SE.dominates(RHS, Guard0->getParent()) &&
+           SE.isBasicBlockEntryGuardedByCond(FC0.Preheader, Pred, LHS, RHS);
+  }
+
+  /// Determine if the loop with more iterations, \p FC0 if \p Leading is true
+  /// and \p FC1 otherwise, can be peeled for the other one although their
+  /// guards differ, as for loops running to n and n + 1. The longer loop has
+  /// to be entered whenever the shorter one is, so that it can take the guard
+  /// of the shorter one, and the iterations it then misses have to be able to
+  /// run after the guarded region of FC1 (see canRunAfterGuardedRegion).
+  bool canPeelAcrossGuards(const FusionCandidate &FC0,
+                           const FusionCandidate &FC1, bool Leading) const {
+    const FusionCandidate &Shorter = Leading ? FC1 : FC0;
+    const FusionCandidate &Longer = Leading ? FC0 : FC1;
+    return isGuardImplied(Shorter, Longer) &&
+           canRunAfterGuardedRegion(Longer, FC1.getNonLoopBlock(),
+                                    /*WholeLoop=*/Leading);
+  }
+
+  /// Determine if a copy of the guarded loop \p FC can run after the guarded
+  /// region that ends in \p Join, the non-loop successor of the last guard,
+  /// as the epilogue of peelTrailingIterations or, if \p WholeLoop is true,
+  /// the copy of versionAcrossGuards do. That requires that FC starts with
+  /// values available at its guard and that nothing but the guarded region
+  /// is left to skip.
+  bool canRunAfterGuardedRegion(const FusionCandidate &FC, BasicBlock *Join,
+                                bool WholeLoop) const {
+    // The values of the copy have to replace the ones the region computed.
+    if (!Join->hasNPredecessors(2) || FC.ExitingBlock != FC.Latch ||
+        !cast<BranchInst>(FC.Latch->getTerminator())->isConditional() ||
+        FC.ExitBlock->getFirstNonPHIOrDbg() != FC.ExitBlock->getTerminator() ||
+        (WholeLoop && !FC.ExitBlock->phis().empty()))
+      return false;
+    for (PHINode &PN : FC.Header->phis())
+      if (!DT.dominates(PN.getIncomingValueForBlock(FC.Preheader),
+                        FC.GuardBranch))
+        return false;
+    // The copy computes the preheader again.
+    return all_of(*FC.Preheader, [](Instruction &I) {
+      return I.isTerminator() ||
+             (isSafeToSpeculativelyExecute(&I) && !I.mayReadFromMemory());
+    });
+  }
+
   /// Modify the latch branch of FC to be unconditional since successors of the
   /// branch are the same.
   void simplifyLatchBranch(const FusionCandidate &FC) const {
@@ -1555,9 +5729,12 @@ private:
   Loop *performFusion(const FusionCandidate &FC0, const FusionCandidate &FC1) {
     assert(FC0.isValid() && FC1.isValid() &&
             "Expecting valid fusion candidates");
-    
-      errs() << "Fusion Candidate 0: \n"; FC0.dump();
-      errs() << "Fusion Candidate 1: \n"; FC1.dump();
+    FUSION_TRACE(TRACE_FUSION, 2,
+                 "fusing loop " << FC0.L->getName() << " with blocks "
+                                << BlockNames{FC0.L->getBlocks()});
+    FUSION_TRACE(TRACE_FUSION, 2,
+                 "  and loop " << FC1.L->getName() << " with blocks "
+                               << BlockNames{FC1.L->getBlocks()});
   
     LLVM_DEBUG(dbgs() << "Fusion Candidate 0: \n"; FC0.dump();
                 dbgs() << "Fusion Candidate 1: \n"; FC1.dump(););
@@ -1751,6 +5928,158 @@ private:
     return FC0.L;
   }
   
+  /// Fuse a chain of fusion candidates, creating a new fused loop.
+  ///
+  /// The candidates in \p Chain are unguarded and rotated, and each one is
+  /// adjacent to the next one (see extendFusionChain). The result is the same
+  /// as fusing them pairwise with performFusion, first into second, the fused
+  /// loop into third and so on, but the work of each step that scales with
+  /// the size of the fused loop is done once for the whole chain:
+  ///
+  ///   1. The CFG of all loops is rewired first, the latch of each loop
+  ///   jumping to the header of the next one and the latch of the last loop
+  ///   to the header of the first one. DT and PDT are updated with one batch
+  ///   of updates, which also covers the merging of the latches.
+  ///   2. SE forgets the loops once, instead of forgetting the fused loop
+  ///   again after every step.
+  ///   3. The instructions of the old latches are moved to the new latch once
+  ///   DT is up to date, as mergeLatch does.
+  Loop *performChainFusion(ArrayRef<FusionCandidate> Chain) {
+    assert(Chain.size() > 2 && "Expecting a chain of more than two loops");
+    const FusionCandidate &FC0 = Chain.front();
+    for (const FusionCandidate &FC : Chain) {
+      assert(FC.isValid() && !FC.GuardBranch && FC.ExitingBlock == FC.Latch &&
+             "Expecting valid, unguarded and rotated fusion candidates");
+      FUSION_TRACE(TRACE_FUSION, 2,
+                   (&FC == &FC0 ? "fusing loop " : "  and loop ")
+                       << FC.L->getName() << " with blocks "
+                       << BlockNames{FC.L->getBlocks()});
+    }
+
+    // Move instructions from the preheaders to the end of the preheader of
+    // FC0, and remember the instructions of the latches, which are moved once
+    // the CFG has been rewired.
+    SmallVector<SmallVector<Instruction *, 8>, 4> LatchInsts;
+    for (const FusionCandidate &FC : Chain) {
+      if (&FC != &FC0)
+        moveInstructionsToTheEnd(*FC.Preheader, *FC0.Preheader, DT, PDT, DI);
+      LatchInsts.emplace_back();
+      for (Instruction &I : *FC.Latch)
+        if (!I.isTerminator() && !isa<PHINode>(I))
+          LatchInsts.back().push_back(&I);
+    }
+
+    SmallVector<DominatorTree::UpdateType, 16> TreeUpdates;
+    for (unsigned Idx = 1, E = Chain.size(); Idx < E; ++Idx) {
+      const FusionCandidate &Prev = Chain[Idx - 1];
+      const FusionCandidate &FC = Chain[Idx];
+      assert(FC.Preheader == Prev.ExitBlock && FC.Preheader->size() == 1 &&
+             FC.Preheader->getSingleSuccessor() == FC.Header);
+
+      // The back edge of Prev goes to the header of FC0 at this point, as
+      // the latch of FC0 or of the loop fused last in this chain.
+      FC.Preheader->replaceSuccessorsPhiUsesWith(FC0.Preheader);
+      Prev.Latch->replaceSuccessorsPhiUsesWith(FC.Latch);
+
+      // Both successors of the latch of Prev become the header of FC.
+      Instruction *PrevTerm = Prev.Latch->getTerminator();
+      PrevTerm->replaceUsesOfWith(FC.Preheader, FC.Header);
+      PrevTerm->replaceUsesOfWith(FC0.Header, FC.Header);
+      FC.Latch->getTerminator()->replaceUsesOfWith(FC.Header, FC0.Header);
+      simplifyLatchBranch(Prev);
+
+      // The pre-header of FC is not necessary anymore.
+      assert(pred_empty(FC.Preheader));
+      FC.Preheader->getTerminator()->eraseFromParent();
+      new UnreachableInst(FC.Preheader->getContext(), FC.Preheader);
+
+      // Moves the phi nodes from the header of FC to the header of FC0.
+      while (PHINode *PHI = dyn_cast<PHINode>(&FC.Header->front())) {
+        if (SE.isSCEVable(PHI->getType()))
+          SE.forgetValue(PHI);
+        if (PHI->hasNUsesOrMore(1))
+          PHI->moveBefore(&*FC0.Header->getFirstInsertionPt());
+        else
+          PHI->eraseFromParent();
+      }
+
+      // The updates are relative to the CFG before the chain was fused.
+      TreeUpdates.emplace_back(DominatorTree::UpdateType(
+          DominatorTree::Delete, Prev.Latch, Prev.Header));
+      TreeUpdates.emplace_back(DominatorTree::UpdateType(
+          DominatorTree::Delete, Prev.Latch, FC.Preheader));
+      TreeUpdates.emplace_back(DominatorTree::UpdateType(
+          DominatorTree::Insert, Prev.Latch, FC.Header));
+      TreeUpdates.emplace_back(DominatorTree::UpdateType(
+          DominatorTree::Delete, FC.Preheader, FC.Header));
+    }
+    const FusionCandidate &Last = Chain.back();
+    TreeUpdates.emplace_back(DominatorTree::UpdateType(
+        DominatorTree::Delete, Last.Latch, Last.Header));
+    TreeUpdates.emplace_back(DominatorTree::UpdateType(
+        DominatorTree::Insert, Last.Latch, FC0.Header));
+    DTU.applyUpdates(TreeUpdates);
+
+    for (const FusionCandidate &FC : drop_begin(Chain)) {
+      LI.removeBlock(FC.Preheader);
+      DTU.deleteBB(FC.Preheader);
+    }
+
+    // Need to forget the loops before merging the latches, as merging may
+    // remove the only block of a loop.
+    for (const FusionCandidate &FC : Chain)
+      SE.forgetLoop(FC.L);
+
+    // Merge the header of each loop into the latch of the loop before it; the
+    // updates go into the same batch.
+    for (const FusionCandidate &FC : drop_begin(Chain))
+      MergeBlockIntoPredecessor(FC.Header, &DTU, &LI);
+    DTU.flush();
+
+    // Merge the loops.
+    for (const FusionCandidate &FC : drop_begin(Chain)) {
+      SmallVector<BasicBlock *, 8> Blocks(FC.L->blocks());
+      for (BasicBlock *BB : Blocks) {
+        FC0.L->addBlockEntry(BB);
+        FC.L->removeBlockFromLoop(BB);
+        if (LI.getLoopFor(BB) != FC.L)
+          continue;
+        LI.changeLoopFor(BB, FC0.L);
+      }
+      while (!FC.L->isInnermost()) {
+        const auto &ChildLoopIt = FC.L->begin();
+        Loop *ChildLoop = *ChildLoopIt;
+        FC.L->removeChildLoop(ChildLoopIt);
+        FC0.L->addChildLoop(ChildLoop);
+      }
+      LI.erase(FC.L);
+    }
+
+    // Move the instructions of the old latches to the beginning of the new
+    // one, keeping their order, as pairwise fusion would.
+    BasicBlock *Latch = FC0.L->getLoopLatch();
+    for (auto &Insts : reverse(LatchInsts))
+      for (Instruction *I : reverse(Insts)) {
+        if (I->getParent() == Latch)
+          continue;
+        Instruction *MovePos = Latch->getFirstNonPHIOrDbg();
+        if (isSafeToMoveBefore(*I, *MovePos, DT, &PDT, &DI))
+          I->moveBefore(MovePos);
+      }
+
+#ifndef NDEBUG
+    assert(!verifyFunction(*FC0.Header->getParent(), &errs()));
+    assert(DT.verify(DominatorTree::VerificationLevel::Fast));
+    assert(PDT.verify());
+    LI.verify(DT);
+    SE.verify();
+#endif
+
+    LLVM_DEBUG(dbgs() << "Chain fusion done:\n");
+
+    return FC0.L;
+  }
+
   /// Report details on loop fusion opportunities.
   ///
   /// This template function can be used to report both successful and missed
@@ -1769,6 +6098,10 @@ private:
     assert(FC0.Preheader && FC1.Preheader &&
             "Expecting valid fusion candidates");
     using namespace ore;
+    FUSION_TRACE(TRACE_FUSION, 1,
+                 "loops " << FC0.L->getName() << " and " << FC1.L->getName()
+                          << " in " << FC0.Preheader->getParent()->getName()
+                          << ": " << getTraceReason(Stat));
 #if LLVM_ENABLE_STATS
     ++Stat;
     ORE.emit(RemarkKind(DEBUG_TYPE, Stat.getName(), FC0.L->getStartLoc(),
@@ -2070,7 +6403,6 @@ struct LoopFuseLegacy : public FunctionPass {
   }
   
   bool runOnFunction(Function &F) override {
-    errs() << "...STARTING...\n";
     if (skipFunction(F))
       return false;
     auto &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
@@ -2085,14 +6417,12 @@ struct LoopFuseLegacy : public FunctionPass {
     const DataLayout &DL = F.getParent()->getDataLayout();
   
     LoopFuser LF(LI, DT, DI, SE, PDT, ORE, DL, AC, TTI);
-    errs() << "right before 'LF.fuseLoops(F)'\n";
-    return LF.prepass(F);
+    return LF.run(F);
   }
 };
 } // namespace
   
 PreservedAnalyses LoopFusePass::run(Function &F, FunctionAnalysisManager &AM) {
-  errs() << "...STARTING2...\n";
   auto &LI = AM.getResult<LoopAnalysis>(F);
   auto &DT = AM.getResult<DominatorTreeAnalysis>(F);
   auto &DI = AM.getResult<DependenceAnalysis>(F);
@@ -2104,7 +6434,7 @@ PreservedAnalyses LoopFusePass::run(Function &F, FunctionAnalysisManager &AM) {
   const DataLayout &DL = F.getParent()->getDataLayout();
   
   LoopFuser LF(LI, DT, DI, SE, PDT, ORE, DL, AC, TTI);
-  bool Changed = LF.fuseLoops(F);
+  bool Changed = LF.run(F);
   if (!Changed)
     return PreservedAnalyses::all();
   
@@ -0,0 +1,58 @@
+#!/bin/bash
+# Usage: compile_time.sh [SITES...]
+# Compile-time benchmark for the prepass. For every count in SITES (default:
+# 10 100 1000 10000) generates a benchmark5.c style function with that many
+# for-if-for sites and reports the time spent in -loopfuseprepass, in total
+# and per site. The per-site time should stay flat as the count grows.
+
+PATH2LIB=../build/LoopFusePrePass/LLVMHW2.so   # Specify your build directory in the project
+SITES=${*:-10 100 1000 10000}
+
+# Print a function with $1 for-if-for sites.
+gen_sites() {
+  echo "#include <stdio.h>"
+  echo ""
+  echo "int foo[100];"
+  echo "int foobar[100];"
+  echo ""
+  echo "int main(int argc, char **argv){"
+  echo "    int a = argc + 1;"
+  for ((n = 0; n < $1; n++)); do
+    echo "    for(int i = 0; i < 100; i++){"
+    echo "        foo[i] = i + $n;"
+    echo "    }"
+    echo "    if (a == 2) {"
+    echo "        for(int i = 0; i < 100; i++){"
+    echo "            foobar[i] += foo[i];"
+    echo "        }"
+    echo "    }"
+  done
+  echo "    printf(\"%d\\n\", foobar[99]);"
+  echo "    return 0;"
+  echo "}"
+}
+
+now_ns() { date +%s%N; }
+
+printf "%8s %12s %14s\n" "sites" "total (ms)" "per site (us)"
+for N in $SITES; do
+  gen_sites $N > compile_time_${N}.c
+  clang -Xclang -disable-O0-optnone -emit-llvm -c compile_time_${N}.c -o compile_time_${N}.bc
+
+  # Subtract the cost of reading and writing the module and of the analyses
+  # the pass requires, so that only the prepass itself is measured.
+  START=$(now_ns)
+  opt -loop-simplify -domtree -postdomtree -scalar-evolution -da -opt-remark-emitter \
+      < compile_time_${N}.bc > /dev/null
+  BASE=$(( $(now_ns) - START ))
+
+  START=$(now_ns)
+  opt -load ${PATH2LIB} -loopfuseprepass -loop-fusion-prepass-only-proj \
+      < compile_time_${N}.bc > /dev/null 2> /dev/null
+  TOTAL=$(( $(now_ns) - START - BASE ))
+
+  printf "%8d %12d %14d\n" $N $(( TOTAL / 1000000 )) $(( TOTAL / 1000 / N ))
+done
+
+# Cleanup
+rm -f compile_time_*.c compile_time_*.bc
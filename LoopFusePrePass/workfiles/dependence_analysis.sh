@@ -0,0 +1,85 @@
+#!/bin/bash
+# Usage: dependence_analysis.sh [COPIES]
+# Benchmark for the dependence analyses of loop fusion. Generates a file with
+# COPIES (default: 100) copies of a set of loop pairs with different kinds of
+# dependences between them and reports, for each choice of
+# -loop-fusion-dependence-analysis-proj, how many pairs were fused and the
+# time spent in -loopfuseprepass. Pairs marked "no" below must never fuse.
+
+PATH2LIB=../build/LoopFusePrePass/LLVMHW2.so   # Specify your build directory in the project
+COPIES=${1:-100}
+
+# Print the loop pairs of copy $1, each one in a function of its own.
+gen_kernels() {
+  echo "int a$1[1024], b$1[1024], c$1[66][66], d$1[66][66];"
+  echo ""
+  echo "void same$1() {     /* a[i] then a[i]: fuse */"
+  echo "    for (int i = 0; i < 1000; i++) a$1[i] = i;"
+  echo "    for (int i = 0; i < 1000; i++) b$1[i] = a$1[i];"
+  echo "}"
+  echo "void forward$1() {  /* a[i] then a[i - 1]: fuse */"
+  echo "    for (int i = 1; i < 1000; i++) a$1[i] = i;"
+  echo "    for (int i = 1; i < 1000; i++) b$1[i] = a$1[i - 1];"
+  echo "}"
+  echo "void backward$1() { /* a[i] then a[i + 1]: no */"
+  echo "    for (int i = 0; i < 1000; i++) a$1[i] = i;"
+  echo "    for (int i = 0; i < 1000; i++) b$1[i] = a$1[i + 1];"
+  echo "}"
+  echo "void strided$1() {  /* a[2i] then a[2i + 1], GCD: fuse */"
+  echo "    for (int i = 0; i < 500; i++) a$1[2 * i] = i;"
+  echo "    for (int i = 0; i < 500; i++) b$1[i] = a$1[2 * i + 1];"
+  echo "}"
+  echo "void halves$1() {   /* a[i] then a[i + 500], bounds: fuse */"
+  echo "    for (int i = 0; i < 500; i++) a$1[i] = i;"
+  echo "    for (int i = 0; i < 500; i++) b$1[i] = a$1[i + 500];"
+  echo "}"
+  echo "void rows$1() {     /* c[t][j] then c[t + 1][j]: fuse */"
+  echo "    for (int t = 0; t < 64; t++) {"
+  echo "        for (int j = 0; j < 64; j++) c$1[t][j] = t + j;"
+  echo "        for (int j = 0; j < 64; j++) d$1[t][j] = c$1[t + 1][j];"
+  echo "    }"
+  echo "}"
+  echo "void columns$1() {  /* c[j + 1][t] then c[j][t]: fuse */"
+  echo "    for (int t = 0; t < 64; t++) {"
+  echo "        for (int j = 0; j < 64; j++) c$1[j + 1][t] = t + j;"
+  echo "        for (int j = 0; j < 64; j++) d$1[j][t] = c$1[j][t];"
+  echo "    }"
+  echo "}"
+  echo "void stencil$1() {  /* c[t][j] then c[t][j + 1]: no */"
+  echo "    for (int t = 0; t < 64; t++) {"
+  echo "        for (int j = 0; j < 64; j++) c$1[t][j] = t + j;"
+  echo "        for (int j = 0; j < 64; j++) d$1[t][j] = c$1[t][j + 1];"
+  echo "    }"
+  echo "}"
+  echo "void vrows$1(int n, int m, int (*restrict e)[m], int (*restrict f)[m]) {"
+  echo "                    /* e[t][j] then e[t + 1][j], runtime rows: fuse */"
+  echo "    for (int t = 0; t < n - 1; t++) {"
+  echo "        for (int j = 0; j < m; j++) e[t][j] = t + j;"
+  echo "        for (int j = 0; j < m; j++) f[t][j] = e[t + 1][j];"
+  echo "    }"
+  echo "}"
+  echo ""
+}
+
+now_ns() { date +%s%N; }
+
+for ((n = 0; n < COPIES; n++)); do
+  gen_kernels $n
+done > dependence_analysis.c
+echo "int main() { return 0; }" >> dependence_analysis.c
+clang -Xclang -disable-O0-optnone -emit-llvm -c dependence_analysis.c -o dependence_analysis.bc
+
+printf "%8s %8s %10s %12s\n" "analysis" "fused" "of pairs" "time (ms)"
+for DA in scev da affine all; do
+  START=$(now_ns)
+  FUSED=$(opt -load ${PATH2LIB} -loopfuseprepass \
+              -loop-fusion-dependence-analysis-proj=$DA \
+              -loop-fusion-trace-proj=fusion -loop-fusion-trace-level-proj=2 \
+              < dependence_analysis.bc 2>&1 > /dev/null |
+          grep -c "^\[fusion\]   and loop ")
+  TOTAL=$(( $(now_ns) - START ))
+  printf "%8s %8d %10d %12d\n" $DA $FUSED $(( 9 * COPIES )) $(( TOTAL / 1000000 ))
+done
+
+# Cleanup
+rm -f dependence_analysis.c dependence_analysis.bc
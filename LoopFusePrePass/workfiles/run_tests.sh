@@ -0,0 +1,54 @@
+#!/bin/bash
+# Usage: run_tests.sh [TESTS...]
+# Regression tests for the prepass and loop fusion. Every test in tests/ (or
+# every given TEST) is run through -loopfuseprepass, on its own and with
+# -loop-fusion-prepass-only-proj. The output has to verify and print the same
+# as the input under lli, and the number of loop pairs fused has to match the
+# "; CHECK-FUSED: N" line of the test. Fusions are counted in the trace, which
+# unlike the remarks does not depend on statistics being enabled, leaving out
+# those of rounds that were rolled back.
+#
+# A test may also give extra opt flags for both runs on a "; RUN-FLAGS: ..."
+# line, and patterns that the output of the default run has to contain, one
+# per "; CHECK-IR: PATTERN" line, matched with grep against its llvm-dis
+# output.
+
+PATH2LIB=../build/LoopFusePrePass/LLVMHW2.so   # Specify your build directory in the project
+TESTS=${*:-tests/*.ll}
+
+FAILED=0
+for TEST in $TESTS; do
+  EXPECTED=$(sed -n 's/^; CHECK-FUSED: *//p' $TEST)
+  FLAGS=$(sed -n 's/^; RUN-FLAGS: *//p' $TEST)
+  REFERENCE=$(lli $TEST 2>&1)
+  for MODE in "" -loop-fusion-prepass-only-proj; do
+    RESULT=PASS
+    FUSED=$(opt -load ${PATH2LIB} -loopfuseprepass ${MODE} ${FLAGS} \
+                -loop-fusion-trace-proj=fusion -loop-fusion-trace-level-proj=2 \
+                $TEST -o run_tests.bc 2>&1 |
+            awk '/^\[fusion\] round on .* rolled back$/ { Round = 0; next }
+                 /^\[fusion\] round on / { Fused += Round; Round = 0 }
+                 /^\[fusion\]   and loop / { Round++ }
+                 END { print Fused + Round }')
+    if ! opt -verify run_tests.bc -o /dev/null 2> /dev/null; then
+      RESULT="FAIL (invalid IR)"
+    elif [ "$(lli run_tests.bc 2>&1)" != "$REFERENCE" ]; then
+      RESULT="FAIL (output differs)"
+    elif [ -z "$MODE" ] && [ "$FUSED" != "$EXPECTED" ]; then
+      RESULT="FAIL (fused $FUSED, expected $EXPECTED)"
+    elif [ -z "$MODE" ]; then
+      while read -r PATTERN; do
+        if ! llvm-dis run_tests.bc -o - | grep -q -e "$PATTERN"; then
+          RESULT="FAIL (no match for $PATTERN)"
+          break
+        fi
+      done < <(sed -n 's/^; CHECK-IR: *//p' $TEST)
+    fi
+    [ "$RESULT" == PASS ] || FAILED=$(( FAILED + 1 ))
+    printf "%-40s %-32s %s\n" $TEST "${MODE:-default}" "$RESULT"
+  done
+done
+
+# Cleanup
+rm -f run_tests.bc
+exit $(( FAILED != 0 ))
@@ -0,0 +1,84 @@
+; Two loops under the same guard, separated by an empty forwarding block,
+; where the second loop reads what the next iteration of the first one
+; writes. Moving the block out of the way and aligning the loops by one
+; iteration fuses them.
+; CHECK-FUSED: 1
+
+@.fmt = private unnamed_addr constant [4 x i8] c"%d\0A\00", align 1
+
+define void @f(i32 %c, i32* noalias %a, i32* noalias %b) {
+entry:
+  %tobool = icmp ne i32 %c, 0
+  br i1 %tobool, label %for.cond, label %if.end
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.inc ]
+  %cmp = icmp slt i32 %i, 100
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %add = add nsw i32 %i, 7
+  %arrayidx = getelementptr inbounds i32, i32* %a, i32 %i
+  store i32 %add, i32* %arrayidx, align 4
+  br label %for.inc
+
+for.inc:
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  br label %if.end
+
+if.end:
+  br label %forward
+
+forward:
+  br label %if.cond1
+
+if.cond1:
+  %tobool1 = icmp ne i32 %c, 0
+  br i1 %tobool1, label %for.cond1, label %if.end1
+
+for.cond1:
+  %j = phi i32 [ 0, %if.cond1 ], [ %j.next, %for.inc1 ]
+  %cmp1 = icmp slt i32 %j, 100
+  br i1 %cmp1, label %for.body1, label %for.end1
+
+for.body1:
+  %add1 = add nsw i32 %j, 1
+  %arrayidx1 = getelementptr inbounds i32, i32* %a, i32 %add1
+  %0 = load i32, i32* %arrayidx1, align 4
+  %arrayidx2 = getelementptr inbounds i32, i32* %b, i32 %j
+  store i32 %0, i32* %arrayidx2, align 4
+  br label %for.inc1
+
+for.inc1:
+  %j.next = add nsw i32 %j, 1
+  br label %for.cond1
+
+for.end1:
+  br label %if.end1
+
+if.end1:
+  ret void
+}
+
+define i32 @main() {
+entry:
+  %a = alloca [101 x i32], align 16
+  %b = alloca [100 x i32], align 16
+  %ap = getelementptr inbounds [101 x i32], [101 x i32]* %a, i64 0, i64 0
+  %bp = getelementptr inbounds [100 x i32], [100 x i32]* %b, i64 0, i64 0
+  %last = getelementptr inbounds [101 x i32], [101 x i32]* %a, i64 0, i64 100
+  store i32 3, i32* %last, align 4
+  call void @f(i32 1, i32* %ap, i32* %bp)
+  %arrayidx = getelementptr inbounds [100 x i32], [100 x i32]* %b, i64 0, i64 98
+  %0 = load i32, i32* %arrayidx, align 4
+  %arrayidx1 = getelementptr inbounds [100 x i32], [100 x i32]* %b, i64 0, i64 99
+  %1 = load i32, i32* %arrayidx1, align 4
+  %sum = add nsw i32 %0, %1
+  %call = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %sum)
+  ret i32 0
+}
+
+declare i32 @printf(i8*, ...)
@@ -0,0 +1,152 @@
+; Two inner loops in the same outer loop over the rows of 16-column arrays,
+; fused with the dependence analysis set to da. The second loop reads row
+; i - 1 of a, which the first loop wrote in an earlier iteration of the outer
+; loop. DA reports '<' for the outer loop, so the dependence is kept by
+; fusion whatever the inner loops do, and they are fused.
+; RUN-FLAGS: -loop-fusion-dependence-analysis-proj=da
+; CHECK-FUSED: 1
+
+@.fmt = private unnamed_addr constant [4 x i8] c"%d\0A\00", align 1
+
+define void @f(i32* noalias %a, i32* noalias %b, i32 %n) {
+entry:
+  %a2 = bitcast i32* %a to [16 x i32]*
+  %b2 = bitcast i32* %b to [16 x i32]*
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 1, %entry ], [ %i.next, %for.inc ]
+  %cmp = icmp slt i32 %i, %n
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %idxprom.i = sext i32 %i to i64
+  %sub.i = sub nsw i32 %i, 1
+  %idxprom.i1 = sext i32 %sub.i to i64
+  br label %for.cond1
+
+for.cond1:
+  %j = phi i32 [ 0, %for.body ], [ %j.next, %for.inc1 ]
+  %cmp1 = icmp slt i32 %j, 15
+  br i1 %cmp1, label %for.body1, label %for.end1
+
+for.body1:
+  %idxprom.j = sext i32 %j to i64
+  %mul = mul nsw i32 %i, %j
+  %arrayidx = getelementptr inbounds [16 x i32], [16 x i32]* %a2, i64 %idxprom.i, i64 %idxprom.j
+  store i32 %mul, i32* %arrayidx, align 4
+  br label %for.inc1
+
+for.inc1:
+  %j.next = add nsw i32 %j, 1
+  br label %for.cond1
+
+for.end1:
+  br label %for.cond2
+
+for.cond2:
+  %k = phi i32 [ 0, %for.end1 ], [ %k.next, %for.inc2 ]
+  %cmp2 = icmp slt i32 %k, 15
+  br i1 %cmp2, label %for.body2, label %for.end2
+
+for.body2:
+  %idxprom.k = sext i32 %k to i64
+  %idxprom.k1 = sext i32 %k to i64
+  %arrayidx2 = getelementptr inbounds [16 x i32], [16 x i32]* %a2, i64 %idxprom.i1, i64 %idxprom.k1
+  %0 = load i32, i32* %arrayidx2, align 4
+  %add = add nsw i32 %0, 1
+  %arrayidx3 = getelementptr inbounds [16 x i32], [16 x i32]* %b2, i64 %idxprom.i, i64 %idxprom.k
+  store i32 %add, i32* %arrayidx3, align 4
+  br label %for.inc2
+
+for.inc2:
+  %k.next = add nsw i32 %k, 1
+  br label %for.cond2
+
+for.end2:
+  br label %for.inc
+
+for.inc:
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+define void @init(i32* %p, i32 %seed) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %cmp = icmp slt i32 %i, 128
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %mul = mul nsw i32 %i, %seed
+  %rem = srem i32 %mul, 97
+  %idxprom = sext i32 %i to i64
+  %arrayidx = getelementptr inbounds i32, i32* %p, i64 %idxprom
+  store i32 %rem, i32* %arrayidx, align 4
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+define i32 @sum(i32* %p) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %for.body ]
+  %cmp = icmp slt i32 %i, 128
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %idxprom = sext i32 %i to i64
+  %arrayidx = getelementptr inbounds i32, i32* %p, i64 %idxprom
+  %0 = load i32, i32* %arrayidx, align 4
+  %mul = mul nsw i32 %s, 31
+  %s.next = add nsw i32 %mul, %0
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret i32 %s
+}
+
+define i32 @main() {
+entry:
+  %a.arr = alloca [128 x i32], align 16
+  %b.arr = alloca [128 x i32], align 16
+  %a = getelementptr inbounds [128 x i32], [128 x i32]* %a.arr, i64 0, i64 0
+  %b = getelementptr inbounds [128 x i32], [128 x i32]* %b.arr, i64 0, i64 0
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @f(i32* %a, i32* %b, i32 8)
+  %a.sum0 = call i32 @sum(i32* %a)
+  %a.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum0)
+  %b.sum0 = call i32 @sum(i32* %b)
+  %b.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum0)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @f(i32* %a, i32* %b, i32 2)
+  %a.sum1 = call i32 @sum(i32* %a)
+  %a.call1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum1)
+  %b.sum1 = call i32 @sum(i32* %b)
+  %b.call1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum1)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @f(i32* %a, i32* %b, i32 0)
+  %a.sum2 = call i32 @sum(i32* %a)
+  %a.call2 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum2)
+  %b.sum2 = call i32 @sum(i32* %b)
+  %b.call2 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum2)
+  ret i32 0
+}
+
+declare i32 @printf(i8*, ...)
@@ -0,0 +1,154 @@
+; Three adjacent loops with the same constant trip count. The third loop reads
+; a[99 - k], which the first loop writes in a later iteration, so it cannot
+; join the chain of the first two, although it could be fused with the second
+; one alone. Only the first two loops are fused.
+; CHECK-FUSED: 1
+
+@.fmt = private unnamed_addr constant [4 x i8] c"%d\0A\00", align 1
+
+define void @f(i32* noalias %a, i32* noalias %b, i32* noalias %c) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.inc ]
+  %cmp = icmp slt i32 %i, 100
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %idxprom.0 = sext i32 %i to i64
+  %arrayidx.0 = getelementptr inbounds i32, i32* %b, i64 %idxprom.0
+  %0 = load i32, i32* %arrayidx.0, align 4
+  %add = add nsw i32 %0, 1
+  %idxprom.a = sext i32 %i to i64
+  %arrayidx.a = getelementptr inbounds i32, i32* %a, i64 %idxprom.a
+  store i32 %add, i32* %arrayidx.a, align 4
+  br label %for.inc
+
+for.inc:
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  br label %for.cond1
+
+for.cond1:
+  %j = phi i32 [ 0, %for.end ], [ %j.next, %for.inc1 ]
+  %cmp1 = icmp slt i32 %j, 100
+  br i1 %cmp1, label %for.body1, label %for.end1
+
+for.body1:
+  %idxprom.1 = sext i32 %j to i64
+  %arrayidx.1 = getelementptr inbounds i32, i32* %a, i64 %idxprom.1
+  %1 = load i32, i32* %arrayidx.1, align 4
+  %mul = mul nsw i32 %1, 2
+  %idxprom.c = sext i32 %j to i64
+  %arrayidx.c = getelementptr inbounds i32, i32* %c, i64 %idxprom.c
+  store i32 %mul, i32* %arrayidx.c, align 4
+  br label %for.inc1
+
+for.inc1:
+  %j.next = add nsw i32 %j, 1
+  br label %for.cond1
+
+for.end1:
+  br label %for.cond2
+
+for.cond2:
+  %k = phi i32 [ 0, %for.end1 ], [ %k.next, %for.inc2 ]
+  %cmp2 = icmp slt i32 %k, 100
+  br i1 %cmp2, label %for.body2, label %for.end2
+
+for.body2:
+  %sub = sub nsw i32 100, %k
+  %sub1 = sub nsw i32 %sub, 1
+  %idxprom.2 = sext i32 %k to i64
+  %arrayidx.2 = getelementptr inbounds i32, i32* %c, i64 %idxprom.2
+  %2 = load i32, i32* %arrayidx.2, align 4
+  %idxprom.3 = sext i32 %sub1 to i64
+  %arrayidx.3 = getelementptr inbounds i32, i32* %a, i64 %idxprom.3
+  %3 = load i32, i32* %arrayidx.3, align 4
+  %add2 = add nsw i32 %2, %3
+  %idxprom.b = sext i32 %k to i64
+  %arrayidx.b = getelementptr inbounds i32, i32* %b, i64 %idxprom.b
+  store i32 %add2, i32* %arrayidx.b, align 4
+  br label %for.inc2
+
+for.inc2:
+  %k.next = add nsw i32 %k, 1
+  br label %for.cond2
+
+for.end2:
+  br label %return
+
+return:
+  ret void
+}
+
+define void @init(i32* %p, i32 %seed) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %cmp = icmp slt i32 %i, 128
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %mul = mul nsw i32 %i, %seed
+  %rem = srem i32 %mul, 97
+  %idxprom = sext i32 %i to i64
+  %arrayidx = getelementptr inbounds i32, i32* %p, i64 %idxprom
+  store i32 %rem, i32* %arrayidx, align 4
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+define i32 @sum(i32* %p) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %for.body ]
+  %cmp = icmp slt i32 %i, 128
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %idxprom = sext i32 %i to i64
+  %arrayidx = getelementptr inbounds i32, i32* %p, i64 %idxprom
+  %0 = load i32, i32* %arrayidx, align 4
+  %mul = mul nsw i32 %s, 31
+  %s.next = add nsw i32 %mul, %0
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret i32 %s
+}
+
+define i32 @main() {
+entry:
+  %a.arr = alloca [128 x i32], align 16
+  %b.arr = alloca [128 x i32], align 16
+  %c.arr = alloca [128 x i32], align 16
+  %a = getelementptr inbounds [128 x i32], [128 x i32]* %a.arr, i64 0, i64 0
+  %b = getelementptr inbounds [128 x i32], [128 x i32]* %b.arr, i64 0, i64 0
+  %c = getelementptr inbounds [128 x i32], [128 x i32]* %c.arr, i64 0, i64 0
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @init(i32* %c, i32 7)
+  call void @f(i32* %a, i32* %b, i32* %c)
+  %a.sum0 = call i32 @sum(i32* %a)
+  %a.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum0)
+  %b.sum0 = call i32 @sum(i32* %b)
+  %b.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum0)
+  %c.sum0 = call i32 @sum(i32* %c)
+  %c.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %c.sum0)
+  ret i32 0
+}
+
+declare i32 @printf(i8*, ...)
@@ -0,0 +1,70 @@
+; for-if-for site whose second loop divides by the guarded value in its
+; preheader. Sinking the guard would divide by zero when k is 0.
+; CHECK-FUSED: 0
+
+@.fmt = private unnamed_addr constant [4 x i8] c"%d\0A\00", align 1
+
+define void @f(i32 %n, i32 %k, i32* noalias %a, i32* noalias %b) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.inc ]
+  %cmp = icmp slt i32 %i, %n
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %arrayidx = getelementptr inbounds i32, i32* %a, i32 %i
+  store i32 %i, i32* %arrayidx, align 4
+  br label %for.inc
+
+for.inc:
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  %tobool = icmp ne i32 %k, 0
+  br i1 %tobool, label %if.then, label %if.end
+
+if.then:
+  %div = sdiv i32 %n, %k
+  br label %for.cond1
+
+for.cond1:
+  %j = phi i32 [ 0, %if.then ], [ %j.next, %for.inc1 ]
+  %cmp1 = icmp slt i32 %j, %n
+  br i1 %cmp1, label %for.body1, label %for.end1
+
+for.body1:
+  %arrayidx1 = getelementptr inbounds i32, i32* %a, i32 %j
+  %0 = load i32, i32* %arrayidx1, align 4
+  %add = add nsw i32 %0, %div
+  %arrayidx2 = getelementptr inbounds i32, i32* %b, i32 %j
+  store i32 %add, i32* %arrayidx2, align 4
+  br label %for.inc1
+
+for.inc1:
+  %j.next = add nsw i32 %j, 1
+  br label %for.cond1
+
+for.end1:
+  br label %if.end
+
+if.end:
+  ret void
+}
+
+define i32 @main() {
+entry:
+  %a = alloca [100 x i32], align 16
+  %b = alloca [100 x i32], align 16
+  %ap = getelementptr inbounds [100 x i32], [100 x i32]* %a, i64 0, i64 0
+  %bp = getelementptr inbounds [100 x i32], [100 x i32]* %b, i64 0, i64 0
+  store i32 7, i32* %bp, align 4
+  call void @f(i32 100, i32 0, i32* %ap, i32* %bp)
+  %0 = load i32, i32* %bp, align 4
+  %call = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %0)
+  ret i32 0
+}
+
+declare i32 @printf(i8*, ...)
@@ -0,0 +1,96 @@
+; for-if-for site over global arrays whose guard is loop invariant but not
+; known at compile time. With -loop-fusion-if-convert-guards-proj the guard
+; that ends up inside the fused loop is if-converted, the store of the
+; guarded body becoming a store of a select.
+; RUN-FLAGS: -loop-fusion-if-convert-guards-proj
+; CHECK-FUSED: 1
+; CHECK-IR: select i1
+
+@a = global [100 x i32] zeroinitializer, align 16
+@b = global [100 x i32] zeroinitializer, align 16
+@.fmt = private unnamed_addr constant [4 x i8] c"%d\0A\00", align 1
+
+define void @f(i32 %k) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %for.inc ]
+  %cmp = icmp slt i64 %i, 100
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %i.trunc = trunc i64 %i to i32
+  %arrayidx = getelementptr inbounds [100 x i32], [100 x i32]* @a, i64 0, i64 %i
+  store i32 %i.trunc, i32* %arrayidx, align 4
+  br label %for.inc
+
+for.inc:
+  %i.next = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  %tobool = icmp eq i32 %k, 2
+  br i1 %tobool, label %for.cond1, label %if.end
+
+for.cond1:
+  %j = phi i64 [ 0, %for.end ], [ %j.next, %for.inc1 ]
+  %cmp1 = icmp slt i64 %j, 100
+  br i1 %cmp1, label %for.body1, label %for.end1
+
+for.body1:
+  %arrayidx1 = getelementptr inbounds [100 x i32], [100 x i32]* @a, i64 0, i64 %j
+  %0 = load i32, i32* %arrayidx1, align 4
+  %mul = mul nsw i32 %0, 3
+  %arrayidx2 = getelementptr inbounds [100 x i32], [100 x i32]* @b, i64 0, i64 %j
+  %1 = load i32, i32* %arrayidx2, align 4
+  %add = add nsw i32 %mul, %1
+  store i32 %add, i32* %arrayidx2, align 4
+  br label %for.inc1
+
+for.inc1:
+  %j.next = add nsw i64 %j, 1
+  br label %for.cond1
+
+for.end1:
+  br label %if.end
+
+if.end:
+  ret void
+}
+
+define i32 @sum() {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %for.body ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %for.body ]
+  %cmp = icmp slt i64 %i, 100
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %arrayidx = getelementptr inbounds [100 x i32], [100 x i32]* @b, i64 0, i64 %i
+  %0 = load i32, i32* %arrayidx, align 4
+  %mul = mul nsw i32 %s, 31
+  %s.next = add nsw i32 %mul, %0
+  %i.next = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret i32 %s
+}
+
+define i32 @main() {
+entry:
+  store i32 7, i32* getelementptr inbounds ([100 x i32], [100 x i32]* @b, i64 0, i64 5), align 4
+  call void @f(i32 3)
+  %0 = call i32 @sum()
+  %call = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %0)
+  call void @f(i32 2)
+  %1 = call i32 @sum()
+  %call1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %1)
+  ret i32 0
+}
+
+declare i32 @printf(i8*, ...)
@@ -0,0 +1,172 @@
+; Two regions guarded by x == 2, each holding a loop, with statements in
+; between: c[0] = c[1] + 5 is hoisted above the first region, and c[2] = a[3],
+; which reads what the first loop writes, is sunk below the second one. The
+; regions are merged, and the loops in them fused. @f is run with x == 2 and
+; x != 2.
+; CHECK-FUSED: 1
+
+@.fmt = private unnamed_addr constant [4 x i8] c"%d\0A\00", align 1
+
+define void @f(i32* noalias %a, i32* noalias %b, i32* noalias %c, i32 %x, i32 %n) {
+entry:
+  %cmp.x = icmp eq i32 %x, 2
+  br i1 %cmp.x, label %for.cond, label %if.end
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.inc ]
+  %cmp = icmp slt i32 %i, %n
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %idxprom.0 = sext i32 %i to i64
+  %arrayidx.0 = getelementptr inbounds i32, i32* %b, i64 %idxprom.0
+  %0 = load i32, i32* %arrayidx.0, align 4
+  %add = add nsw i32 %0, 1
+  %idxprom.a = sext i32 %i to i64
+  %arrayidx.a = getelementptr inbounds i32, i32* %a, i64 %idxprom.a
+  store i32 %add, i32* %arrayidx.a, align 4
+  br label %for.inc
+
+for.inc:
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  br label %if.end
+
+if.end:
+  %arrayidx.c1 = getelementptr inbounds i32, i32* %c, i64 1
+  %c1.val = load i32, i32* %arrayidx.c1, align 4
+  %add.c = add nsw i32 %c1.val, 5
+  store i32 %add.c, i32* %c, align 4
+  %arrayidx.a3 = getelementptr inbounds i32, i32* %a, i64 3
+  %a3.val = load i32, i32* %arrayidx.a3, align 4
+  %arrayidx.c2 = getelementptr inbounds i32, i32* %c, i64 2
+  store i32 %a3.val, i32* %arrayidx.c2, align 4
+  %cmp.x1 = icmp eq i32 %x, 2
+  br i1 %cmp.x1, label %for.cond1, label %if.end1
+
+for.cond1:
+  %j = phi i32 [ 0, %if.end ], [ %j.next, %for.inc1 ]
+  %cmp1 = icmp slt i32 %j, %n
+  br i1 %cmp1, label %for.body1, label %for.end1
+
+for.body1:
+  %idxprom.1 = sext i32 %j to i64
+  %arrayidx.1 = getelementptr inbounds i32, i32* %a, i64 %idxprom.1
+  %1 = load i32, i32* %arrayidx.1, align 4
+  %mul = mul nsw i32 %1, 2
+  %idxprom.b = sext i32 %j to i64
+  %arrayidx.b = getelementptr inbounds i32, i32* %b, i64 %idxprom.b
+  store i32 %mul, i32* %arrayidx.b, align 4
+  br label %for.inc1
+
+for.inc1:
+  %j.next = add nsw i32 %j, 1
+  br label %for.cond1
+
+for.end1:
+  br label %if.end1
+
+if.end1:
+  ret void
+}
+
+define void @init(i32* %p, i32 %seed) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %cmp = icmp slt i32 %i, 128
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %mul = mul nsw i32 %i, %seed
+  %rem = srem i32 %mul, 97
+  %idxprom = sext i32 %i to i64
+  %arrayidx = getelementptr inbounds i32, i32* %p, i64 %idxprom
+  store i32 %rem, i32* %arrayidx, align 4
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+define i32 @sum(i32* %p) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %for.body ]
+  %cmp = icmp slt i32 %i, 128
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %idxprom = sext i32 %i to i64
+  %arrayidx = getelementptr inbounds i32, i32* %p, i64 %idxprom
+  %0 = load i32, i32* %arrayidx, align 4
+  %mul = mul nsw i32 %s, 31
+  %s.next = add nsw i32 %mul, %0
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret i32 %s
+}
+
+define i32 @main() {
+entry:
+  %a.arr = alloca [128 x i32], align 16
+  %b.arr = alloca [128 x i32], align 16
+  %c.arr = alloca [128 x i32], align 16
+  %a = getelementptr inbounds [128 x i32], [128 x i32]* %a.arr, i64 0, i64 0
+  %b = getelementptr inbounds [128 x i32], [128 x i32]* %b.arr, i64 0, i64 0
+  %c = getelementptr inbounds [128 x i32], [128 x i32]* %c.arr, i64 0, i64 0
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @init(i32* %c, i32 7)
+  call void @f(i32* %a, i32* %b, i32* %c, i32 2, i32 100)
+  %a.sum0 = call i32 @sum(i32* %a)
+  %a.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum0)
+  %b.sum0 = call i32 @sum(i32* %b)
+  %b.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum0)
+  %c.sum0 = call i32 @sum(i32* %c)
+  %c.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %c.sum0)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @init(i32* %c, i32 7)
+  call void @f(i32* %a, i32* %b, i32* %c, i32 3, i32 100)
+  %a.sum1 = call i32 @sum(i32* %a)
+  %a.call1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum1)
+  %b.sum1 = call i32 @sum(i32* %b)
+  %b.call1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum1)
+  %c.sum1 = call i32 @sum(i32* %c)
+  %c.call1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %c.sum1)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @init(i32* %c, i32 7)
+  call void @f(i32* %a, i32* %b, i32* %c, i32 2, i32 0)
+  %a.sum2 = call i32 @sum(i32* %a)
+  %a.call2 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum2)
+  %b.sum2 = call i32 @sum(i32* %b)
+  %b.call2 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum2)
+  %c.sum2 = call i32 @sum(i32* %c)
+  %c.call2 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %c.sum2)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @init(i32* %c, i32 7)
+  call void @f(i32* %a, i32* %b, i32* %c, i32 2, i32 2)
+  %a.sum3 = call i32 @sum(i32* %a)
+  %a.call3 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum3)
+  %b.sum3 = call i32 @sum(i32* %b)
+  %b.call3 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum3)
+  %c.sum3 = call i32 @sum(i32* %c)
+  %c.call3 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %c.sum3)
+  ret i32 0
+}
+
+declare i32 @printf(i8*, ...)
+
@@ -0,0 +1,184 @@
+; Two loop nests over n x m arrays with a runtime row size m, addressed as
+; a[i * m + j]. The second nest reads a[k][l + 1], which for l = m - 1 is the
+; first element of the next row, written by the first nest in a later
+; iteration of the outer loop. The accesses are not delinearized, and the
+; loops are not fused.
+; CHECK-FUSED: 0
+
+@.fmt = private unnamed_addr constant [4 x i8] c"%d\0A\00", align 1
+
+define void @f(i32* noalias %a, i32* noalias %b, i32 %n, i32 %m) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.inc ]
+  %cmp = icmp slt i32 %i, %n
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %row = mul nsw i32 %i, %m
+  br label %for.cond.in
+
+for.cond.in:
+  %j = phi i32 [ 0, %for.body ], [ %j.next, %for.inc.in ]
+  %cmp.in = icmp slt i32 %j, %m
+  br i1 %cmp.in, label %for.body.in, label %for.end.in
+
+for.body.in:
+  %idx = add nsw i32 %row, %j
+  %idxprom = sext i32 %idx to i64
+  %arrayidx = getelementptr inbounds i32, i32* %a, i64 %idxprom
+  %mul = mul nsw i32 %i, %j
+  store i32 %mul, i32* %arrayidx, align 4
+  br label %for.inc.in
+
+for.inc.in:
+  %j.next = add nsw i32 %j, 1
+  br label %for.cond.in
+
+for.end.in:
+  br label %for.inc
+
+for.inc:
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  br label %for.cond1
+
+for.cond1:
+  %k = phi i32 [ 0, %for.end ], [ %k.next, %for.inc1 ]
+  %cmp1 = icmp slt i32 %k, %n
+  br i1 %cmp1, label %for.body1, label %for.end1
+
+for.body1:
+  %row1 = mul nsw i32 %k, %m
+  br label %for.cond1.in
+
+for.cond1.in:
+  %l = phi i32 [ 0, %for.body1 ], [ %l.next, %for.inc1.in ]
+  %cmp1.in = icmp slt i32 %l, %m
+  br i1 %cmp1.in, label %for.body1.in, label %for.end1.in
+
+for.body1.in:
+  %col = add nsw i32 %l, 1
+  %idx1 = add nsw i32 %row1, %col
+  %idxprom1 = sext i32 %idx1 to i64
+  %arrayidx1 = getelementptr inbounds i32, i32* %a, i64 %idxprom1
+  %0 = load i32, i32* %arrayidx1, align 4
+  %add = add nsw i32 %0, 1
+  %idx2 = add nsw i32 %row1, %l
+  %idxprom2 = sext i32 %idx2 to i64
+  %arrayidx2 = getelementptr inbounds i32, i32* %b, i64 %idxprom2
+  store i32 %add, i32* %arrayidx2, align 4
+  br label %for.inc1.in
+
+for.inc1.in:
+  %l.next = add nsw i32 %l, 1
+  br label %for.cond1.in
+
+for.end1.in:
+  br label %for.inc1
+
+for.inc1:
+  %k.next = add nsw i32 %k, 1
+  br label %for.cond1
+
+for.end1:
+  br label %return
+
+return:
+  ret void
+}
+
+define void @init(i32* %p, i32 %seed) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %cmp = icmp slt i32 %i, 128
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %mul = mul nsw i32 %i, %seed
+  %rem = srem i32 %mul, 97
+  %idxprom = sext i32 %i to i64
+  %arrayidx = getelementptr inbounds i32, i32* %p, i64 %idxprom
+  store i32 %rem, i32* %arrayidx, align 4
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+define i32 @sum(i32* %p) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %for.body ]
+  %cmp = icmp slt i32 %i, 128
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %idxprom = sext i32 %i to i64
+  %arrayidx = getelementptr inbounds i32, i32* %p, i64 %idxprom
+  %0 = load i32, i32* %arrayidx, align 4
+  %mul = mul nsw i32 %s, 31
+  %s.next = add nsw i32 %mul, %0
+  %i.next = add nsw i32 %i, 1
+  br label %for.cond
+
+for.end:
+  ret i32 %s
+}
+
+define i32 @main() {
+entry:
+  %a.arr = alloca [128 x i32], align 16
+  %b.arr = alloca [128 x i32], align 16
+  %a = getelementptr inbounds [128 x i32], [128 x i32]* %a.arr, i64 0, i64 0
+  %b = getelementptr inbounds [128 x i32], [128 x i32]* %b.arr, i64 0, i64 0
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @f(i32* %a, i32* %b, i32 8, i32 16)
+  %a.sum0 = call i32 @sum(i32* %a)
+  %a.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum0)
+  %b.sum0 = call i32 @sum(i32* %b)
+  %b.call0 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum0)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @f(i32* %a, i32* %b, i32 4, i32 5)
+  %a.sum1 = call i32 @sum(i32* %a)
+  %a.call1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum1)
+  %b.sum1 = call i32 @sum(i32* %b)
+  %b.call1 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum1)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @f(i32* %a, i32* %b, i32 1, i32 7)
+  %a.sum2 = call i32 @sum(i32* %a)
+  %a.call2 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum2)
+  %b.sum2 = call i32 @sum(i32* %b)
+  %b.call2 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum2)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @f(i32* %a, i32* %b, i32 0, i32 3)
+  %a.sum3 = call i32 @sum(i32* %a)
+  %a.call3 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum3)
+  %b.sum3 = call i32 @sum(i32* %b)
+  %b.call3 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum3)
+  call void @init(i32* %a, i32 3)
+  call void @init(i32* %b, i32 5)
+  call void @f(i32* %a, i32* %b, i32 3, i32 0)
+  %a.sum4 = call i32 @sum(i32* %a)
+  %a.call4 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %a.sum4)
+  %b.sum4 = call i32 @sum(i32* %b)
+  %b.call4 = call i32 (i8*, ...) @printf(i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.fmt, i64 0, i64 0), i32 %b.sum4)
+  ret i32 0
+}
+
+declare i32 @printf(i8*, ...)